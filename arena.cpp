@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+const size_t ARENA_ALIGN = alignof(max_align_t);
+const size_t ARENA_CLASSES = 8;
+
+typedef struct _block
+{
+    struct _block * next;
+    size_t size;
+    size_t used;
+
+} Block;
+
+typedef struct _chunk
+{
+    struct _chunk * next;
+
+} Chunk;
+
+struct _arena
+{
+    Block * head;
+    Chunk * free[ARENA_CLASSES];    // freed small chunks by size / ARENA_ALIGN
+    size_t block_size;              // blocks grow from ARENA_FIRST_BLOCK up to this
+    size_t next_size;
+    size_t used;
+    unsigned int refs;              // trees sharing the arena
+};
+
+static Block * _create_block(size_t size);
+static size_t _align(size_t size);
+
+static size_t _align(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static Block * _create_block(size_t size)
+{
+    // blocks come zeroed, so every bump allocation is zeroed as well
+    Block * block = (Block*) calloc(1, _align(sizeof(Block)) + size);
+    if (!block) return NULL;
+
+    block->size = size;
+    return block;
+}
+
+Arena * CreateArena(size_t block_size)
+{
+    Arena * arena = (Arena*) calloc(1, sizeof(Arena));
+    if (!arena) return NULL;
+
+    arena->block_size = block_size ? _align(block_size) : ARENA_BLOCK_SIZE;
+    arena->next_size = arena->block_size < ARENA_FIRST_BLOCK ? arena->block_size : ARENA_FIRST_BLOCK;
+    arena->refs = 1;
+    return arena;
+}
+
+Arena * RetainArena(Arena * arena)
+{
+    if (arena) arena->refs++;
+    return arena;
+}
+
+int ArenaShared(const Arena * arena)
+{
+    return arena && arena->refs > 1;
+}
+
+// Moves the blocks and free chunks of other into arena and destroys other.
+// Threads allocate from arenas of their own and hand them over at the join.
+int ArenaAdopt(Arena * arena, Arena * other)
+{
+    if (!arena || !other || arena == other || other->refs > 1) return -1;
+
+    if (other->head)
+    {
+        Block * tail = other->head;
+        while (tail->next) tail = tail->next;
+
+        // the current block of arena stays the one bump allocations go to
+        if (arena->head)
+        {
+            tail->next = arena->head->next;
+            arena->head->next = other->head;
+        }
+        else arena->head = other->head;
+    }
+
+    for (size_t cls = 0; cls < ARENA_CLASSES; cls++)
+    {
+        if (!other->free[cls]) continue;
+
+        Chunk * tail = other->free[cls];
+        while (tail->next) tail = tail->next;
+        tail->next = arena->free[cls];
+        arena->free[cls] = other->free[cls];
+    }
+
+    // chunks freed into other may come from arena, only the sum is right
+    arena->used += other->used;
+    free(other);
+    return 0;
+}
+
+void * ArenaAlloc(Arena * arena, size_t size)
+{
+    if (!arena) return NULL;
+    size = _align(size);
+
+    size_t cls = size / ARENA_ALIGN;
+    if (cls < ARENA_CLASSES && arena->free[cls])
+    {
+        Chunk * chunk = arena->free[cls];
+        arena->free[cls] = chunk->next;
+        arena->used += size;
+
+        memset(chunk, 0, size);
+        return chunk;
+    }
+
+    Block * block = arena->head;
+    if (!block || block->size - block->used < size)
+    {
+        // big requests get a block of their own behind the current one,
+        // so the space left in the current block is not thrown away
+        if (size > arena->block_size / 4)
+        {
+            Block * big = _create_block(size);
+            if (!big) return NULL;
+
+            if (block)
+            {
+                big->next = block->next;
+                block->next = big;
+            }
+            else arena->head = big;
+
+            big->used = size;
+            arena->used += size;
+            return (char*) big + _align(sizeof(Block));
+        }
+
+        // small trees stay in a few small blocks, big ones soon get full ones
+        size_t fresh = arena->next_size;
+        while (fresh < size) fresh *= 2;
+        arena->next_size = fresh * 2 < arena->block_size ? fresh * 2 : arena->block_size;
+
+        block = _create_block(fresh);
+        if (!block) return NULL;
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    void * result = (char*) block + _align(sizeof(Block)) + block->used;
+    block->used += size;
+    arena->used += size;
+
+    return result;
+}
+
+// Small chunks go to a free list of their size class and are handed out again
+// by ArenaAlloc, bigger ones stay in the arena until it is destroyed.
+void ArenaFree(Arena * arena, void * ptr, size_t size)
+{
+    if (!arena || !ptr) return;
+    size = _align(size);
+    arena->used -= size;
+
+    size_t cls = size / ARENA_ALIGN;
+    if (cls >= ARENA_CLASSES) return;
+
+    Chunk * chunk = (Chunk*) ptr;
+    chunk->next = arena->free[cls];
+    arena->free[cls] = chunk;
+}
+
+size_t ArenaUsed(const Arena * arena)
+{
+    if (!arena) return 0;
+    return arena->used;
+}
+
+// Drops one reference, the memory is released with the last one.
+void DestroyArena(Arena * arena)
+{
+    if (!arena) return;
+    if (--arena->refs) return;
+
+    Block * block = arena->head;
+    while (block)
+    {
+        Block * next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(arena);
+}
@@ -0,0 +1,27 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct _arena Arena;
+
+const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+const size_t ARENA_FIRST_BLOCK = 1024;
+
+Arena * CreateArena(size_t block_size);
+
+Arena * RetainArena(Arena * arena);
+
+int ArenaShared(const Arena * arena);
+
+int ArenaAdopt(Arena * arena, Arena * other);
+
+void * ArenaAlloc(Arena * arena, size_t size);
+
+void ArenaFree(Arena * arena, void * ptr, size_t size);
+
+size_t ArenaUsed(const Arena * arena);
+
+void DestroyArena(Arena * arena);
+
+#endif
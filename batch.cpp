@@ -0,0 +1,297 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "pool.h"
+
+// one chunk of lines in flight: every worker writes into its own memory
+// stream and the outputs are put back in input order afterwards
+typedef struct _batch_job
+{
+    char ** lines;
+    size_t * owners;        // worker that did line i
+    long * offsets;         // where its output starts in that worker's stream
+    long * lengths;
+    FILE ** outs;
+    char ** buffers;
+    size_t * sizes;
+    BatchStats * stats;     // per worker
+    int * errors;
+    int format;
+
+} BatchJob;
+
+// taken by every run from now on, NULL for none
+static DiffCache * Cache = NULL;
+
+static double _now(void);
+static int _batch_line(char * line, FILE * out, int format, BatchStats * stats);
+static void _batch_task(void * arg, size_t index, size_t worker);
+static int _batch_chunk(Pool * pool, BatchJob * job, size_t count, FILE * out);
+static void _batch_add(BatchStats * total, const BatchStats * part);
+
+static double _now(void)
+{
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+int BatchFormat(const char * name)
+{
+    if (!name) return -1;
+    if (strcmp(name, "infix") == 0)     return BATCH_INFIX;
+    if (strcmp(name, "tex") == 0)       return BATCH_TEX;
+    if (strcmp(name, "none") == 0)      return BATCH_NONE;
+    return -1;
+}
+
+// the derivatives are looked up in cache first and stored there on a miss
+void BatchUseCache(DiffCache * cache)
+{
+    Cache = cache;
+}
+
+// One expression: its derivative goes out as one line, a line that does not
+// parse gives "error" so the output lines stay in step with the input.
+static int _batch_line(char * line, FILE * out, int format, BatchStats * stats)
+{
+    size_t length = strlen(line);
+    stats->bytes += length;
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+
+    if (!length)
+    {
+        if (format != BATCH_NONE) fputc('\n', out);
+        return SUCCESS;
+    }
+
+    stats->expressions++;
+
+    double start = _now();
+    int error = SUCCESS;
+    CacheKey key = {};
+    Tree * diff = NULL;
+
+    if (Cache) error = DiffCacheKey(line, &key);
+    if (Cache && !error) diff = DiffCacheLoad(Cache, &key);
+    if (diff) stats->cached++;
+
+    Tree * tree = NULL;
+    if (!diff && !error)
+    {
+        tree = CreateTree(NULL, NULL, NULL);
+        if (!tree)
+        {
+            DestroyCacheKey(&key);
+            return ALLOCATE_MEMORY_ERROR;
+        }
+
+        error = TreeParseString(tree, line);
+    }
+    double parsed = _now();
+    stats->parse += parsed - start;
+
+    if (tree && !error) diff = DiffTree(tree);
+    double diffed = _now();
+    stats->diff += diffed - parsed;
+
+    if (tree && diff) error = TreeSimplify(diff, NULL);
+    if (tree && diff && !error && Cache) DiffCacheStore(Cache, &key, diff);
+    double simplified = _now();
+    stats->simplify += simplified - diffed;
+
+    if (!diff || error)
+    {
+        stats->errors++;
+        if (format != BATCH_NONE) fputs("error\n", out);
+    }
+    else
+    {
+        // shared subtrees count once, a deep DAG can stand for far more tree nodes
+        if (format != BATCH_NONE) stats->nodes += TreeNodes(diff);
+        if (format == BATCH_INFIX)  TreePrint(diff, out);
+        if (format == BATCH_TEX)    TreeTex(diff, out);
+    }
+    stats->output += _now() - simplified;
+
+    DestroyCacheKey(&key);
+    DestroyTree(diff);
+    DestroyTree(tree);
+    return SUCCESS;
+}
+
+// Reads newline separated expressions from in until EOF and streams the
+// derivative of each one to out in the given format.
+int BatchRun(FILE * in, FILE * out, int format, BatchStats * stats)
+{
+    if (!in || !out || !stats) return INVALID_ARGUMENT;
+    if (format != BATCH_INFIX && format != BATCH_TEX && format != BATCH_NONE) return INVALID_ARGUMENT;
+
+    char * line = NULL;
+    size_t capacity = 0;
+    int error = SUCCESS;
+
+    double start = _now();
+
+    while (!error && getline(&line, &capacity, in) != -1)
+        error = _batch_line(line, out, format, stats);
+
+    free(line);
+
+    if (fflush(out)) error = FCLOSE_ERROR;
+    stats->wall += _now() - start;
+    stats->threads = 1;
+    return error;
+}
+
+static void _batch_task(void * arg, size_t index, size_t worker)
+{
+    BatchJob * job = (BatchJob*) arg;
+    FILE * out = job->outs[worker];
+
+    long before = ftell(out);
+    int error = _batch_line(job->lines[index], out, job->format, &job->stats[worker]);
+    if (error) job->errors[worker] = error;
+
+    job->owners[index] = worker;
+    job->offsets[index] = before;
+    job->lengths[index] = ftell(out) - before;
+}
+
+static int _batch_chunk(Pool * pool, BatchJob * job, size_t count, FILE * out)
+{
+    size_t threads = PoolThreads(pool);
+    int error = SUCCESS;
+
+    for (size_t i = 0; i < threads; i++)
+    {
+        job->outs[i] = open_memstream(&job->buffers[i], &job->sizes[i]);
+        if (!job->outs[i]) error = ALLOCATE_MEMORY_ERROR;
+    }
+
+    if (!error) error = PoolRun(pool, count, _batch_task, job);
+
+    for (size_t i = 0; i < threads; i++)
+    {
+        if (job->outs[i]) fflush(job->outs[i]);
+        if (job->errors[i]) error = job->errors[i];
+    }
+
+    for (size_t i = 0; i < count && !error; i++)
+        fwrite(job->buffers[job->owners[i]] + job->offsets[i], 1, (size_t) job->lengths[i], out);
+
+    for (size_t i = 0; i < threads; i++)
+    {
+        if (job->outs[i]) fclose(job->outs[i]);
+        free(job->buffers[i]);
+        job->outs[i] = NULL;
+        job->buffers[i] = NULL;
+    }
+
+    return error;
+}
+
+static void _batch_add(BatchStats * total, const BatchStats * part)
+{
+    total->expressions  += part->expressions;
+    total->errors       += part->errors;
+    total->bytes        += part->bytes;
+    total->nodes        += part->nodes;
+    total->cached       += part->cached;
+    total->parse        += part->parse;
+    total->diff         += part->diff;
+    total->simplify     += part->simplify;
+    total->output       += part->output;
+}
+
+// BatchRun over a pool of threads (0 for one per CPU). Lines are read in
+// chunks of BATCH_CHUNK, one expression is one task, and the output comes
+// out in the order of the input whatever thread did each line.
+int BatchRunParallel(FILE * in, FILE * out, int format, size_t threads, BatchStats * stats)
+{
+    if (!in || !out || !stats) return INVALID_ARGUMENT;
+    if (format != BATCH_INFIX && format != BATCH_TEX && format != BATCH_NONE) return INVALID_ARGUMENT;
+
+    Pool * pool = CreatePool(threads);
+    if (!pool) return ALLOCATE_MEMORY_ERROR;
+    threads = PoolThreads(pool);
+
+    BatchJob job = {};
+    job.format = format;
+    job.lines = (char**) calloc(BATCH_CHUNK, sizeof(char*));
+    size_t * capacities = (size_t*) calloc(BATCH_CHUNK, sizeof(size_t));
+    job.owners = (size_t*) calloc(BATCH_CHUNK, sizeof(size_t));
+    job.offsets = (long*) calloc(BATCH_CHUNK, sizeof(long));
+    job.lengths = (long*) calloc(BATCH_CHUNK, sizeof(long));
+    job.outs = (FILE**) calloc(threads, sizeof(FILE*));
+    job.buffers = (char**) calloc(threads, sizeof(char*));
+    job.sizes = (size_t*) calloc(threads, sizeof(size_t));
+    job.stats = (BatchStats*) calloc(threads, sizeof(BatchStats));
+    job.errors = (int*) calloc(threads, sizeof(int));
+
+    int error = SUCCESS;
+    if (!job.lines || !capacities || !job.owners || !job.offsets || !job.lengths ||
+        !job.outs || !job.buffers || !job.sizes || !job.stats || !job.errors)
+        error = ALLOCATE_MEMORY_ERROR;
+
+    double start = _now();
+
+    while (!error)
+    {
+        size_t count = 0;
+        while (count < BATCH_CHUNK && getline(&job.lines[count], &capacities[count], in) != -1) count++;
+        if (!count) break;
+
+        error = _batch_chunk(pool, &job, count, out);
+        if (count < BATCH_CHUNK) break;
+    }
+
+    if (fflush(out) && !error) error = FCLOSE_ERROR;
+    stats->wall += _now() - start;
+    stats->threads = threads;
+
+    for (size_t i = 0; job.stats && i < threads; i++) _batch_add(stats, &job.stats[i]);
+    for (size_t i = 0; job.lines && i < BATCH_CHUNK; i++) free(job.lines[i]);
+
+    free(job.lines);
+    free(capacities);
+    free(job.owners);
+    free(job.offsets);
+    free(job.lengths);
+    free(job.outs);
+    free(job.buffers);
+    free(job.sizes);
+    free(job.stats);
+    free(job.errors);
+
+    DestroyPool(pool);
+    return error;
+}
+
+
+void BatchReport(const BatchStats * stats, FILE * out)
+{
+    if (!stats || !out) return;
+
+    double phases[] = {stats->parse, stats->diff, stats->simplify, stats->output};
+    const char * names[] = {"parse", "diff", "simplify", "output"};
+    double total = 0;
+
+    fprintf(out, "%zu expressions (%zu errors), %zu bytes in, %zu nodes out\n",
+            stats->expressions, stats->errors, stats->bytes, stats->nodes);
+    if (stats->cached) fprintf(out, "%zu expressions from the cache\n", stats->cached);
+
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); i++)
+    {
+        total += phases[i];
+        fprintf(out, "%-10s %9.3lf s %14.0lf expr/sec\n", names[i], phases[i],
+                phases[i] > 0 ? (double) stats->expressions / phases[i] : 0);
+    }
+
+    fprintf(out, "%-10s %9.3lf s %14.0lf expr/sec\n", "total", total,
+            total > 0 ? (double) stats->expressions / total : 0);
+    fprintf(out, "%-10s %9.3lf s %14.0lf expr/sec on %zu threads\n", "wall", stats->wall,
+            stats->wall > 0 ? (double) stats->expressions / stats->wall : 0, stats->threads);
+}
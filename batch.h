@@ -0,0 +1,46 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+#include "diff.h"
+#include "cache.h"
+
+enum batch_formats
+{
+    BATCH_INFIX,
+    BATCH_TEX,
+    BATCH_NONE
+};
+
+// totals of a run, times are in seconds
+typedef struct _batch_stats
+{
+    size_t expressions;
+    size_t errors;
+    size_t bytes;           // of input
+    size_t nodes;           // distinct, of the derivatives written out, none with BATCH_NONE
+    size_t cached;          // expressions loaded from the cache, their time counts as parse
+    double parse;
+    double diff;
+    double simplify;
+    double output;
+    double wall;            // the phases are summed over the threads, this is not
+    size_t threads;
+
+} BatchStats;
+
+const size_t BATCH_OUT_BUFFER = 1 << 20;
+const size_t BATCH_CHUNK = 16384;       // lines read and written at a time by BatchRunParallel
+
+int BatchFormat(const char * name);
+
+void BatchUseCache(DiffCache * cache);
+
+int BatchRun(FILE * in, FILE * out, int format, BatchStats * stats);
+
+int BatchRunParallel(FILE * in, FILE * out, int format, size_t threads, BatchStats * stats);
+
+void BatchReport(const BatchStats * stats, FILE * out);
+
+#endif
@@ -0,0 +1,872 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+
+#include "diff.h"
+#include "vm.h"
+#include "codegen.h"
+#include "batch.h"
+#include "lexer.h"
+#include "cache.h"
+
+const char * BENCH_FILE     = "bench_expr.txt";
+const char * BENCH_EXPR     = "sin(x*x)*cos(x)/(x^3+ln(x))*ch(x)";
+const int    BENCH_ORDER    = 5;
+const int    BENCH_ROUNDS   = 10;
+const int    BENCH_EVALS    = 1000000;
+const int    BENCH_TAYLORS  = 100000;
+const char * BENCH_CORPUS   = "bench_corpus.txt";
+const int    BENCH_LINES    = 200000;
+
+// leaves of the random trees for the fork-join versions
+const size_t BENCH_FORK_SIZES[] = {10000, 100000, 1000000};
+const size_t BENCH_PARSE_LEAVES = 2000000;
+const char * BENCH_PARSE_FILE = "bench_parse.txt";
+const size_t BENCH_WALK_LEAVES = 100000;
+const int    BENCH_WALK_ROUNDS = 10;
+const size_t BENCH_DEPTH = 1000000;
+const char * BENCH_RESULTS = "bench_results.tsv";
+const int    BENCH_PHASE_ROUNDS = 3;
+const DumpOptions BENCH_DUMP = {0, 0, DUMP_NO_DOT, "png"};
+const char * BENCH_DUMP_FILE = "bench_dump.dot";
+const char * BENCH_TEX_FILE = "bench_dump.tex";
+const char * BENCH_STORE_FILE = "bench_dump.tree";
+const char * BENCH_CACHE_DIR = "bench_cache";
+const char * BENCH_CACHE_CORPUS = "bench_cache.txt";
+const int    BENCH_CACHE_LINES = 20000;
+const size_t BENCH_CACHE_NODES = 60;        // of every line, all of them different
+
+// lines of the batch corpus, used in turn
+const char * BENCH_LINE_EXPRS[] =
+{
+    "sin(x*x)*cos(x)/(x^3+ln(x))*ch(x)",
+    "x^x*x^x*x^x",
+    "tg(x)+ctg(x)*sh(x)",
+    "e(x)*x/(x+1)",
+    "(x+1)^3-x/2",
+    "sin(cos(ln(x)))",
+    "alpha*x^2+beta*sin(gamma*x)",
+};
+
+// Shape and mix of the random expressions of the phases suite. An inner
+// node is a function with func_percent chance, else a binary operator whose
+// left operand is a single leaf with skew_percent chance (long right spines)
+// and a random share of the nodes otherwise.
+typedef struct _bench_gen
+{
+    const char * name;
+    size_t nodes;                   // fewer if depth cuts the tree
+    size_t depth;
+    const char * opers;             // picked uniformly, a repeated one weighs more
+    const char * const * funcs;     // NULL-terminated, NULL for none
+    int func_percent;
+    int skew_percent;
+
+} BenchGen;
+
+static const char * const BENCH_FUNCS[] = {"sin", "cos", "tg", "ln", "sh", "ch", "e", NULL};
+
+static const BenchGen BENCH_CASES[] =
+{
+    {"small",    2000,    32, "+-*/^",   BENCH_FUNCS, 20, 0},
+    {"mixed",  200000,    64, "+-*/^",   BENCH_FUNCS, 20, 0},
+    {"arith",  200000,    64, "++--**/", NULL,         0, 0},
+    {"funcs",  200000,    64, "+*",      BENCH_FUNCS, 60, 0},
+    {"deep",    20000, 20000, "+-",      NULL,         0, 95},
+};
+
+// one row of the results: what was done to how many items in how long
+typedef struct _bench_row
+{
+    const char * suite;
+    const char * name;              // of the case
+    const char * phase;
+    double items;
+    double seconds;
+    size_t result;                  // nodes of the tree made, 0 if none
+    size_t memory;                  // arena bytes after the phase
+    long peak;                      // RSS in KB during the phase
+
+} BenchRow;
+
+static FILE * Results = NULL;
+
+static double Now(void);
+static void BenchPeakReset(void);
+static long BenchPeak(void);
+static void BenchRecord(const BenchRow * row);
+static void BenchGenerate(FILE * out, const BenchGen * gen, size_t nodes, size_t depth, unsigned int * seed);
+static void BenchPhases(unsigned int seed);
+static void BenchEval(void);
+static void BenchBatch(void);
+static void BenchTree(FILE * out, size_t leaves, unsigned int * seed);
+static void BenchFork(unsigned int seed);
+static void BenchParse(unsigned int seed);
+static void BenchChain(FILE * out, size_t depth, int nested);
+static void BenchWalk(unsigned int seed);
+static void BenchCache(unsigned int seed);
+static void BenchRemoveDir(const char * name);
+
+static double Now(void)
+{
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// the peak RSS starts over from the current one (Linux clear_refs)
+static void BenchPeakReset(void)
+{
+    FILE * refs = fopen("/proc/self/clear_refs", "wb");
+    if (!refs) return;
+
+    fputs("5", refs);
+    fclose(refs);
+}
+
+// peak RSS in KB since BenchPeakReset, since the start without /proc
+static long BenchPeak(void)
+{
+    long peak = -1;
+
+    FILE * status = fopen("/proc/self/status", "rb");
+    if (status)
+    {
+        char line[DEF_SIZE] = "";
+        while (fgets(line, sizeof(line), status))
+            if (sscanf(line, "VmHWM: %ld", &peak) == 1) break;
+
+        fclose(status);
+    }
+
+    if (peak < 0)
+    {
+        struct rusage usage = {};
+        if (!getrusage(RUSAGE_SELF, &usage)) peak = usage.ru_maxrss;
+    }
+
+    return peak;
+}
+
+// a tab-separated line of Results, the same rows for the same build and
+// seed so that two runs can be diffed or joined
+static void BenchRecord(const BenchRow * row)
+{
+    if (!Results) return;
+
+    fprintf(Results, "%s\t%s\t%s\t%.0lf\t%.6lf\t%.0lf\t%zu\t%zu\t%ld\n",
+            row->suite, row->name, row->phase, row->items, row->seconds,
+            row->seconds > 0 ? row->items / row->seconds : 0, row->result, row->memory,
+            row->peak ? row->peak : BenchPeak());
+    fflush(Results);
+}
+
+// an expression of about nodes nodes at most depth levels deep
+static void BenchGenerate(FILE * out, const BenchGen * gen, size_t nodes, size_t depth, unsigned int * seed)
+{
+    size_t funcs = 0;
+    while (gen->funcs && gen->funcs[funcs]) funcs++;
+
+    int func = funcs && (nodes == 2 || rand_r(seed) % 100 < gen->func_percent);
+    if (nodes < 2 || depth < 2 || (nodes == 2 && !func))
+    {
+        int leaf = rand_r(seed) % 10;
+        if (leaf < 5) fputc('x', out);
+        else if (leaf < 7) fputc('y', out);
+        else fprintf(out, "%d", 1 + rand_r(seed) % 9);
+        return;
+    }
+
+    if (func)
+    {
+        fprintf(out, "%s(", gen->funcs[(size_t) rand_r(seed) % funcs]);
+        BenchGenerate(out, gen, nodes - 1, depth - 1, seed);
+        fputc(')', out);
+        return;
+    }
+
+    size_t left = 1;
+    if (rand_r(seed) % 100 >= gen->skew_percent) left += (size_t) rand_r(seed) % (nodes - 2);
+
+    fputc('(', out);
+    BenchGenerate(out, gen, left, depth - 1, seed);
+    fprintf(out, " %c ", gen->opers[(size_t) rand_r(seed) % strlen(gen->opers)]);
+    BenchGenerate(out, gen, nodes - 1 - left, depth - 1, seed);
+    fputc(')', out);
+}
+
+#define PHASE(index, call)                                                      \
+    BenchPeakReset();                                                           \
+    start = Now();                                                              \
+    call;                                                                       \
+    times[index] = Now() - start;                                               \
+    peaks[index] = BenchPeak();
+
+// Every phase of BENCH_CASES on its own, the best of BENCH_PHASE_ROUNDS;
+// items are source nodes (tokens for Tokenize), the rate is per second.
+static void BenchPhases(unsigned int seed)
+{
+    const char * phases[] = {"Tokenize", "TreeParseString", "DiffTree", "TreeSimplify",
+                             "CountTree", "TreeDump", "TexDump", "TreeSave", "TreeLoad",
+                             "TreeCanonical", "TreeHash"};
+    const int count = sizeof(phases) / sizeof(phases[0]);
+
+    for (size_t c = 0; c < sizeof(BENCH_CASES) / sizeof(BENCH_CASES[0]); c++)
+    {
+        const BenchGen * gen = &BENCH_CASES[c];
+
+        char * expression = NULL;
+        size_t length = 0;
+        FILE * out = open_memstream(&expression, &length);
+        if (!out) return;
+
+        unsigned int state = seed + (unsigned int) c;
+        BenchGenerate(out, gen, gen->nodes, gen->depth, &state);
+        fclose(out);
+
+        BenchRow rows[sizeof(phases) / sizeof(phases[0])] = {};
+        size_t nodes = 0;
+
+        for (int round = 0; round < BENCH_PHASE_ROUNDS; round++)
+        {
+            double times[sizeof(phases) / sizeof(phases[0])] = {};
+            long peaks[sizeof(phases) / sizeof(phases[0])] = {};
+            size_t results[sizeof(phases) / sizeof(phases[0])] = {};
+            size_t memory[sizeof(phases) / sizeof(phases[0])] = {};
+            double start = 0;
+
+            Tokens tokens = {};
+            PHASE(0, Tokenize(expression, &tokens));
+            double items = (double) tokens.count;
+            DestroyTokens(&tokens);
+
+            Tree * tree = CreateTree(NULL, NULL, NULL);
+            PHASE(1, TreeParseString(tree, expression));
+            nodes = results[1] = TreeSize(tree);
+            memory[1] = TreeMemory(tree);
+
+            Tree * diff = NULL;
+            PHASE(2, diff = DiffTree(tree));
+            results[2] = TreeSize(diff);
+            memory[2] = TreeMemory(diff);
+
+            PHASE(3, TreeSimplify(diff, NULL));
+            results[3] = TreeSize(diff);
+            memory[3] = TreeMemory(diff);
+
+            PHASE(4, CountTree(tree));
+
+            // the whole graph without dot and the .tex without pdflatex, the writers alone
+            PHASE(5, TreeDumpWith(tree, BENCH_DUMP_FILE, &BENCH_DUMP));
+            PHASE(6, TexDumpWith(tree, BENCH_TEX_FILE, NULL));
+
+            // the simplified derivative back without parsing and differentiating
+            PHASE(7, TreeSave(diff, BENCH_STORE_FILE));
+            Tree * loaded = CreateTree(NULL, NULL, NULL);
+            PHASE(8, TreeLoad(loaded, BENCH_STORE_FILE));
+            results[8] = TreeSize(loaded);
+            memory[8] = TreeMemory(loaded);
+
+            PHASE(9, TreeCanonical(loaded));
+            results[9] = TreeSize(loaded);
+            memory[9] = TreeMemory(loaded);
+            DestroyTree(loaded);
+
+            // the simplified derivative was never hashed, so nothing is cached
+            PHASE(10, TreeHash(diff));
+
+            for (int phase = 0; phase < count; phase++)
+            {
+                if (round && times[phase] >= rows[phase].seconds) continue;
+                rows[phase] = (BenchRow) {"phases", gen->name, phases[phase], phase ? (double) nodes : items,
+                                          times[phase], results[phase], memory[phase], peaks[phase]};
+            }
+
+            DestroyTree(diff);
+            DestroyTree(tree);
+        }
+
+        fprintf(stderr, "phases, %-6s %7zu nodes (Mitems/sec, peak MB):", gen->name, nodes);
+        for (int phase = 0; phase < count; phase++)
+        {
+            BenchRecord(&rows[phase]);
+            fprintf(stderr, " %s %.2lf %.0lf%s", phases[phase],
+                    rows[phase].seconds > 0 ? rows[phase].items / rows[phase].seconds / 1e6 : 0,
+                    (double) rows[phase].peak / 1024, phase + 1 < count ? "," : "\n");
+        }
+
+        remove(BENCH_DUMP_FILE);
+        remove(BENCH_TEX_FILE);
+        remove(BENCH_STORE_FILE);
+
+        free(expression);
+    }
+}
+
+#undef PHASE
+
+// BatchRunParallel on 1, 2, 4, ... threads up to the CPU count
+static void BenchBatch(void)
+{
+    FILE * corpus = fopen(BENCH_CORPUS, "wb");
+    if (!corpus) return;
+
+    size_t kinds = sizeof(BENCH_LINE_EXPRS) / sizeof(BENCH_LINE_EXPRS[0]);
+    for (int i = 0; i < BENCH_LINES; i++) fprintf(corpus, "%s\n", BENCH_LINE_EXPRS[(size_t) i % kinds]);
+    fclose(corpus);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double single = 0;
+
+    for (long threads = 1; ; threads *= 2)
+    {
+        if (threads > cpus) threads = cpus;
+
+        FILE * in = fopen(BENCH_CORPUS, "rb");
+        FILE * out = fopen("/dev/null", "wb");
+        BatchStats stats = {};
+
+        if (in && out) BatchRunParallel(in, out, BATCH_INFIX, (size_t) threads, &stats);
+        if (in) fclose(in);
+        if (out) fclose(out);
+
+        double rate = stats.wall > 0 ? (double) stats.expressions / stats.wall : 0;
+        if (threads == 1) single = rate;
+
+        fprintf(stderr, "BatchRunParallel %2ld threads: %zu expressions in %.3lf s, %.0lf expr/sec, x%.2lf\n",
+                threads, stats.expressions, stats.wall, rate, single > 0 ? rate / single : 0);
+
+        char name[DEF_SIZE] = "";
+        snprintf(name, sizeof(name), "%ld threads", threads);
+        BenchRow row = {"batch", name, "BatchRunParallel", (double) stats.expressions, stats.wall, stats.nodes, 0, 0};
+        BenchRecord(&row);
+
+        if (threads >= cpus) break;
+    }
+
+    remove(BENCH_CORPUS);
+}
+
+// BatchRun of distinct lines without the cache, with an empty one and with
+// the one the previous run filled
+static void BenchCache(unsigned int seed)
+{
+    FILE * corpus = fopen(BENCH_CACHE_CORPUS, "wb");
+    if (!corpus) return;
+
+    for (int i = 0; i < BENCH_CACHE_LINES; i++)
+    {
+        BenchGenerate(corpus, &BENCH_CASES[0], BENCH_CACHE_NODES, BENCH_CASES[0].depth, &seed);
+        fputc('\n', corpus);
+    }
+    fclose(corpus);
+
+    BenchRemoveDir(BENCH_CACHE_DIR);
+    DiffCache * cache = CreateDiffCache(BENCH_CACHE_DIR, DIFF_CACHE_SIZE);
+    if (!cache) return;
+
+    const char * runs[] = {"none", "cold", "warm"};
+    for (int run = 0; run < 3; run++)
+    {
+        BatchUseCache(run ? cache : NULL);
+
+        FILE * in = fopen(BENCH_CACHE_CORPUS, "rb");
+        FILE * out = fopen("/dev/null", "wb");
+        BatchStats stats = {};
+
+        if (in && out) BatchRun(in, out, BATCH_INFIX, &stats);
+        if (in) fclose(in);
+        if (out) fclose(out);
+
+        double compute = stats.parse + stats.diff + stats.simplify;
+        fprintf(stderr, "BatchRun %s cache: %zu expressions (%zu cached) in %.3lf s, parse+diff+simplify %.3lf s\n",
+                runs[run], stats.expressions, stats.cached, stats.wall, compute);
+
+        BenchRow row = {"cache", runs[run], "BatchRun", (double) stats.expressions, stats.wall, stats.nodes, 0, 0};
+        BenchRecord(&row);
+    }
+
+    CacheStats cached = {};
+    DiffCacheGetStats(cache, &cached);
+    fprintf(stderr, "cache: %zu hits, %zu misses, %zu stores, %zu evictions\n",
+            cached.hits, cached.misses, cached.stores, cached.evictions);
+
+    BatchUseCache(NULL);
+    DestroyDiffCache(cache);
+
+    BenchRemoveDir(BENCH_CACHE_DIR);
+    remove(BENCH_CACHE_CORPUS);
+}
+
+// the files of a directory and then the directory
+static void BenchRemoveDir(const char * name)
+{
+    DIR * dir = opendir(name);
+    if (!dir) return;
+
+    for (struct dirent * file = readdir(dir); file; file = readdir(dir))
+    {
+        if (!strcmp(file->d_name, ".") || !strcmp(file->d_name, "..")) continue;
+
+        char path[DEF_SIZE] = "";
+        snprintf(path, sizeof(path), "%s/%s", name, file->d_name);
+        remove(path);
+    }
+
+    closedir(dir);
+    rmdir(name);
+}
+
+// balanced random expression in x and y with the given number of leaves
+static void BenchTree(FILE * out, size_t leaves, unsigned int * seed)
+{
+    if (leaves == 1)
+    {
+        const char * leaf[] = {"x", "y", "2", "x"};
+        fputs(leaf[rand_r(seed) % 4], out);
+        return;
+    }
+
+    const char * open[] = {"sin(", "cos(", "(", "(", "(", "("};
+    const char oper[] = "+-*+*";
+
+    fputs(open[rand_r(seed) % 6], out);
+    BenchTree(out, leaves / 2, seed);
+    fprintf(out, " %c ", oper[rand_r(seed) % 5]);
+    BenchTree(out, leaves - leaves / 2, seed);
+    fputc(')', out);
+}
+
+// DiffTree + TreeSimplify of one big tree against the parallel versions
+// on 1, 2, 4, ... threads up to the CPU count
+static void BenchFork(unsigned int seed)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (size_t size = 0; size < sizeof(BENCH_FORK_SIZES) / sizeof(BENCH_FORK_SIZES[0]); size++)
+    {
+        char * expression = NULL;
+        size_t length = 0;
+        FILE * out = open_memstream(&expression, &length);
+        if (!out) return;
+
+        unsigned int state = seed;
+        BenchTree(out, BENCH_FORK_SIZES[size], &state);
+        fclose(out);
+
+        double serial = 0;
+
+        // threads == 0 is the serial DiffTree and TreeSimplify
+        for (long threads = 0; ; threads = threads ? threads * 2 : 1)
+        {
+            if (threads > cpus) threads = cpus;
+
+            Tree * tree = CreateTree(NULL, NULL, NULL);
+            TreeParseString(tree, expression);
+            size_t nodes = TreeSize(tree);
+
+            double start = Now();
+            Tree * diff = threads ? DiffTreeParallel(tree, (size_t) threads) : DiffTree(tree);
+            double diffed = Now();
+
+            if (threads) TreeSimplifyParallel(diff, (size_t) threads, NULL);
+            else TreeSimplify(diff, NULL);
+            double elapsed = Now() - start;
+
+            if (!threads) serial = elapsed;
+
+            fprintf(stderr, "%s %7zu nodes %2ld threads: diff %.3lf s, simplify %.3lf s, x%.2lf\n",
+                    threads ? "DiffTreeParallel" : "DiffTree        ", nodes, threads,
+                    diffed - start, elapsed - (diffed - start), elapsed > 0 ? serial / elapsed : 0);
+
+            char name[DEF_SIZE] = "";
+            snprintf(name, sizeof(name), "%zu leaves, %ld threads", BENCH_FORK_SIZES[size], threads);
+            BenchRow row = {"fork", name, threads ? "DiffTreeParallel" : "DiffTree", (double) nodes,
+                            diffed - start, 0, TreeMemory(diff), 0};
+            BenchRecord(&row);
+            row.phase = threads ? "TreeSimplifyParallel" : "TreeSimplify";
+            row.seconds = elapsed - (diffed - start);
+            BenchRecord(&row);
+
+            DestroyTree(diff);
+            DestroyTree(tree);
+
+            if (threads >= cpus) break;
+        }
+
+        free(expression);
+    }
+}
+
+// TreeParseString of one multi-megabyte expression and TreeParse of it in a file
+static void BenchParse(unsigned int seed)
+{
+    char * expression = NULL;
+    size_t length = 0;
+    FILE * out = open_memstream(&expression, &length);
+    if (!out) return;
+
+    BenchTree(out, BENCH_PARSE_LEAVES, &seed);
+    fclose(out);
+
+    Tree * tree = CreateTree(NULL, NULL, NULL);
+
+    double start = Now();
+    TreeParseString(tree, expression);
+    double elapsed = Now() - start;
+
+    fprintf(stderr, "TreeParseString: %zu bytes, %zu nodes in %.3lf s, %.1lf MB/sec\n",
+            length, TreeSize(tree), elapsed, (double) length / elapsed / 1e6);
+
+    BenchRow row = {"parse", "string", "TreeParseString", (double) length, elapsed, TreeSize(tree), TreeMemory(tree), 0};
+    BenchRecord(&row);
+    DestroyTree(tree);
+
+    out = fopen(BENCH_PARSE_FILE, "wb");
+    if (out)
+    {
+        fwrite(expression, 1, length, out);
+        fclose(out);
+
+        tree = CreateTree(NULL, NULL, NULL);
+
+        start = Now();
+        TreeParse(tree, BENCH_PARSE_FILE);
+        elapsed = Now() - start;
+
+        fprintf(stderr, "TreeParse (mapped file): %zu nodes in %.3lf s, %.1lf MB/sec\n",
+                TreeSize(tree), elapsed, (double) length / elapsed / 1e6);
+
+        row = (BenchRow) {"parse", "mapped file", "TreeParse", (double) length, elapsed, TreeSize(tree), TreeMemory(tree), 0};
+        BenchRecord(&row);
+
+        DestroyTree(tree);
+        remove(BENCH_PARSE_FILE);
+    }
+
+    free(expression);
+}
+
+// x + x + x * y + ... or sin(ln(sin(... x ...))) depth levels deep
+static void BenchChain(FILE * out, size_t depth, int nested)
+{
+    if (!nested)
+    {
+        fputc('x', out);
+        for (size_t i = 1; i < depth; i++) fputs(i % 3 ? " + x" : " * y", out);
+        return;
+    }
+
+    for (size_t i = 0; i < depth; i++) fputs(i % 2 ? "sin(" : "ln(", out);
+    fputc('x', out);
+    for (size_t i = 0; i < depth; i++) fputc(')', out);
+}
+
+// Every walk over a balanced tree, where the call stack did best, and over
+// chains BENCH_DEPTH levels deep, which used to overflow it; per source node.
+static void BenchWalk(unsigned int seed)
+{
+    const char * shapes[] = {"balanced", "left-deep", "nested"};
+    FILE * null = fopen("/dev/null", "wb");
+    if (!null) return;
+
+    for (int shape = 0; shape < 3; shape++)
+    {
+        char * expression = NULL;
+        size_t length = 0;
+        FILE * out = open_memstream(&expression, &length);
+        if (!out) break;
+
+        unsigned int state = seed;
+        if (shape) BenchChain(out, BENCH_DEPTH, shape == 2);
+        else BenchTree(out, BENCH_WALK_LEAVES, &state);
+        fclose(out);
+
+        int rounds = shape ? 1 : BENCH_WALK_ROUNDS;
+        double times[8] = {};
+        size_t nodes = 0;
+
+        for (int round = 0; round < rounds; round++)
+        {
+            double start = Now();
+            Tree * tree = CreateTree(NULL, NULL, NULL);
+            TreeParseString(tree, expression);
+            times[0] += Now() - start;
+
+            start = Now();
+            Tree * diff = DiffTree(tree);
+            times[1] += Now() - start;
+
+            start = Now();
+            TreeSimplify(diff, NULL);
+            times[2] += Now() - start;
+
+            start = Now();
+            CountTree(tree);
+            times[3] += Now() - start;
+
+            start = Now();
+            TreePrint(tree, null);
+            times[4] += Now() - start;
+
+            start = Now();
+            TreeTex(tree, null);
+            times[5] += Now() - start;
+
+            start = Now();
+            nodes = TreeSize(tree);
+            times[6] += Now() - start;
+
+            start = Now();
+            DestroyTree(diff);
+            DestroyTree(tree);
+            times[7] += Now() - start;
+        }
+
+        double scale = 1e9 / (double) rounds / (double) (nodes ? nodes : 1);
+        fprintf(stderr, "walks, %-9s %7zu nodes (ns/node): parse %.1lf, diff %.1lf, simplify %.1lf, "
+                        "count %.1lf, print %.1lf, tex %.1lf, size %.1lf, destroy %.1lf\n",
+                shapes[shape], nodes, times[0] * scale, times[1] * scale, times[2] * scale,
+                times[3] * scale, times[4] * scale, times[5] * scale, times[6] * scale, times[7] * scale);
+
+        const char * walks[] = {"parse", "diff", "simplify", "count", "print", "tex", "size", "destroy"};
+        for (int walk = 0; walk < 8; walk++)
+        {
+            BenchRow row = {"walk", shapes[shape], walks[walk], (double) nodes * rounds, times[walk], 0, 0, 0};
+            BenchRecord(&row);
+        }
+
+        free(expression);
+    }
+
+    fclose(null);
+}
+
+// DiffTree + TreeSimplify up to BENCH_ORDER and the evaluators of one expression
+static void BenchEval(void)
+{
+    FILE * out = fopen(BENCH_FILE, "wb");
+    if (!out) return;
+    fprintf(out, "%s\n", BENCH_EXPR);
+    fclose(out);
+
+    size_t nodes = 0;
+    size_t memory = 0;
+    double start = Now();
+
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        Tree * tree = CreateTree(NULL, NULL, NULL);
+        TreeParse(tree, BENCH_FILE);
+
+        // every order is differentiated from the simplified previous one
+        Tree * current = tree;
+        for (int order = 0; order < BENCH_ORDER; order++)
+        {
+            Tree * next = DiffTree(current);
+            TreeSimplify(next, NULL);
+            nodes += TreeSize(next);
+            if (TreeMemory(next) > memory) memory = TreeMemory(next);
+
+            if (current != tree) DestroyTree(current);
+            current = next;
+        }
+
+        DestroyTree(current);
+        DestroyTree(tree);
+    }
+
+    double elapsed = Now() - start;
+
+    fprintf(stderr, "DiffTree + TreeSimplify: %zu nodes in %.3lf s, %.0lf nodes/sec\n",
+            nodes, elapsed, (double) nodes / elapsed);
+    fprintf(stderr, "peak arena memory: %zu bytes\n", memory);
+
+    BenchRow row = {"eval", "orders", "DiffTree+TreeSimplify", (double) nodes, elapsed, nodes, memory, 0};
+    BenchRecord(&row);
+
+    Tree * tree = CreateTree(NULL, NULL, NULL);
+    TreeParse(tree, BENCH_FILE);
+    Tree * diff = DiffTree(tree);
+    TreeSimplify(diff, NULL);
+
+    Program * program = CompileTree(diff);
+    int x = ProgramVar(program, 'x');
+    field_t vars[1] = {};
+    field_t sum = 0;
+
+    start = Now();
+    for (int i = 0; i < BENCH_EVALS; i++)
+    {
+        if (x >= 0) vars[x] = 1 + (field_t) i / BENCH_EVALS;
+        sum += ProgramEval(program, vars);
+    }
+    elapsed = Now() - start;
+
+    fprintf(stderr, "ProgramEval: %d evals in %.3lf s, %.0lf evals/sec (checksum %lg)\n",
+            BENCH_EVALS, elapsed, BENCH_EVALS / elapsed, sum);
+
+    row = (BenchRow) {"eval", "scalar", "ProgramEval", BENCH_EVALS, elapsed, 0, 0, 0};
+    BenchRecord(&row);
+
+    field_t * xs = (field_t*) calloc(BENCH_EVALS, sizeof(field_t));
+    field_t * ys = (field_t*) calloc(BENCH_EVALS, sizeof(field_t));
+    for (int i = 0; i < BENCH_EVALS; i++) xs[i] = 1 + (field_t) i / BENCH_EVALS;
+
+    start = Now();
+    ProgramEvalBatch(program, vars, x, xs, ys, BENCH_EVALS);
+    elapsed = Now() - start;
+
+    sum = 0;
+    for (int i = 0; i < BENCH_EVALS; i++) sum += ys[i];
+    fprintf(stderr, "ProgramEvalBatch: %d points in %.3lf s, %.0lf points/sec (checksum %lg)\n",
+            BENCH_EVALS, elapsed, BENCH_EVALS / elapsed, sum);
+
+    row = (BenchRow) {"eval", "array", "ProgramEvalBatch", BENCH_EVALS, elapsed, 0, 0, 0};
+    BenchRecord(&row);
+
+    // f' at every point without building the derivative tree
+    Program * source = CompileTree(tree);
+    int sx = ProgramVar(source, 'x');
+    field_t * diffs = (field_t*) calloc(BENCH_EVALS, sizeof(field_t));
+
+    start = Now();
+    ProgramEvalDualBatch(source, NULL, sx, xs, ys, diffs, BENCH_EVALS);
+    elapsed = Now() - start;
+
+    sum = 0;
+    for (int i = 0; i < BENCH_EVALS; i++) sum += diffs[i];
+    fprintf(stderr, "ProgramEvalDualBatch: %d points in %.3lf s, %.0lf points/sec (checksum %lg)\n",
+            BENCH_EVALS, elapsed, BENCH_EVALS / elapsed, sum);
+
+    row = (BenchRow) {"eval", "array", "ProgramEvalDualBatch", BENCH_EVALS, elapsed, 0, 0, 0};
+    BenchRecord(&row);
+
+    free(diffs);
+
+    // every Taylor coefficient up to BENCH_ORDER from the source program
+    field_t coeffs[BENCH_ORDER + 1] = {};
+    field_t point[1] = {};
+    sum = 0;
+
+    start = Now();
+    for (int i = 0; i < BENCH_TAYLORS; i++)
+    {
+        point[0] = xs[i];
+        ProgramTaylor(source, point, sx, BENCH_ORDER, coeffs);
+        sum += coeffs[BENCH_ORDER];
+    }
+    elapsed = Now() - start;
+
+    fprintf(stderr, "ProgramTaylor order %d: %d points in %.3lf s, %.0lf points/sec (checksum %lg)\n",
+            BENCH_ORDER, BENCH_TAYLORS, elapsed, BENCH_TAYLORS / elapsed, sum);
+
+    row = (BenchRow) {"eval", "points", "ProgramTaylor", BENCH_TAYLORS, elapsed, 0, 0, 0};
+    BenchRecord(&row);
+
+    DestroyProgram(source);
+
+    // the first run may pay the compiler, a restart finds the cached object
+    start = Now();
+    Native * native = CompileNative(diff, NULL);
+    elapsed = Now() - start;
+    fprintf(stderr, "CompileNative: %.3lf s\n", elapsed);
+
+    row = (BenchRow) {"eval", "compile", "CompileNative", 1, elapsed, 0, 0, 0};
+    BenchRecord(&row);
+
+    if (native)
+    {
+        NativeFunc f = NativeScalar(native);
+        sum = 0;
+
+        start = Now();
+        for (int i = 0; i < BENCH_EVALS; i++) sum += f(xs[i]);
+        elapsed = Now() - start;
+
+        fprintf(stderr, "NativeScalar: %d evals in %.3lf s, %.0lf evals/sec (checksum %lg)\n",
+                BENCH_EVALS, elapsed, BENCH_EVALS / elapsed, sum);
+
+        row = (BenchRow) {"eval", "scalar", "NativeScalar", BENCH_EVALS, elapsed, 0, 0, 0};
+        BenchRecord(&row);
+
+        start = Now();
+        NativeArray(native)(xs, ys, BENCH_EVALS);
+        elapsed = Now() - start;
+
+        sum = 0;
+        for (int i = 0; i < BENCH_EVALS; i++) sum += ys[i];
+        fprintf(stderr, "NativeArray: %d points in %.3lf s, %.0lf points/sec (checksum %lg)\n",
+                BENCH_EVALS, elapsed, BENCH_EVALS / elapsed, sum);
+
+        row = (BenchRow) {"eval", "array", "NativeArray", BENCH_EVALS, elapsed, 0, 0, 0};
+        BenchRecord(&row);
+
+        DestroyNative(native);
+    }
+
+    free(xs);
+    free(ys);
+
+    DestroyProgram(program);
+    DestroyTree(diff);
+    DestroyTree(tree);
+
+    remove(BENCH_FILE);
+}
+
+// bench [-s seed] [-o results] [suite ...]: the suites named (all of them by
+// default) report to stderr and append rows to results (BENCH_RESULTS,
+// "-" for none): suite, case, phase, items, seconds, items/sec, result
+// nodes, arena bytes and peak RSS in KB, tab-separated
+int main(int argc, char ** argv)
+{
+    const char * suites[] = {"phases", "eval", "parse", "walk", "batch", "fork", "cache"};
+    const int count = sizeof(suites) / sizeof(suites[0]);
+
+    unsigned int seed = 1;
+    const char * results = BENCH_RESULTS;
+    int selected[sizeof(suites) / sizeof(suites[0])] = {};
+    int any = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "-s"))         seed = (unsigned int) strtoul(argv[++i], NULL, 10);
+        else if (i + 1 < argc && !strcmp(argv[i], "-o"))    results = argv[++i];
+        else
+        {
+            int suite = 0;
+            while (suite < count && strcmp(argv[i], suites[suite])) suite++;
+
+            if (suite == count)
+            {
+                fprintf(stderr, "usage: %s [-s seed] [-o results] [phases|eval|parse|walk|batch|fork|cache ...]\n", argv[0]);
+                return INVALID_ARGUMENT;
+            }
+
+            selected[suite] = any = 1;
+        }
+    }
+
+    if (strcmp(results, "-"))
+    {
+        Results = fopen(results, "wb");
+        if (!Results) return FOPEN_ERROR;
+        fprintf(Results, "suite\tcase\tphase\titems\tseconds\trate\tresult\tarena\tpeak_kb\n");
+    }
+
+    if (!any || selected[0]) BenchPhases(seed);
+    if (!any || selected[1]) BenchEval();
+    if (!any || selected[2]) BenchParse(seed + 1);
+    if (!any || selected[3]) BenchWalk(seed + 2);
+    if (!any || selected[4]) BenchBatch();
+    if (!any || selected[5]) BenchFork(seed);
+    if (!any || selected[6]) BenchCache(seed + 3);
+
+    if (Results && fclose(Results)) return FCLOSE_ERROR;
+    return 0;
+}
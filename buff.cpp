@@ -1,8 +1,27 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "buff.h"
 
+// A regular file is one read-only mapping handed out as a single piece,
+// anything else (pipes, stdin) is read in BUFF_CHUNK pieces into one buffer.
+struct _buff
+{
+    int fd;
+    int owned;              // fd was opened by OpenBuff
+    char * map;
+    size_t map_size;
+    int mapped_out;         // the mapping was handed out already
+    char * chunk;
+    int error;              // errno of a failed read
+};
+
 size_t GetFileSize(FILE * fp)
 {
     fseek(fp, 0L, SEEK_END);
@@ -13,19 +32,138 @@ size_t GetFileSize(FILE * fp)
     return (size_t) sz;
 }
 
+// The whole stream in one heap string; reads until EOF,
+// so it works for pipes as well as for files.
 char * CreateBuf(FILE * toRead)
 {
-    size_t fsize = GetFileSize(toRead);
-    if (!fsize) return NULL;
-
-    char * expression = (char*) calloc(fsize + 1, sizeof(char));
+    size_t size = 0;
+    size_t cap = BUFF_CHUNK;
+    char * expression = (char*) malloc(cap + 1);
     if (!expression) return NULL;
 
-    size_t read = fread((expression), sizeof(char), fsize, toRead);
-    if (read < fsize) return NULL;
-    if (expression[read - 1] == '\n') expression[read - 1] = 0;
+    size_t read = 0;
+    while ((read = fread(expression + size, sizeof(char), cap - size, toRead)) > 0)
+    {
+        size += read;
+        if (size < cap) continue;
+
+        char * grown = (char*) realloc(expression, 2 * cap + 1);
+        if (!grown)
+        {
+            free(expression);
+            return NULL;
+        }
+
+        expression = grown;
+        cap *= 2;
+    }
+
+    if (ferror(toRead) || !size)
+    {
+        free(expression);
+        return NULL;
+    }
+
+    expression[size] = '\0';
+    if (expression[size - 1] == '\n') expression[size - 1] = '\0';
     return expression;
 }
 
+// "-" is stdin
+Buff * OpenBuff(const char * filename)
+{
+    if (!filename) return NULL;
+    if (!strcmp(filename, "-")) return OpenBuffFd(STDIN_FILENO);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    Buff * buff = OpenBuffFd(fd);
+    if (!buff)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    buff->owned = 1;
+    return buff;
+}
+
+// reads fd from where it is, the descriptor stays open
+Buff * OpenBuffFd(int fd)
+{
+    if (fd < 0) return NULL;
+
+    Buff * buff = (Buff*) calloc(1, sizeof(Buff));
+    if (!buff) return NULL;
+    buff->fd = fd;
+
+    struct stat st = {};
+    off_t start = lseek(fd, 0, SEEK_CUR);
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && start == 0 && st.st_size > 0)
+    {
+        void * map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+            buff->map = (char*) map;
+            buff->map_size = (size_t) st.st_size;
+            return buff;
+        }
+    }
 
+    buff->chunk = (char*) malloc(BUFF_CHUNK);
+    if (!buff->chunk)
+    {
+        free(buff);
+        return NULL;
+    }
 
+    return buff;
+}
+
+// The next piece of the input, 0 at its end or on an error. A piece stays
+// valid until the next call, the pieces of a mapping until CloseBuff.
+size_t BuffNext(Buff * buff, const char ** data)
+{
+    if (!buff || !data) return 0;
+
+    if (buff->map)
+    {
+        if (buff->mapped_out) return 0;
+        buff->mapped_out = 1;
+
+        *data = buff->map;
+        return buff->map_size;
+    }
+
+    ssize_t got = 0;
+    do got = read(buff->fd, buff->chunk, BUFF_CHUNK);
+    while (got < 0 && errno == EINTR);
+
+    if (got < 0)
+    {
+        buff->error = errno;
+        return 0;
+    }
+
+    *data = buff->chunk;
+    return (size_t) got;
+}
+
+int BuffError(const Buff * buff)
+{
+    if (!buff) return 0;
+    return buff->error;
+}
+
+void CloseBuff(Buff * buff)
+{
+    if (!buff) return;
+
+    if (buff->map) munmap(buff->map, buff->map_size);
+    if (buff->owned) close(buff->fd);
+    free(buff->chunk);
+    free(buff);
+}
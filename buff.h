@@ -1,7 +1,23 @@
 #ifndef BUFF_H
 #define BUFF_H
 
+#include <stdio.h>
+
+typedef struct _buff Buff;
+
+const size_t BUFF_CHUNK = 64 * 1024;
+
 size_t GetFileSize(FILE * fp);
 char * CreateBuf(FILE * toRead);
 
+Buff * OpenBuff(const char * filename);
+
+Buff * OpenBuffFd(int fd);
+
+size_t BuffNext(Buff * buff, const char ** data);
+
+int BuffError(const Buff * buff);
+
+void CloseBuff(Buff * buff);
+
 #endif
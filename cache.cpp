@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "lexer.h"
+#include "trace.h"
+
+typedef struct _cache_entry
+{
+    char * name;
+    size_t size;
+    struct timespec used;   // mtime, set again on every hit
+
+} CacheEntry;
+
+struct _diff_cache
+{
+    char * directory;
+    size_t max_bytes;
+
+    pthread_mutex_t lock;
+    size_t used;            // bytes on disk as of the last scan and the stores since
+    CacheStats stats;
+};
+
+static unsigned long long _cache_mix(unsigned long long hash, const void * data, size_t size);
+static void _cache_name(const DiffCache * cache, unsigned long long key, const char * suffix, char * name, size_t size);
+static size_t _cache_offset(size_t tokens);
+static int _cache_check(const char * name, const CacheKey * key, size_t * offset);
+static int _cache_file(const char * name);
+static int _cache_scan(const DiffCache * cache, CacheEntry ** entries, size_t * count, size_t * total);
+static int _entry_cmp(const void * a, const void * b);
+static void _cache_evict(DiffCache * cache);
+static void _cache_add(DiffCache * cache, const char * name);
+
+// FNV-1a
+static unsigned long long _cache_mix(unsigned long long hash, const void * data, size_t size)
+{
+    const unsigned char * bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void _cache_name(const DiffCache * cache, unsigned long long key, const char * suffix, char * name, size_t size)
+{
+    snprintf(name, size, "%s/%016llx%s", cache->directory, key, suffix);
+}
+
+// where the tree of an entry starts, aligned for OpenStoredTreeAt
+static size_t _cache_offset(size_t tokens)
+{
+    return (sizeof(CacheHeader) + tokens + sizeof(field_t) - 1) / sizeof(field_t) * sizeof(field_t);
+}
+
+// 1 if name is an entry of key, 0 if it is not there or of another key,
+// -1 if it is no entry at all; offset is where its tree starts
+static int _cache_check(const char * name, const CacheKey * key, size_t * offset)
+{
+    FILE * file = fopen(name, "rb");
+    if (!file) return 0;
+
+    CacheHeader header = {};
+    int found = fread(&header, sizeof(header), 1, file) == 1 &&
+                !memcmp(header.magic, DIFF_CACHE_MAGIC, sizeof(header.magic)) ? 0 : -1;
+
+    if (!found && header.tokens == key->size)
+    {
+        char * tokens = (char*) malloc(key->size);
+        found = tokens && fread(tokens, 1, key->size, file) == key->size && !memcmp(tokens, key->tokens, key->size);
+        free(tokens);
+    }
+    fclose(file);
+
+    if (!found) TRACE_DUMP(TRACE_INFO, "%s is of another expression", name);
+
+    *offset = _cache_offset(key->size);
+    return found;
+}
+
+// a .tree or a .so of the cache, not the lock or a file still being written
+static int _cache_file(const char * name)
+{
+    size_t length = strlen(name);
+    if (length > 5 && !strcmp(name + length - 5, ".tree")) return 1;
+    if (length > 3 && !strcmp(name + length - 3, ".so")) return 1;
+    return 0;
+}
+
+static int _cache_scan(const DiffCache * cache, CacheEntry ** entries, size_t * count, size_t * total)
+{
+    DIR * dir = opendir(cache->directory);
+    if (!dir) return FOPEN_ERROR;
+
+    size_t cap = 0;
+    int error = SUCCESS;
+    *entries = NULL;
+    *count = 0;
+    *total = 0;
+
+    for (struct dirent * file = readdir(dir); file && !error; file = readdir(dir))
+    {
+        if (!_cache_file(file->d_name)) continue;
+
+        char name[DEF_SIZE] = "";
+        snprintf(name, sizeof(name), "%s/%s", cache->directory, file->d_name);
+
+        struct stat info = {};
+        if (stat(name, &info)) continue;        // removed by another process meanwhile
+
+        if (*count == cap)
+        {
+            cap = cap ? 2 * cap : 64;
+            CacheEntry * grown = (CacheEntry*) realloc(*entries, cap * sizeof(CacheEntry));
+            if (!grown)
+            {
+                error = ALLOCATE_MEMORY_ERROR;
+                break;
+            }
+            *entries = grown;
+        }
+
+        CacheEntry * entry = &(*entries)[*count];
+        entry->name = strdup(name);
+        entry->size = (size_t) info.st_size;
+        entry->used = info.st_mtim;
+        if (!entry->name) error = ALLOCATE_MEMORY_ERROR;
+        else
+        {
+            *total += entry->size;
+            (*count)++;
+        }
+    }
+
+    closedir(dir);
+    return error;
+}
+
+// the ones used longest ago first
+static int _entry_cmp(const void * a, const void * b)
+{
+    const struct timespec * x = &((const CacheEntry*) a)->used;
+    const struct timespec * y = &((const CacheEntry*) b)->used;
+
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    if (x->tv_nsec != y->tv_nsec) return x->tv_nsec < y->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Down to DIFF_CACHE_LOW percent of max_bytes. One process evicts at a time,
+// the others skip it. A file removed while another process has it mapped or
+// dlopened stays readable to that process.
+static void _cache_evict(DiffCache * cache)
+{
+    char lock_name[DEF_SIZE] = "";
+    snprintf(lock_name, sizeof(lock_name), "%s/.lock", cache->directory);
+
+    int lock = open(lock_name, O_RDWR | O_CREAT, 0644);
+    if (lock < 0) return;
+    if (flock(lock, LOCK_EX | LOCK_NB))
+    {
+        close(lock);
+        return;
+    }
+
+    CacheEntry * entries = NULL;
+    size_t count = 0;
+    size_t total = 0;
+    int error = _cache_scan(cache, &entries, &count, &total);
+
+    size_t low = cache->max_bytes / 100 * DIFF_CACHE_LOW;
+    size_t evicted = 0;
+
+    if (!error && total > low)
+    {
+        qsort(entries, count, sizeof(CacheEntry), _entry_cmp);
+        for (size_t i = 0; i < count && total > low; i++)
+        {
+            if (unlink(entries[i].name) && errno != ENOENT) continue;
+            total -= entries[i].size;
+            evicted++;
+            TRACE_DUMP(TRACE_DEBUG, "%s evicted", entries[i].name);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) free(entries[i].name);
+    free(entries);
+
+    flock(lock, LOCK_UN);
+    close(lock);
+
+    pthread_mutex_lock(&cache->lock);
+    if (!error) cache->used = total;
+    cache->stats.evictions += evicted;
+    pthread_mutex_unlock(&cache->lock);
+
+    TRACE_DUMP(TRACE_INFO, "%zu files evicted, %zu bytes left", evicted, total);
+}
+
+// counts a file just written and evicts if the cache is full now
+static void _cache_add(DiffCache * cache, const char * name)
+{
+    struct stat info = {};
+    if (stat(name, &info)) return;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->used += (size_t) info.st_size;
+    int full = cache->used > cache->max_bytes;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (full) _cache_evict(cache);
+}
+
+// directory = NULL takes DIFF_CACHE_DIR, max_bytes = 0 takes DIFF_CACHE_SIZE
+DiffCache * CreateDiffCache(const char * directory, size_t max_bytes)
+{
+    if (!directory) directory = DIFF_CACHE_DIR;
+    if (!max_bytes) max_bytes = DIFF_CACHE_SIZE;
+
+    if (mkdir(directory, 0755) && errno != EEXIST) return NULL;
+
+    DiffCache * cache = (DiffCache*) calloc(1, sizeof(DiffCache));
+    if (!cache) return NULL;
+
+    cache->directory = strdup(directory);
+    cache->max_bytes = max_bytes;
+    if (!cache->directory)
+    {
+        free(cache);
+        return NULL;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+
+    CacheEntry * entries = NULL;
+    size_t count = 0;
+    int error = _cache_scan(cache, &entries, &count, &cache->used);
+    for (size_t i = 0; i < count; i++) free(entries[i].name);
+    free(entries);
+
+    if (error)
+    {
+        DestroyDiffCache(cache);
+        return NULL;
+    }
+
+    if (cache->used > max_bytes) _cache_evict(cache);
+    return cache;
+}
+
+// The tokens of expression and their hash, so spacing and the spelling of
+// numbers do not matter and nothing is parsed. key is empty if it does not
+// lex, DestroyCacheKey frees it otherwise.
+int DiffCacheKey(const char * expression, CacheKey * key)
+{
+    if (!expression || !key) return INVALID_ARGUMENT;
+    *key = (CacheKey) {};
+
+    FILE * out = open_memstream(&key->tokens, &key->size);
+    if (!out) return ALLOCATE_MEMORY_ERROR;
+
+    Lexer * lexer = CreateLexer(expression);
+    int error = lexer ? SUCCESS : ALLOCATE_MEMORY_ERROR;
+
+    const unsigned int version[] = {DIFF_CACHE_VERSION, STORED_VERSION, (unsigned int) DIFF_VAR};
+    fwrite(version, sizeof(version), 1, out);
+
+    Token token = {};
+    while (lexer)
+    {
+        LexerRead(lexer, &token);
+        int kind = (int) token.kind;
+        fwrite(&kind, sizeof(kind), 1, out);
+        if (token.kind == TOKEN_VAR && token.value >= VAR_NAMES)
+        {
+            // the id of a longer name depends on the process, the name does not
+            const char * name = VarName((int) token.value);
+            fwrite(name, 1, strlen(name) + 1, out);
+        }
+        else fwrite(&token.value, sizeof(token.value), 1, out);
+
+        if (token.kind == TOKEN_END) break;
+    }
+
+    if (!error) error = LexerError(lexer);
+    DestroyLexer(lexer);
+
+    if (ferror(out) && !error) error = ALLOCATE_MEMORY_ERROR;
+    if (fclose(out) && !error) error = ALLOCATE_MEMORY_ERROR;
+
+    if (error) DestroyCacheKey(key);
+    else key->hash = _cache_mix(14695981039346656037ULL, key->tokens, key->size);
+    return error;
+}
+
+void DestroyCacheKey(CacheKey * key)
+{
+    if (!key) return;
+
+    free(key->tokens);
+    *key = (CacheKey) {};
+}
+
+// The derivative stored under key in a tree of its own, NULL on a miss.
+// A file that does not load is removed, one of another key is left alone.
+Tree * DiffCacheLoad(DiffCache * cache, const CacheKey * key)
+{
+    if (!cache || !key) return NULL;
+
+    char name[DEF_SIZE] = "";
+    _cache_name(cache, key->hash, ".tree", name, sizeof(name));
+
+    size_t offset = 0;
+    int found = _cache_check(name, key, &offset);
+
+    Tree * tree = NULL;
+    if (found > 0)
+    {
+        tree = CreateTree(NULL, NULL, NULL);
+        StoredTree * stored = tree ? OpenStoredTreeAt(name, offset) : NULL;
+        if (tree && (!stored || TreeLoadStored(tree, stored)))
+        {
+            found = -1;
+            DestroyTree(tree);
+            tree = NULL;
+        }
+        CloseStoredTree(stored);
+    }
+
+    if (found < 0)
+    {
+        TRACE_DUMP(TRACE_ERROR, "%s does not load, removed", name);
+        remove(name);
+    }
+
+    if (tree) utimensat(AT_FDCWD, name, NULL, 0);
+
+    pthread_mutex_lock(&cache->lock);
+    if (tree) cache->stats.hits++;
+    else cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return tree;
+}
+
+// The entry replaces whatever is under the hash of key, the evaluator of
+// the expression it was of goes with it.
+int DiffCacheStore(DiffCache * cache, const CacheKey * key, Tree * derivative)
+{
+    if (!cache || !key || !derivative) return INVALID_ARGUMENT;
+
+    char name[DEF_SIZE] = "";
+    char so_name[DEF_SIZE] = "";
+    char tmp_name[DEF_SIZE + 32] = "";
+    _cache_name(cache, key->hash, ".tree", name, sizeof(name));
+    _cache_name(cache, key->hash, ".so", so_name, sizeof(so_name));
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.%llx.tmp", name, (long) getpid(), (unsigned long long) pthread_self());
+
+    FILE * out = fopen(tmp_name, "wb");
+    if (!out) return FOPEN_ERROR;
+
+    CacheHeader header = {};
+    memcpy(header.magic, DIFF_CACHE_MAGIC, sizeof(header.magic));
+    header.tokens = key->size;
+
+    const char zeros[sizeof(field_t)] = {};
+    size_t pad = _cache_offset(key->size) - sizeof(header) - key->size;
+
+    int error = SUCCESS;
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(key->tokens, 1, key->size, out) != key->size ||
+        fwrite(zeros, 1, pad, out) != pad) error = FOPEN_ERROR;
+
+    if (!error) error = TreeSaveTo(derivative, out);
+    if (fclose(out) && !error) error = FCLOSE_ERROR;
+
+    if (!error) unlink(so_name);
+    if (!error && rename(tmp_name, name)) error = FOPEN_ERROR;
+    if (error)
+    {
+        remove(tmp_name);
+        return error;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->stats.stores++;
+    pthread_mutex_unlock(&cache->lock);
+
+    _cache_add(cache, name);
+    return SUCCESS;
+}
+
+// The simplified derivative of expression by DIFF_VAR: loaded on a hit,
+// parsed, differentiated, simplified and stored on a miss. A failed store
+// only loses the entry.
+Tree * DiffCached(DiffCache * cache, const char * expression, int * error)
+{
+    if (!cache || !expression || !error) return NULL;
+
+    CacheKey key = {};
+    *error = DiffCacheKey(expression, &key);
+    if (*error) return NULL;
+
+    Tree * diff = DiffCacheLoad(cache, &key);
+    if (diff)
+    {
+        DestroyCacheKey(&key);
+        return diff;
+    }
+
+    Tree * tree = CreateTree(NULL, NULL, NULL);
+    if (!tree)
+    {
+        DestroyCacheKey(&key);
+        *error = ALLOCATE_MEMORY_ERROR;
+        return NULL;
+    }
+
+    *error = TreeParseString(tree, expression);
+    if (!*error)
+    {
+        diff = DiffTree(tree);
+        if (!diff) *error = ALLOCATE_MEMORY_ERROR;
+    }
+    if (diff) *error = TreeSimplify(diff, NULL);
+    DestroyTree(tree);
+
+    int stored = *error ? SUCCESS : DiffCacheStore(cache, &key, diff);
+    if (stored) TRACE_DUMP(TRACE_ERROR, "%016llx is not stored: %d", key.hash, stored);
+    DestroyCacheKey(&key);
+
+    if (*error)
+    {
+        DestroyTree(diff);
+        return NULL;
+    }
+
+    return diff;
+}
+
+// The evaluator of the derivative under key: opened if it was compiled
+// before, compiled from derivative otherwise (NULL to only look it up).
+// It belongs to the .tree of the entry, so that has to be of key; if it is
+// not, derivative is stored first.
+Native * DiffCacheNative(DiffCache * cache, const CacheKey * key, Tree * derivative)
+{
+    if (!cache || !key) return NULL;
+
+    char name[DEF_SIZE] = "";
+    char tree_name[DEF_SIZE] = "";
+    _cache_name(cache, key->hash, ".so", name, sizeof(name));
+    _cache_name(cache, key->hash, ".tree", tree_name, sizeof(tree_name));
+
+    size_t offset = 0;
+    int ours = _cache_check(tree_name, key, &offset) > 0;
+
+    Native * native = !ours || access(name, R_OK) ? NULL : OpenNative(name);
+    if (native)
+    {
+        utimensat(AT_FDCWD, name, NULL, 0);
+        pthread_mutex_lock(&cache->lock);
+        cache->stats.hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return native;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!derivative) return NULL;
+    if (!ours && DiffCacheStore(cache, key, derivative)) return NULL;
+
+    native = CompileNativeFile(derivative, name);
+    if (!native) return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->stats.stores++;
+    pthread_mutex_unlock(&cache->lock);
+
+    _cache_add(cache, name);
+    return native;
+}
+
+void DiffCacheGetStats(DiffCache * cache, CacheStats * stats)
+{
+    if (!cache || !stats) return;
+
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void DestroyDiffCache(DiffCache * cache)
+{
+    if (!cache) return;
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->directory);
+    free(cache);
+}
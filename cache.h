@@ -0,0 +1,70 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "diff.h"
+#include "codegen.h"
+
+// Simplified derivatives on disk, one file per expression named by the hash
+// of its tokens, and optionally the evaluator compiled from it. The file
+// holds the tokens too, an entry of another expression of the same hash is
+// a miss. Files are written under a name of the process and renamed in
+// place, so processes can share a directory; past max_bytes the ones used
+// longest ago are removed.
+typedef struct _diff_cache DiffCache;
+
+// the tokens of an expression as they are hashed, without what does not
+// change the derivative: spacing and the spelling of numbers
+typedef struct _cache_key
+{
+    unsigned long long hash;    // names the files of the entry
+    char * tokens;
+    size_t size;
+
+} CacheKey;
+
+// A .tree file of the cache: the header, the tokens of its key, zeros up to
+// a multiple of 8 and a file of TreeSave.
+typedef struct _cache_header
+{
+    char magic[8];
+    uint64_t tokens;            // bytes of the key after the header
+
+} CacheHeader;
+
+typedef struct _cache_stats
+{
+    size_t hits;
+    size_t misses;
+    size_t stores;
+    size_t evictions;
+
+} CacheStats;
+
+const char * const DIFF_CACHE_DIR = "./tmp/cache";
+const size_t DIFF_CACHE_SIZE = 256 << 20;
+const unsigned int DIFF_CACHE_VERSION = 2;     // bump when DiffTree or TreeSimplify give other trees
+const char DIFF_CACHE_MAGIC[8] = {'D', 'I', 'F', 'F', 'K', 'E', 'Y', 'S'};
+const size_t DIFF_CACHE_LOW = 80;              // percent of max_bytes left after an eviction
+
+DiffCache * CreateDiffCache(const char * directory, size_t max_bytes);
+
+int DiffCacheKey(const char * expression, CacheKey * key);
+
+void DestroyCacheKey(CacheKey * key);
+
+Tree * DiffCacheLoad(DiffCache * cache, const CacheKey * key);
+
+int DiffCacheStore(DiffCache * cache, const CacheKey * key, Tree * derivative);
+
+Tree * DiffCached(DiffCache * cache, const char * expression, int * error);
+
+Native * DiffCacheNative(DiffCache * cache, const CacheKey * key, Tree * derivative);
+
+void DiffCacheGetStats(DiffCache * cache, CacheStats * stats);
+
+void DestroyDiffCache(DiffCache * cache);
+
+#endif
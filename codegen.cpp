@@ -0,0 +1,337 @@
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "codegen.h"
+#include "node.h"
+#include "map.h"
+
+struct _native
+{
+    void * handle;
+    NativeFunc scalar;
+    NativeArrayFunc array;
+};
+
+// Every unique node of the tree becomes one temporary, so shared subtrees
+// of a DiffTree result are computed once instead of being printed out again.
+typedef struct _emitter
+{
+    FILE * out;
+    Map * done;             // node -> temporary + 1
+    size_t temps;
+    int var;                // the one variable bound to the argument
+    int error;
+
+} Emitter;
+
+static size_t _emit_node(Emitter * e, Node * node);
+static const char * _func_call(int func);
+static unsigned long long _source_hash(const char * source, size_t size);
+static int _make_dirs(const char * path);
+static int _compile_source(const char * source, const char * so_name);
+
+// the C of a function up to its argument, "(t%zu)" follows
+static const char * _func_call(int func)
+{
+    switch (func)
+    {
+        case SIN:       return "sin";
+        case COS:       return "cos";
+        case TG:        return "tan";
+        case CTG:       return "1 / tan";
+        case SH:        return "sinh";
+        case CH:        return "cosh";
+        case TH:        return "tanh";
+        case CTH:       return "1 / tanh";
+        case LN:        return "log";
+        case LOG:       return "log10";
+        case EX:        return "exp";
+        case ARCSIN:    return "asin";
+        case ARCCOS:    return "acos";
+        case ARCTG:     return "atan";
+        case ARCCTG:    return "1.57079632679489661923 - atan";
+        default:        return NULL;
+    }
+}
+
+// post-order like _compile_node, a temporary is declared after its operands
+static size_t _emit_node(Emitter * e, Node * node)
+{
+    if (!node)
+    {
+        e->error = UNKNOWN_NODE;
+        return 0;
+    }
+
+    void * known = MapFind(e->done, node);
+    if (known) return (size_t) known - 1;
+
+    size_t left = 0;
+    size_t right = 0;
+    field_t value = NodeValue(node);
+
+    switch (NodeType(node))
+    {
+        case NUM:
+            if (isfinite(value))
+                fprintf(e->out, "    const double t%zu = %a;\n", e->temps, value);
+            else
+                fprintf(e->out, "    const double t%zu = %s;\n", e->temps, isnan(value) ? "NAN" : value > 0 ? "INFINITY" : "-INFINITY");
+            break;
+
+        case VAR:
+            // e only appears as the constant made by DiffHARDPOW
+            if ((int) value == EX)
+            {
+                fprintf(e->out, "    const double t%zu = %a;\n", e->temps, M_E);
+                break;
+            }
+
+            if (!e->var) e->var = (int) value;
+            if (e->var != (int) value) e->error = INVALID_ARGUMENT;
+            fprintf(e->out, "    const double t%zu = x;\n", e->temps);
+            break;
+
+        case OPER:
+            left = _emit_node(e, node->left);
+            right = _emit_node(e, node->right);
+
+            if ((int) value == POW)
+                fprintf(e->out, "    const double t%zu = pow(t%zu, t%zu);\n", e->temps, left, right);
+            else if (strchr("+-*/", (int) value))
+                fprintf(e->out, "    const double t%zu = t%zu %c t%zu;\n", e->temps, left, (int) value, right);
+            else
+                e->error = UNKNOWN_NODE;
+            break;
+
+        case FUNC:
+        {
+            left = _emit_node(e, node->left);
+            right = node->right ? _emit_node(e, node->right) : left;
+
+            if ((int) value == AX)
+            {
+                fprintf(e->out, "    const double t%zu = pow(t%zu, t%zu);\n", e->temps, left, right);
+                break;
+            }
+
+            const char * call = _func_call((int) value);
+            if (!call)
+            {
+                e->error = UNKNOWN_NODE;
+                break;
+            }
+
+            fprintf(e->out, "    const double t%zu = %s(t%zu);\n", e->temps, call, left);
+            break;
+        }
+
+        case ERROR:
+        default:
+            e->error = UNKNOWN_NODE;
+            return 0;
+    }
+
+    if (MapInsert(e->done, node, (void*) (e->temps + 1))) e->error = ALLOCATE_MEMORY_ERROR;
+    return e->temps++;
+}
+
+// Prints the tree as a C translation unit: double f(double x) and
+// void f_array(const double * xs, double * ys, size_t count).
+// The tree may have at most one variable, it is bound to x.
+int TreeToC(Tree * tree, FILE * out)
+{
+    if (!tree || !tree->root || !out) return INVALID_ARGUMENT;
+
+    Emitter e = {};
+    e.out = out;
+    e.done = CreateMap(0);
+    if (!e.done) return ALLOCATE_MEMORY_ERROR;
+
+    fprintf(out,    "#include <math.h>\n"
+                    "#include <stddef.h>\n\n"
+                    "static inline double _expr(double x)\n"
+                    "{\n"
+                    "    (void) x;\n");
+
+    size_t result = _emit_node(&e, tree->root);
+    DestroyMap(e.done);
+
+    fprintf(out,    "    return t%zu;\n"
+                    "}\n\n"
+                    "double f(double x)\n"
+                    "{\n"
+                    "    return _expr(x);\n"
+                    "}\n\n"
+                    "void f_array(const double * restrict xs, double * restrict ys, size_t count)\n"
+                    "{\n"
+                    "    for (size_t i = 0; i < count; i++)\n"
+                    "        ys[i] = _expr(xs[i]);\n"
+                    "}\n", result);
+
+    return e.error;
+}
+
+// FNV-1a over the generated source, equal sources share one shared object
+static unsigned long long _source_hash(const char * source, size_t size)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= (unsigned char) source[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static int _make_dirs(const char * path)
+{
+    char dir[DEF_SIZE] = "";
+    if (strlen(path) >= sizeof(dir)) return INVALID_ARGUMENT;
+    strcpy(dir, path);
+
+    for (char * slash = strchr(dir + 1, '/'); ; slash = strchr(slash + 1, '/'))
+    {
+        if (slash) *slash = '\0';
+        if (mkdir(dir, 0755) && errno != EEXIST) return FOPEN_ERROR;
+        if (!slash) return SUCCESS;
+        *slash = '/';
+    }
+}
+
+// The object is built under a name of this process and renamed in place,
+// so a concurrent run never dlopens a half written file.
+static int _compile_source(const char * source, const char * so_name)
+{
+    char c_name[DEF_SIZE] = "";
+    char tmp_name[DEF_SIZE] = "";
+    char command[3 * DEF_SIZE] = "";
+
+    snprintf(c_name, sizeof(c_name), "%s.%ld.c", so_name, (long) getpid());
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", so_name, (long) getpid());
+
+    FILE * file = fopen(c_name, "wb");
+    if (!file) return FOPEN_ERROR;
+    fputs(source, file);
+    if (fclose(file)) return FCLOSE_ERROR;
+
+    const char * cc = getenv("CC");
+    snprintf(command, sizeof(command), "%s -std=c99 -O3 -march=native -fno-math-errno -shared -fPIC -o '%s' '%s' -lm",
+             cc ? cc : "cc", tmp_name, c_name);
+
+    int status = system(command);
+    remove(c_name);
+
+    if (status || rename(tmp_name, so_name))
+    {
+        remove(tmp_name);
+        return FOPEN_ERROR;
+    }
+
+    return SUCCESS;
+}
+
+// the object at filename, NULL if it is not there or has no f and f_array
+Native * OpenNative(const char * filename)
+{
+    if (!filename) return NULL;
+
+    Native * native = (Native*) calloc(1, sizeof(Native));
+    if (!native) return NULL;
+
+    native->handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+    if (native->handle)
+    {
+        // POSIX lets a void * hold a function, C++ only converts it by copy
+        void * scalar = dlsym(native->handle, "f");
+        void * array = dlsym(native->handle, "f_array");
+        memcpy(&native->scalar, &scalar, sizeof(scalar));
+        memcpy(&native->array, &array, sizeof(array));
+    }
+
+    if (!native->scalar || !native->array)
+    {
+        DestroyNative(native);
+        return NULL;
+    }
+
+    return native;
+}
+
+// an object named by the source hash in cache_dir, compiled only if it is not there yet
+Native * CompileNative(Tree * tree, const char * cache_dir)
+{
+    if (!tree) return NULL;
+    if (!cache_dir) cache_dir = NATIVE_CACHE_DIR;
+
+    char * source = NULL;
+    size_t size = 0;
+    FILE * out = open_memstream(&source, &size);
+    if (!out) return NULL;
+
+    int error = TreeToC(tree, out);
+    fclose(out);
+
+    char so_name[DEF_SIZE] = "";
+    snprintf(so_name, sizeof(so_name), "%s/f_%016llx.so", cache_dir, _source_hash(source, size));
+
+    if (!error && access(so_name, R_OK))
+    {
+        error = _make_dirs(cache_dir);
+        if (!error) error = _compile_source(source, so_name);
+    }
+
+    free(source);
+    if (error) return NULL;
+
+    return OpenNative(so_name);
+}
+
+// compiled to filename whatever is there, its directory has to exist
+Native * CompileNativeFile(Tree * tree, const char * filename)
+{
+    if (!tree || !filename) return NULL;
+
+    char * source = NULL;
+    size_t size = 0;
+    FILE * out = open_memstream(&source, &size);
+    if (!out) return NULL;
+
+    int error = TreeToC(tree, out);
+    fclose(out);
+
+    if (!error) error = _compile_source(source, filename);
+
+    free(source);
+    if (error) return NULL;
+
+    return OpenNative(filename);
+}
+
+NativeFunc NativeScalar(const Native * native)
+{
+    if (!native) return NULL;
+    return native->scalar;
+}
+
+NativeArrayFunc NativeArray(const Native * native)
+{
+    if (!native) return NULL;
+    return native->array;
+}
+
+void DestroyNative(Native * native)
+{
+    if (!native) return;
+    if (native->handle) dlclose(native->handle);
+    free(native);
+}
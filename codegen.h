@@ -0,0 +1,29 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include <stdio.h>
+
+#include "diff.h"
+
+typedef field_t (*NativeFunc)       (field_t x);
+typedef void    (*NativeArrayFunc)  (const field_t * xs, field_t * ys, size_t count);
+
+typedef struct _native Native;
+
+const char * const NATIVE_CACHE_DIR = "./tmp/native";
+
+int TreeToC(Tree * tree, FILE * out);
+
+Native * CompileNative(Tree * tree, const char * cache_dir);
+
+Native * CompileNativeFile(Tree * tree, const char * filename);
+
+Native * OpenNative(const char * filename);
+
+NativeFunc NativeScalar(const Native * native);
+
+NativeArrayFunc NativeArray(const Native * native);
+
+void DestroyNative(Native * native);
+
+#endif
@@ -4,49 +4,55 @@
 #include <ctype.h>
 #include <math.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 #include <ctype.h>
 
 #include "buff.h"
 #include "diff.h"
-
-#define DEBUG
-
-typedef struct _node
-{
-    void * value;
-    struct _node * left;
-    struct _node * right;
-
-} Node;
-
-struct _tree
-{
-    Node * root;
-    TreeInit init;
-    TreeCmp cmp;
-    TreeFree free;
-};
+#include "arena.h"
+#include "map.h"
+#include "node.h"
+#include "pool.h"
+#include "lexer.h"
+#include "stack.h"
+#include "trace.h"
+
+// arena and unique table that _create_node/_create_field work with,
+// entry points switch them to the ones of the tree they build
+static thread_local Arena * CurrentArena = NULL;
+static thread_local Table * CurrentTable = NULL;
+
+#define ENTER_TREE(tree)                                                        \
+    Arena * saved_arena = CurrentArena;                                         \
+    Table * saved_table = CurrentTable;                                         \
+    CurrentArena = (tree)->arena;                                               \
+    CurrentTable = (tree)->table;
+
+#define LEAVE_TREE                                                              \
+    CurrentArena = saved_arena;                                                 \
+    CurrentTable = saved_table;
 
 static int _create_node(Tree * t, Node ** node, const void * pair);
 int _tree_parse(Tree* tree, Node ** node, const char ** string);
-Tree * _tree_dump_func(Tree * tree, Node ** node, FILE * Out);
+typedef struct _dump_walk DumpWalk;
+void _dump_node(Node * node, size_t id, FILE * Out);
+void _dump_cut(DumpWalk * walk, Node * node, size_t id);
+int _dump_reach(DumpWalk * walk, Node * node, size_t depth, size_t * id);
+int _tree_dump_func(DumpWalk * walk, Node * root);
+FILE * _open_replace(const char * name, char * tmp_name, size_t size);
+int _close_replace(FILE * file, const char * tmp_name, const char * name, int error);
 Node * _insert_tree(Tree * t, Node ** root, const void * pair);
 void _destroy_tree(Tree * t, Node * n);
 
-const char * enum_to_name(int name);
-
-int SyntaxError(char exp, char real, const char * func, int line);
-Node ** StringTokenize(const char * string, int * p);
+int _parse_lexer(Tree * tree, Lexer * lex);
 
-Node * GetG(Node ** nodes, int * p);
-Node * GetE(Node ** nodes, int * p);
-Node * GetT(Node ** nodes, int * p);
-Node * GetPow(Node ** nodes, int * p);
-Node * GetP(Node ** nodes, int * p);
-Node * GetFunc(Node ** nodes, int * p);
-Node * GetN(Node ** nodes, int * p);
-Node * GetX(Node ** nodes, int * p);
+Node * GetG(Lexer * lex);
+Node * GetN(const Token * token);
+Node * GetX(const Token * token);
 
 void * DiffCONST(void * node);
 void * DiffX(void * node);
@@ -72,7 +78,7 @@ void * DiffHARDPOW(void * node);
 // void * DiffARCTG(void * node);
 // void * DiffARCCTG(void * node);
 
-static Field NameTable[DEF_SIZE]
+static const Field NameTable[DEF_SIZE]
 {
     {.type = FUNC,      .value = SIN,       .diff = DiffSIN},
     {.type = FUNC,      .value = COS,       .diff = DiffCOS},
@@ -92,314 +98,846 @@ static Field NameTable[DEF_SIZE]
     // {.type = FUNC,      .value = ARCCTG,    .diff = DiffARCCTG}
 };
 
-Node * _copy_branch(Node * node);
-Node * _copy_node(Node * node);
+int _relink_node(Node ** node, Node * left, Node * right);
+
+Table * _create_table(Arena * arena);
+unsigned int _node_hash(Field * field, Node * left, Node * right);
+Node * _table_find(Table * table, unsigned int hash, Field * field, Node * left, Node * right);
+int _table_grow(Table * table, size_t size);
+int _table_insert(Table * table, Node * node);
+void _table_remove(Table * table, Node * node);
+int _table_forget_diffs(Table * table);
+int _table_share(Table * table, size_t size);
+void _table_unshare(Table * table);
+pthread_mutex_t * _table_lock(Table * table, unsigned int hash);
+int _retain_node(Node * node);
 Field * _copy_field(Field * field);
-Node * _create_node(Field * val, Node * left, Node * right);
-Field * _create_field(field_t val, enum types type, Diff diff);
 
 Node * _diff_tree(Node * node);
 
-field_t _node_count(Node * node, field_t val, field_t var);
+size_t _tree_size(Node * node);
+void _print_node(Node * node, FILE * out);
 
 unsigned int NodeColor(Node * node);
-field_t NodeValue(Node * node);
-enum types NodeType(Node * node);
-Diff NodeDiff(Node * node);
 
-#ifdef DEBUG
-#define DESTROY(...)                                                             \
-    {                                                                            \
-    fprintf(stderr, ">>> %s:%d: ", __func__, __LINE__);                          \
-    fprintf(stderr, __VA_ARGS__);                                                \
-    fprintf(stderr, "\n");                                                       \
-    }
-#else
-#define DESTROY(...)
-#endif
 
+Node * _simplify_rule(Node * node, int * error);
+Node * _rehash_node(Node * node, Node * left, Node * right);
+Node * _tree_simplify(Node * node, Map * done, size_t * rewrites, int * error);
+typedef struct _simplify_frame SimplifyFrame;
+Node * _simplify_node(SimplifyFrame * frame, Node * right, Map * done, size_t * rewrites, int * error);
+void _release_done(void * key, void * value);
+int _simplify_tree(Tree * tree, size_t threads, SimplifyStats * stats);
+Tree * _diff_tree_by(Tree * tree, int var, size_t threads);
+
+// Fork-join over one big tree: the subtrees of at most PARALLEL_CUTOFF
+// nodes right under the bigger ones are tasks of a pool, the few big nodes
+// above them are done afterwards by the calling thread.
+typedef struct _fork
+{
+    Tree * tree;
+    Arena ** arenas;        // one per pool thread, adopted by the tree at the join
+    Map ** done;            // one per pool thread, shared subtrees are simplified once by it
+    Node ** tasks;
+    Node ** results;
+    size_t * rewrites;
+    int * errors;
+    size_t count;
+    size_t cap;
+    int diff;               // tasks are differentiated instead of simplified
+
+} Fork;
+
+// walks that used to recurse on depth keep their nodes in a Stack (see stack.h)
+typedef struct _node_frame
+{
+    Node * node;
+    int expanded;           // the children are pushed above it
+
+} NodeFrame;
+
+// the LaTeX of an operator is open, left operand, middle, right operand, close
+typedef struct _tex_oper
+{
+    int op;
+    const char * open;
+    const char * middle;
+    const char * close;
+
+} TexOper;
+
+static const TexOper TexOpers[] =
+{
+    {ADD, "({",      "} + {",      "})"},
+    {SUB, "({",      "} - {",      "})"},
+    {MUL, "({",      "} \\cdot {", "})"},
+    {POW, "{",       "}^{",        "}"},
+    {DIV, "\\frac{", "}{",         "}"},
+};
+
+int _push_node(Stack * stack, Node * node);
+int _push_frame(Stack * stack, Node * node);
+
+const TexOper * _find_tex_oper(Node * node);
+int _tex_node(Node * node, FILE * out);
+void _tex_begin(FILE * out);
+void _tex_end(FILE * out);
+int _unref_node(Node * node);
+Node * _diff_node(Node * node);
+
+// How tight an infix operator holds its operands. It takes the operand on
+// its left from the operator waiting for it when its left power is above
+// that one's right power, so right > left is left-associative.
+typedef struct _binding
+{
+    int op;
+    int left;
+    int right;
+
+} Binding;
+
+static const Binding Bindings[] =
+{
+    {ADD, 10, 11},
+    {SUB, 10, 11},
+    {MUL, 20, 21},
+    {DIV, 20, 21},
+    {POW, 31, 30},      // 2^3^2 is 2^(3^2)
+};
 
-int FindVar(Node * node);
+// right powers of the prefixes
+const int PARSE_GROUP = 0;
+const int PARSE_NEG = 25;       // -x^2 is -(x^2)
+const int PARSE_FUNC = 40;      // a function takes the primary after it, sin x^2 is (sin x)^2
+
+// a prefix or an infix operator waiting for the operand on its right
+typedef struct _parse_frame
+{
+    Node * left;            // NULL for a prefix
+    enum token_kinds kind;
+    int op;                 // the function or the character
+    int right;
+
+} ParseFrame;
+
+const Binding * _parse_binding(const Token * token);
+int _parse_prefix(const Token * token);
+Node * _parse_apply(const ParseFrame * frame, Node * right);
+Field * _parse_field(int op, Node * left, Node * right);
+
+// an operand of a + or * chain and the hash it is ordered by
+typedef struct _canon_item
+{
+    Node * node;
+    uint64_t hash;
+
+} CanonItem;
+
+// places in the canonical order, by enum types: numbers, variables, functions, operators
+static const int CanonRanks[] = {3, 1, 0, 2};
+
+uint64_t _mix_hash(uint64_t hash);
+int _chain_op(Node * node);
+int _same_value(field_t value, field_t expected);
+uint64_t _field_hash(Node * node);
+uint64_t _hash_of(Node * node, Map * hashes);
+uint64_t _chain_term(Node * node, int op, Map * hashes);
+uint64_t _structure_hash(Node * node, Map * hashes);
+int _hash_node(Node * node, Map * hashes);
+int _hash_nodes(Node * root, Map * hashes);
+int _canon_field_cmp(Node * a, Node * b);
+int _canon_deep_cmp(Node * a, Node * b);
+int _canon_cmp(const void * a, const void * b);
+int _canon_operand(Stack * items, Node * operand, int op, field_t * constant, Map * hashes);
+int _chain_operands(Node * node, int op, Stack * operands);
+Node * _canon_chain(Node * node, int op, Map * done, Map * hashes, int * error);
+Node * _canon_node(Node * node, Map * done, Map * hashes, int * error);
+Node * _canon_root(Tree * tree, uint64_t * hash, int * error);
+int _canon_equal(Tree * a, Tree * b);
+
+int _store_order(Node * root, Map * index, Stack * order);
+Diff _stored_rule(const StoredTree * stored, size_t i);
+field_t _stored_value(const StoredTree * stored, size_t i);
+int _stored_bulk(const StoredTree * stored, Node ** nodes);
+Field _name_table(int name);
+size_t _known_weight(Node * node, Map * weights);
+size_t _node_weight(Node * node, Map * weights);
+int _fork_collect(Fork * fork, Node * node, Map * weights, Map * seen);
+void _fork_task(void * arg, size_t index, size_t worker);
+int _fork_tree(Fork * fork, size_t threads);
+void _fork_free(Fork * fork);
 
 Tree * CreateTree(TreeInit init, TreeCmp cmp, TreeFree free)
 {
     Tree * t = (Tree*) malloc(sizeof(Tree));
     if (!t) return NULL;
-    *t = (Tree) {NULL, init, cmp, free};
-    return t;
-}
 
-static int _create_node(Tree * t, Node ** node, const void * pair)
-{
-    if (!*node)
+    Arena * arena = CreateArena(ARENA_BLOCK_SIZE);
+    Table * table = _create_table(arena);
+    if (!table)
     {
-        if (((*node) = (Node *) malloc(sizeof(Node))) == NULL) return 0;
-        **node = (Node) {t->init ? t->init(pair) : (void*) pair, NULL, NULL};
-        return 0;
+        DestroyArena(arena);
+        free(t);
+        return NULL;
     }
 
-    if (t->cmp(pair, (*node)->value) > 0)
-        return _create_node(t, &(*node)->right, pair);
-    else
-        return _create_node(t, &(*node)->left, pair);
+    *t = (Tree) {NULL, init, cmp, free, arena, table, 0};
+    return t;
+}
 
-    (*node)->left = (*node)->right = NULL;
+static int _create_node(Tree * t, Node ** node, const void * pair)
+{
+    while (*node)
+        node = t->cmp(pair, (*node)->value) > 0 ? &(*node)->right : &(*node)->left;
 
+    if (((*node) = (Node *) ArenaAlloc(t->arena, sizeof(Node))) == NULL) return 0;
+    **node = (Node) {t->init ? t->init(pair) : (void*) pair, NULL, NULL, 1};
+    if (t->init) t->owned++;
     return 0;
 }
 
 int CreateNode(Tree * t, const void * pair)
 {
+    t->hashed = 0;
+    t->canonical = 0;
     return _create_node(t, &t->root, pair);
 }
 
 Node * _insert_tree(Tree * t, Node ** root, const void * pair)
 {
-    if (!*root)
-    {
-        if ((*root = (Node*) malloc(sizeof(Node))) == NULL) return NULL;
-        (*root)->value = t->init ? t->init(pair) : (void*) pair;
-        (*root)->right = NULL;
-        (*root)->left = NULL;
-        return *root;
-    }
+    while (*root)
+        root = t->cmp(pair, (*root)->value) > 0 ? &(*root)->right : &(*root)->left;
 
-    if (t->cmp(pair, (*root)->value) > 0)
-        return _insert_tree(t, &(*root)->right, pair);
-    else
-        return _insert_tree(t, &(*root)->left, pair);
+    if ((*root = (Node*) ArenaAlloc(t->arena, sizeof(Node))) == NULL) return NULL;
+    (*root)->value = t->init ? t->init(pair) : (void*) pair;
+    if (t->init) t->owned++;
+    (*root)->right = NULL;
+    (*root)->left = NULL;
+    (*root)->refs = 1;
+    return *root;
 }
 
 int InsertTree(Tree * t, const void * pair)
 {
+    t->hashed = 0;
+    t->canonical = 0;
     return !!_insert_tree(t, &t->root, pair);
 }
 
 
-Tree * _tree_dump_func(Tree * tree, Node ** node, FILE * Out)
+// a node of the graph reached for the first time, the next id is its own
+typedef struct _dump_item
 {
+    Node * node;
+    size_t id;
+    size_t depth;
 
-    if (!tree)
-        return NULL;
+} DumpItem;
 
-    if (!*node) return NULL;
+// One TreeDumpWith: the nodes in the graph by their id + 1, a shared subtree
+// is written once and the edges of all its parents point at it.
+typedef struct _dump_walk
+{
+    const DumpOptions * options;
+    FILE * Out;
+    Map * ids;
+    Map * weights;          // sizes of the subtrees that are cut
+    Stack queue;            // read from head on, never popped
+    size_t head;
+    size_t count;           // ids given
+    size_t shown;
+    size_t cut;
+    size_t edges;
+
+} DumpWalk;
 
-    unsigned int color = NodeColor(*node);
-    field_t field = NodeValue(*node);
+void _dump_node(Node * node, size_t id, FILE * Out)
+{
+    unsigned int color = NodeColor(node);
+    field_t field = NodeValue(node);
 
-    switch (((Field*)(*node)->value)->type)
+    fprintf(Out, "n%zu [label = \"", id);
+    switch (((Field*)node->value)->type)
     {
-        case OPER:  fprintf(Out, "node%p [shape = Mrecord; label = \"{%c | %p}\"; style = filled; fillcolor = \"#%06X\"];\n",
-                    *node, (int) field, *node, color);
+        case OPER:  fprintf(Out, "%c", (int) field);
                     break;
 
-        case VAR:   fprintf(Out, "node%p [shape = Mrecord; label = \"{%c | %p}\"; style = filled; fillcolor = \"#%06X\"];\n",
-                    *node, (int) field, *node, color);
+        case VAR:   fputs(VarName((int) field), Out);
                     break;
 
-        case NUM:   fprintf(Out, "node%p [shape = Mrecord; label = \"{%lg | %p}\"; style = filled; fillcolor = \"#%06X\"];\n",
-                    *node, *node, field, color);
+        case NUM:   fprintf(Out, "%lg", field);
                     break;
 
-        case FUNC:  fprintf(Out, "node%p [shape = Mrecord; label = \"{%s | %p}\"; style = filled; fillcolor = \"#%06X\"];\n",
-                    *node, enum_to_name((int) field), *node, color);
+        case FUNC:  fputs(enum_to_name((int) field), Out);
                     break;
 
-        default:    fprintf(Out, "node%p [shape = Mrecord; label = \"{}\"; style = filled; fillcolor = \"#%06X\"];\n",
-                    *node, color);
-                    break;
+        default:    break;
+    }
+    fprintf(Out, "\"; fillcolor = \"#%06X\"];\n", color);
+}
+
+// the subtree past the limits is one box with the number of its nodes
+void _dump_cut(DumpWalk * walk, Node * node, size_t id)
+{
+    size_t weight = _node_weight(node, walk->weights);
+    fprintf(walk->Out, "n%zu [shape = box; style = dashed; label = \"%zu node%s\"];\n",
+            id, weight, weight == 1 ? "" : "s");
+    walk->cut++;
+}
 
+// the id of the node, given and written out the first time it is reached
+int _dump_reach(DumpWalk * walk, Node * node, size_t depth, size_t * id)
+{
+    size_t known = (size_t) MapFind(walk->ids, node);
+    if (known)
+    {
+        *id = known - 1;
+        return SUCCESS;
     }
 
-    if ((*node)->left)
-        fprintf(Out, "node%p -> node%p\n", *node, (*node)->left);
+    *id = walk->count++;
+    if (MapInsert(walk->ids, node, (void*) (*id + 1))) return ALLOCATE_MEMORY_ERROR;
 
-    if ((*node)->right)
-        fprintf(Out, "node%p -> node%p\n", *node, (*node)->right);
+    const DumpOptions * options = walk->options;
+    if ((options->max_depth && depth >= options->max_depth) ||
+        (options->max_nodes && walk->shown >= options->max_nodes))
+    {
+        _dump_cut(walk, node, *id);
+        return SUCCESS;
+    }
 
-    _tree_dump_func(tree, &(*node)->left, Out);
-    _tree_dump_func(tree, &(*node)->right, Out);
+    DumpItem * item = (DumpItem*) StackPush(&walk->queue);
+    if (!item) return ALLOCATE_MEMORY_ERROR;
 
-    return tree;
+    *item = (DumpItem) {node, *id, depth};
+    _dump_node(node, *id, walk->Out);
+    walk->shown++;
+    return SUCCESS;
 }
 
-Tree * TreeDump(Tree * tree, const char * FileName)
+// breadth-first, so a node budget keeps the top levels of the tree
+int _tree_dump_func(DumpWalk * walk, Node * root)
+{
+    size_t id = 0;
+    int error = _dump_reach(walk, root, 0, &id);
+
+    while (!error && walk->head < StackCount(&walk->queue))
+    {
+        DumpItem item = *(DumpItem*) StackAt(&walk->queue, walk->head++);
+        Node * children[] = {item.node->left, item.node->right};
+
+        for (int i = 0; i < 2 && !error; i++)
+        {
+            if (!children[i]) continue;
+
+            error = _dump_reach(walk, children[i], item.depth + 1, &id);
+            if (error) break;
+
+            fprintf(walk->Out, "n%zu -> n%zu;\n", item.id, id);
+            walk->edges++;
+        }
+    }
+
+    return error;
+}
+
+// written under a name of this thread first, _close_replace renames it
+// over name, so whoever reads name never gets half of a file
+FILE * _open_replace(const char * name, char * tmp_name, size_t size)
+{
+    snprintf(tmp_name, size, "%s.%ld.%llx.tmp", name, (long) getpid(), (unsigned long long) pthread_self());
+    return fopen(tmp_name, "wb");
+}
+
+int _close_replace(FILE * file, const char * tmp_name, const char * name, int error)
+{
+    if (fclose(file) && !error) error = FCLOSE_ERROR;
+    if (!error && rename(tmp_name, name)) error = FOPEN_ERROR;
+    if (error) remove(tmp_name);
+    return error;
+}
+
+// Graphviz source of the tree in FileName, a picture FileName.format if
+// options->dot asks for one; TreeDump is this with DUMP_DEFAULTS. A dot
+// left running reads a whole file even if the tree is dumped again, its
+// picture is moved in place once it is done.
+int TreeDumpWith(Tree * tree, const char * FileName, const DumpOptions * options)
 {
-    FILE * Out = fopen(FileName, "wb");
+    if (!tree || !tree->root || !FileName || !options) return INVALID_ARGUMENT;
+
+    char tmp_name[DEF_SIZE + 64] = "";
+    FILE * Out = _open_replace(FileName, tmp_name, sizeof(tmp_name));
+    if (!Out) return FOPEN_ERROR;
+    setvbuf(Out, NULL, _IOFBF, DUMP_BUFFER);
+
+    DumpWalk walk = {};
+    walk.options = options;
+    walk.Out = Out;
+    walk.ids = CreateMap(0);
+    walk.weights = CreateMap(0);
+    InitStack(&walk.queue, sizeof(DumpItem));
+
+    int error = walk.ids && walk.weights ? SUCCESS : ALLOCATE_MEMORY_ERROR;
 
-    fprintf(Out, "digraph\n{\n");
-    _tree_dump_func(tree, &tree->root, Out);
+    fprintf(Out, "digraph\n{\n"
+                 "node [shape = Mrecord; style = filled];\n");
+    if (!error) error = _tree_dump_func(&walk, tree->root);
     fprintf(Out, "}\n");
 
-    char command[DEF_SIZE] = "";
-    sprintf(command, "dot %s -T png -o %s.png", FileName, FileName);
+    TRACE_DUMP(TRACE_INFO, "%s: %zu nodes, %zu cut subtrees, %zu edges",
+               FileName, walk.shown, walk.cut, walk.edges);
+
+    DestroyStack(&walk.queue);
+    if (walk.weights) DestroyMap(walk.weights);
+    if (walk.ids) DestroyMap(walk.ids);
+
+    error = _close_replace(Out, tmp_name, FileName, error);
+    if (error || options->dot == DUMP_NO_DOT) return error;
+
+    // the shell returns at once if dot is left running in the background,
+    // the picture goes under a name of that shell until it is complete
+    char command[4 * DEF_SIZE] = "";
+    if (options->dot == DUMP_DOT_ASYNC)
+        snprintf(command, sizeof(command), "(dot -T %s -o '%s.%s.'$$.tmp '%s' && mv -f '%s.%s.'$$.tmp '%s.%s') &",
+                 options->format, FileName, options->format, FileName,
+                 FileName, options->format, FileName, options->format);
+    else
+        snprintf(command, sizeof(command), "dot -T %s -o '%s.%s' '%s'", options->format, FileName, options->format, FileName);
+
+    TRACE_DUMP(TRACE_INFO, "%s", command);
+    if (system(command)) TRACE_DUMP(TRACE_ERROR, "%s failed", command);
+
+    return SUCCESS;
+}
+
+Tree * TreeDump(Tree * tree, const char * FileName)
+{
+    return TreeDumpWith(tree, FileName, &DUMP_DEFAULTS) ? NULL : tree;
+}
+
+int _push_frame(Stack * stack, Node * node)
+{
+    if (!node) return SUCCESS;
+
+    NodeFrame * frame = (NodeFrame*) StackPush(stack);
+    if (!frame) return ALLOCATE_MEMORY_ERROR;
+
+    *frame = (NodeFrame) {node, 0};
+    return SUCCESS;
+}
+
+int _push_node(Stack * stack, Node * node)
+{
+    if (!node) return SUCCESS;
+
+    Node ** slot = (Node**) StackPush(stack);
+    if (!slot) return ALLOCATE_MEMORY_ERROR;
 
-    fclose(Out);
+    *slot = node;
+    return SUCCESS;
+}
 
-    system(command);
+const TexOper * _find_tex_oper(Node * node)
+{
+    for (size_t i = 0; i < sizeof(TexOpers) / sizeof(TexOpers[0]); i++)
+        if (TexOpers[i].op == (int) NodeValue(node)) return &TexOpers[i];
 
-    return tree;
+    return NULL;
 }
 
-char * _tex_dump_func(Tree * tree, Node ** node)
+// Streams the LaTeX of node in one in-order walk, the same way _print_node
+// does: every character is written once, straight to out.
+int _tex_node(Node * node, FILE * out)
 {
-    enum types type = NodeType(*node);
-    field_t value = NodeValue(*node);
-    char * oper = NULL;
-    char * number = NULL;
-    char * variable = NULL;
-    char * func = NULL;
-    char * left = NULL;
-    char * right = NULL;
+    Stack stack;
+    InitStack(&stack, sizeof(NodeFrame));
 
-    switch((int) type)
+    int error = SUCCESS;
+    while (!error)
     {
-        case NUM:
-            number = (char*) calloc(DEF_SIZE, 1);
-            sprintf(number, "%lg", value);
-            return number;
+        // down the left spine, writing everything in front of the left operands
+        while (node && !error)
+        {
+            field_t value = NodeValue(node);
+            enum types type = NodeType(node);
+            const TexOper * oper = type == OPER ? _find_tex_oper(node) : NULL;
 
-        case VAR:
-            variable = (char*) calloc(DEF_SIZE, 1);
-            sprintf(variable, "%c", (int) value);
-            return variable;
+            if ((type == FUNC || oper) && _push_frame(&stack, node))
+                error = ALLOCATE_MEMORY_ERROR;
 
-        case FUNC:
+            switch (error ? ERROR : type)
+            {
+                case NUM:   fprintf(out, "%lg", value);
+                            node = NULL;
+                            break;
+
+                case VAR:   fputs(VarName((int) value), out);
+                            node = NULL;
+                            break;
+
+                case FUNC:  fprintf(out, "%s(", enum_to_name((int) value));
+                            node = node->left;
+                            break;
+
+                case OPER:  if (!oper) error = UNKNOWN_NODE;
+                            else fputs(oper->open, out);
+                            node = oper ? node->left : NULL;
+                            break;
+
+                case ERROR:
+                default:    if (!error) error = UNKNOWN_NODE;
+                            node = NULL;
+                            break;
+            }
+        }
+
+        NodeFrame * frame = (NodeFrame*) StackTop(&stack);
+        if (!frame || error) break;
+
+        const TexOper * oper = NodeType(frame->node) == OPER ? _find_tex_oper(frame->node) : NULL;
+        if (oper && !frame->expanded)
         {
-            left = _tex_dump_func(tree, &(*node)->left);
-            char * func = (char*) calloc(DEF_SIZE + strlen(left), 1);
-            DESTROY("FUNC = %d(%c), %s", (int)NodeValue((*node)->left), (int)NodeValue((*node)), enum_to_name((int)NodeValue((*node))));
-            sprintf(func, "%s(%s)", enum_to_name((int)NodeValue((*node))), left);
-            free(left);
-            return func;
+            frame->expanded = 1;
+            fputs(oper->middle, out);
+            node = frame->node->right;
+            continue;
         }
 
-        case OPER:
+        fputs(oper ? oper->close : ")", out);
+        StackPop(&stack);
+    }
+
+    DestroyStack(&stack);
+    return error;
+}
+
+void _tex_begin(FILE * out)
+{
+    fputs("\\documentclass[12]{article}\n"
+          "\\usepackage{amsmath}\n"
+          "\\usepackage{amssymb}\n"
+          "\\usepackage{graphicx} % Required for inserting images\n"
+          "\\usepackage[utf8]{inputenc}\n"
+          "\\usepackage[russian]{babel}\n"
+          "\\begin{document}\n"
+          "\\begin{small}\n", out);
+}
+
+void _tex_end(FILE * out)
+{
+    fputs("\\end{small}\n"
+          "\\end{document}\n", out);
+}
+
+// the document of one tree in filename, queued on render if there is one
+int TexDumpWith(Tree * tree, const char * filename, Render * render)
+{
+    if (!tree || !tree->root || !filename) return INVALID_ARGUMENT;
+
+    // a worker may still be reading the last one, it is replaced as a whole
+    char tmp_name[DEF_SIZE + 64] = "";
+    FILE * Out = _open_replace(filename, tmp_name, sizeof(tmp_name));
+    if (!Out) return FOPEN_ERROR;
+
+    _tex_begin(Out);
+    fprintf(Out, "\n\\[");
+    int error = _tex_node(tree->root, Out);
+    fprintf(Out, "\\]\n");
+    _tex_end(Out);
+
+    error = _close_replace(Out, tmp_name, filename, error);
+    if (error || !render) return error;
+
+    return RenderSubmit(render, filename);
+}
+
+// pdflatex runs on the queue of RenderShared, the process waits for it at exit
+Tree * TexDump(Tree * tree, const char * filename)
+{
+    Render * render = RenderShared();
+    if (!render) TRACE_DUMP(TRACE_ERROR, "no render queue, %s is not compiled", filename);
+
+    return TexDumpWith(tree, filename, render) ? NULL : tree;
+}
+
+// Many trees in one document, compiled once when it is ended.
+struct _tex_report
+{
+    FILE * out;
+    char * filename;
+    char tmp_name[DEF_SIZE + 64];   // written there, renamed to filename at the end
+    int error;                      // the first one, TexReportEnd returns it
+};
+
+TexReport * TexReportBegin(const char * filename)
+{
+    if (!filename) return NULL;
+
+    TexReport * report = (TexReport*) calloc(1, sizeof(TexReport));
+    if (!report) return NULL;
+
+    report->filename = strdup(filename);
+    report->out = report->filename ? _open_replace(filename, report->tmp_name, sizeof(report->tmp_name)) : NULL;
+    if (!report->out)
+    {
+        free(report->filename);
+        free(report);
+        return NULL;
+    }
+
+    _tex_begin(report->out);
+    return report;
+}
+
+// caption is LaTeX put before the formula, NULL for none
+int TexReportAdd(TexReport * report, Tree * tree, const char * caption)
+{
+    if (!report || !tree || !tree->root) return INVALID_ARGUMENT;
+    if (report->error) return report->error;
+
+    if (caption) fprintf(report->out, "\n%s\n", caption);
+    fprintf(report->out, "\n\\[");
+    report->error = _tex_node(tree->root, report->out);
+    fprintf(report->out, "\\]\n");
+
+    return report->error;
+}
+
+// closes and frees the report, the document is queued on render if there is one
+int TexReportEnd(TexReport * report, Render * render)
+{
+    if (!report) return INVALID_ARGUMENT;
+
+    _tex_end(report->out);
+
+    int error = _close_replace(report->out, report->tmp_name, report->filename, report->error);
+    if (!error && render) error = RenderSubmit(render, report->filename);
+
+    free(report->filename);
+    free(report);
+    return error;
+}
+
+// in-order: an operator stays on the stack until its right operand is printed
+void _print_node(Node * node, FILE * out)
+{
+    Stack stack;
+    InitStack(&stack, sizeof(NodeFrame));
+
+    for (;;)
+    {
+        // down the left spine, printing everything in front of the left operands
+        while (node)
+        {
+            field_t value = NodeValue(node);
+            enum types type = NodeType(node);
 
-            left = _tex_dump_func(tree, &(*node)->left);
-            right = _tex_dump_func(tree, &(*node)->right);
-            char * oper = (char*) calloc(DEF_SIZE + strlen(left) + strlen(right), 1);
+            if ((type == FUNC || type == OPER) && _push_frame(&stack, node))
+                type = ERROR;
 
-            switch((int) value)
+            switch (type)
             {
-                case '+':   sprintf(oper, "({%s} + {%s})", left, right);
-                            free(left);
-                            free(right);
-                            return oper;
-
-                case '-':   sprintf(oper, "({%s} - {%s})", left, right);
-                            free(left);
-                            free(right);
-                            return oper;
-
-                case '*':   sprintf(oper, "({%s} \\cdot {%s})", left, right);
-                            free(left);
-                            free(right);
-                            return oper;
-
-                case '^':   sprintf(oper, "{%s}^{%s}", left, right);
-                            free(left);
-                            free(right);
-                            return oper;
-
-                case '/':   sprintf(oper, "\\frac{%s}{%s}", left, right);
-                            free(left);
-                            free(right);
-                            return oper;
-
-                default:    return NULL;
+                // there is no unary minus to read back
+                case NUM:   fprintf(out, value < 0 ? "(0 - %.17g)" : "%.17g", fabs(value));
+                            node = NULL;
+                            break;
+
+                // the e of DiffHARDPOW reads back as the function e(1)
+                case VAR:   fputs((int) value == EX ? "e(1)" : VarName((int) value), out);
+                            node = NULL;
+                            break;
+
+                case FUNC:  fprintf(out, "%s(", enum_to_name((int) value));
+                            node = node->left;
+                            break;
+
+                case OPER:  fputc('(', out);
+                            node = node->left;
+                            break;
+
+                case ERROR:
+                default:    fputc('?', out);
+                            node = NULL;
+                            break;
             }
+        }
+
+        NodeFrame * frame = (NodeFrame*) StackTop(&stack);
+        if (!frame) break;
+
+        if (NodeType(frame->node) == OPER && !frame->expanded)
+        {
+            frame->expanded = 1;
+            fprintf(out, " %c ", (int) NodeValue(frame->node));
+            node = frame->node->right;
+            continue;
+        }
+
+        fputc(')', out);
+        StackPop(&stack);
     }
 
-    return oper;
+    DestroyStack(&stack);
 }
 
-Tree * TexDump(Tree * tree, const char * filename)
+// one line of infix text that TreeParseString reads back
+int TreePrint(Tree * tree, FILE * out)
 {
-    FILE * Out = fopen(filename, "wb");
+    if (!tree || !tree->root || !out) return INVALID_ARGUMENT;
 
-    fprintf(Out,    "\\documentclass[12]{article}\n"
-                    "\\usepackage{amsmath}\n"
-                    "\\usepackage{amssymb}\n"
-                    "\\usepackage{graphicx} % Required for inserting images\n"
-                    "\\usepackage[utf8]{inputenc}\n"
-                    "\\usepackage[russian]{babel}\n"
-                    "\\begin{document}\n"
-                    "\\begin{small}\n");
+    _print_node(tree->root, out);
+    fputc('\n', out);
+    return ferror(out) ? FOPEN_ERROR : SUCCESS;
+}
 
-    fprintf(Out, "\n\\[");
-    char * expression = _tex_dump_func(tree, &tree->root);
-    fprintf(Out, expression);
+// the LaTeX of the expression alone, without the document around it
+int TreeTex(Tree * tree, FILE * out)
+{
+    if (!tree || !tree->root || !out) return INVALID_ARGUMENT;
 
-    fprintf(Out, "\\]\n");
-    fprintf(Out,    "\\end{small}\n"
-                    "\\end{document}\n");
+    int error = _tex_node(tree->root, out);
+    fputc('\n', out);
+
+    if (!error && ferror(out)) error = FOPEN_ERROR;
+    return error;
+}
 
-    fclose(Out);
+// The same LaTeX in a string of its own (without the newline), built in
+// one pass like TreeTex writes it; the caller frees it.
+char * TreeTexString(Tree * tree, size_t * length)
+{
+    if (!tree || !tree->root) return NULL;
 
-    char command[DEF_SIZE] = "";
-    sprintf(command, "pdflatex --output-directory=./tmp %s", filename);
+    char * tex = NULL;
+    size_t size = 0;
+    FILE * out = open_memstream(&tex, &size);
+    if (!out) return NULL;
 
-    system(command);
+    int error = _tex_node(tree->root, out);
+    if (fclose(out) || error)
+    {
+        free(tex);
+        return NULL;
+    }
 
-    free(expression);
-    return tree;
+    if (length) *length = size;
+    return tex;
 }
 
+// Regular files are mapped and pipes read in chunks ("-" is stdin),
+// the parser takes the tokens as they come and the input is never copied.
 int TreeParse(Tree * tree, const char * filename)
 {
-    FILE * file = fopen(filename, "rb");
-    if (ferror(file)) return FOPEN_ERROR;
+    if (!tree || !filename) return INVALID_ARGUMENT;
+
+    Buff * buff = OpenBuff(filename);
+    if (!buff) return FOPEN_ERROR;
 
-    char * expression = CreateBuf(file);
-    if (!expression) return ALLOCATE_MEMORY_ERROR;
+    Lexer * lex = CreateBuffLexer(buff);
+    int error = lex ? _parse_lexer(tree, lex) : ALLOCATE_MEMORY_ERROR;
+
+    DestroyLexer(lex);
+    CloseBuff(buff);
+    return error;
+}
+
+int TreeParseString(Tree * tree, const char * expression)
+{
+    if (!tree || !expression) return INVALID_ARGUMENT;
 
-    const char * ptr = expression;
-    int pointer = 0;
+    // tokens are spans of expression, only nodes go to the arena
+    Lexer * lex = CreateLexer(expression);
+    if (!lex) return ALLOCATE_MEMORY_ERROR;
 
-    Node ** array = StringTokenize(ptr, &pointer);
+    int error = _parse_lexer(tree, lex);
+    DestroyLexer(lex);
+    return error;
+}
 
-    printf("%p\n", (*array));
+// a lexer error may come after a part of the tree is built, that part is dropped
+int _parse_lexer(Tree * tree, Lexer * lex)
+{
+    ENTER_TREE(tree);
+    tree->root = GetG(lex);
+    tree->hashed = 0;
+    tree->canonical = 0;
 
-    pointer = 0;
-    tree->root = GetG(array, &pointer);
+    int error = LexerError(lex);
+    if (!error && !tree->root) error = UNKNOWN_NODE;
 
-    pointer = 0;
-    while (array[pointer])
+    if (error)
     {
-        free(array[pointer]->value);
-        free(array[pointer]);
-        pointer++;
+        _release_node(tree->root);
+        tree->root = NULL;
     }
+    LEAVE_TREE;
 
-    free(array);
+    return error;
+}
 
-    if (fclose(file) == EOF) return FCLOSE_ERROR;
-    free(expression);
+// an operator or function of _node_count waiting for its operands
+typedef struct _count_frame
+{
+    Node * node;
+    field_t left;
+    enum types type;
+    int op;
+    int right;              // the right operand is being counted
 
-    return 1;
-}
+} CountFrame;
 
+// Only the nodes with operands go on the stack, the value of a leaf is
+// handed straight to the node waiting for it.
 field_t _node_count(Node * node, field_t val)
 {
-    enum types type = NodeType(node);
-    field_t field = NodeValue(node);
-    if (type == NUM) return field;
+    Stack stack;
+    InitStack(&stack, sizeof(CountFrame));
 
-    if (type == OPER)
+    field_t value = NAN;
+    for (;;)
     {
-        switch((int) field)
+        // down to the leftmost leaf
+        enum types type = NodeType(node);
+        while (type == OPER || type == FUNC)
+        {
+            CountFrame * frame = (CountFrame*) StackPush(&stack);
+            if (!frame) break;
+
+            *frame = (CountFrame) {node, 0, type, (int) NodeValue(node), 0};
+            node = node->left;
+            type = NodeType(node);
+        }
+
+        // val is the value of the variable, e (made by DiffHARDPOW) is the constant
+        field_t field = NodeValue(node);
+        if (type == NUM)        value = field;
+        else if (type == VAR)   value = (int) field == EX ? M_E : val;
+        else if (type == ERROR) value = val;
+        else                    value = NAN;
+
+        // up while the right operands are done, a function may have none
+        CountFrame * frame = NULL;
+        while ((frame = (CountFrame*) StackTop(&stack)))
         {
-            case '+': val = _node_count(node->left, val) + _node_count(node->right, val); break;
-            case '-': val = _node_count(node->left, val) - _node_count(node->right, val); break;
-            case '*': val = _node_count(node->left, val) * _node_count(node->right, val); break;
-            case '/': val = _node_count(node->left, val) / _node_count(node->right, val); break;
-            case '^': val = pow(_node_count(node->left, val), _node_count(node->right, val)); break;
-            default: return 0;
+            if (!frame->right)
+            {
+                frame->left = value;
+                frame->right = 1;
+                if (frame->type == OPER || frame->node->right) break;
+                value = 0;
+            }
+
+            if (frame->type == OPER) value = _apply_oper(frame->op, frame->left, value);
+            else value = _apply_func(frame->op, frame->left, value);
+            StackPop(&stack);
         }
+
+        if (!frame) break;
+        node = frame->node->right;
     }
 
-    return val;
+    DestroyStack(&stack);
+    return value;
 }
 
 field_t CountTree(Tree * tree)
@@ -407,45 +945,117 @@ field_t CountTree(Tree * tree)
     return _node_count(tree->root, 0);
 }
 
-void _destroy_node(Node * n)
+// pre-order down the left children, the right ones of the nodes
+// with both wait on the stack
+size_t _tree_size(Node * node)
 {
-    if (!n) return;
+    Stack stack;
+    InitStack(&stack, sizeof(Node*));
+
+    size_t size = 0;
+    Node ** top = NULL;
+    while (node)
+    {
+        size++;
+        if (node->left && node->right && _push_node(&stack, node->right)) break;
 
+        node = node->left ? node->left : node->right;
+        if (!node && (top = (Node**) StackPop(&stack))) node = *top;
+    }
 
-    _destroy_node(n->left);
-    _destroy_node(n->right);
+    DestroyStack(&stack);
+    return size;
+}
 
-    free(n->value);
-    free(n);
+size_t TreeSize(Tree * tree)
+{
+    if (!tree) return 0;
+    return _tree_size(tree->root);
 }
 
+// the distinct nodes, a subtree shared in the DAG counts once; 0 out of memory
+size_t TreeNodes(Tree * tree)
+{
+    if (!tree || !tree->root) return 0;
+
+    Map * index = CreateMap(tree->table ? tree->table->count : 0);
+    if (!index) return 0;
+
+    Stack order;
+    InitStack(&order, sizeof(Node*));
+
+    size_t count = _store_order(tree->root, index, &order) ? 0 : StackCount(&order);
+
+    DestroyStack(&order);
+    DestroyMap(index);
+    return count;
+}
 
+// Values made by t->init are owned by their single node and go to t->free,
+// everything else is a shared Field released with its last reference.
 void _destroy_tree(Tree * t, Node * n)
 {
     if (!n) return;
 
-    DESTROY("SUBTREE %p value = %lg (%c) %p. Destroying.", n, NodeValue(n), (int) NodeValue(n), ((Field*) n->value));
+    if (!t->owned)
+    {
+        _release_node(n);
+        return;
+    }
+
+    // a node goes once its children are on the stack
+    Stack stack;
+    InitStack(&stack, sizeof(Node*));
 
-    _destroy_tree(t, n->left);
-    _destroy_tree(t, n->right);
+    int error = SUCCESS;
+    Node ** top = NULL;
+    while (n)
+    {
+        TRACE_TREE(TRACE_DEBUG, "SUBTREE %p value = %lg (%c) %p. Destroying.", n, NodeValue(n), (int) NodeValue(n), ((Field*) n->value));
+
+        // out of memory the rest of the values leak, the nodes go with the arena
+        if (!error) error = _push_node(&stack, n->right);
+        if (!error) error = _push_node(&stack, n->left);
+
+        if (t->free) t->free(n->value);
+        ArenaFree(t->arena, n, sizeof(Node));
+        TRACE_TREE(TRACE_DEBUG, "SUBTREE %p. Destroyed.", n);
+
+        n = (top = (Node**) StackPop(&stack)) ? *top : NULL;
+    }
 
-    if (t->free) t->free(n->value);
-    DESTROY("SUBTREE %p. Destroyed.", n);
-    free(n);
+    DestroyStack(&stack);
 }
 
 void DestroyTree(Tree * t)
 {
-    DESTROY("STARTED TREE DESTROY");
-    _destroy_tree(t, t->root);
+    if (!t) return;
+
+    TRACE_TREE(TRACE_INFO, "destroying tree %p", t);
+
+    // the last tree of an arena drops all of its nodes at once,
+    // others only let go of the nodes nobody else references
+    if (ArenaShared(t->arena) || t->owned)
+    {
+        ENTER_TREE(t);
+        _destroy_tree(t, t->root);
+        LEAVE_TREE;
+    }
+
+    DestroyArena(t->arena);
     free(t);
+}
 
+size_t TreeMemory(Tree * tree)
+{
+    if (!tree) return 0;
+    return ArenaUsed(tree->arena);
 }
 
 field_t NodeValue(Node * node)
 {
     if (!node) return NULL;
-    DESTROY("Getting node value %p %lg", node, ((Field*)(node->value))->value);
+    TRACE_TREE(TRACE_DEBUG, "Getting node value %p %lg", node, ((Field*)(node->value))->value);
     return ((Field*)(node->value))->value;
 }
 
@@ -491,146 +1101,1434 @@ unsigned int NodeColor(Node * node)
     return color;
 }
 
-int FindVar(Node * node)
+// Rules for a node whose children are already simplified.
+// Returns the replacement or NULL if nothing applies.
+Node * _simplify_rule(Node * node, int * error)
 {
-    if (!node) return 0;
-    if (NodeType(node) == VAR) return VAR;
+    if (NodeType(node) != OPER) return NULL;
 
+    Node * left = node->left;
+    Node * right = node->right;
+    int op = (int) NodeValue(node);
 
-    int result = FindVar(node->left);
-    if (!result) result = FindVar(node->right);
-    return result;
-}
+    if (op == '/' && NodeType(right) == NUM && _same_value(NodeValue(right), 0))
+    {
+        *error = DIVISION_BY_ZERO;
+        return NULL;
+    }
 
-int _need_to_simplify(Node ** node)
-{
-    // if (FindVar(*node) != VAR) return 1;
-    if ((int)NodeValue((*node)) == '*' && (NodeValue((*node)->left) == 1) && NodeType((*node)->left) == NUM)  return 1;
-    if ((int)NodeValue((*node)) == '*' && (NodeValue((*node)->left) == 0) && NodeType((*node)->left) == NUM)  return 1;
-    if ((int)NodeValue((*node)) == '*' && (NodeValue((*node)->right) == 0) && NodeType((*node)->right) == NUM) return 1;
-    if ((int)NodeValue((*node)) == '*' && (NodeValue((*node)->right) == 1) && NodeType((*node)->right) == NUM) return 1;
-    return 0;
+    if (NodeType(left) == NUM && NodeType(right) == NUM)
+        return _create_node(_create_field(_apply_oper(op, NodeValue(left), NodeValue(right)), NUM, DiffCONST), NULL, NULL);
+
+    if (op == '*' && NodeType(left) == NUM && _same_value(NodeValue(left), 0))    return _copy_branch(left);
+    if (op == '*' && NodeType(right) == NUM && _same_value(NodeValue(right), 0))  return _copy_branch(right);
+    if (op == '*' && NodeType(left) == NUM && _same_value(NodeValue(left), 1))    return _copy_branch(right);
+    if (op == '*' && NodeType(right) == NUM && _same_value(NodeValue(right), 1))  return _copy_branch(left);
+
+    if (op == '/' && NodeType(left) == NUM && _same_value(NodeValue(left), 0))    return _copy_branch(left);
+    if (op == '/' && NodeType(right) == NUM && _same_value(NodeValue(right), 1))  return _copy_branch(left);
+
+    if (op == '+' && NodeType(left) == NUM && _same_value(NodeValue(left), 0))    return _copy_branch(right);
+    if (op == '+' && NodeType(right) == NUM && _same_value(NodeValue(right), 0))  return _copy_branch(left);
+    if (op == '-' && NodeType(right) == NUM && _same_value(NodeValue(right), 0))  return _copy_branch(left);
+
+    if (op == '^' && NodeType(right) == NUM && _same_value(NodeValue(right), 1))  return _copy_branch(left);
+    if (op == '^' && NodeType(right) == NUM && _same_value(NodeValue(right), 0))
+        return _create_node(_create_field(1, NUM, DiffCONST), NULL, NULL);
+
+    // equal subtrees are the same node, so u - u and u / u are found by pointer
+    if (op == '-' && left == right) return _create_node(_create_field(0, NUM, DiffCONST), NULL, NULL);
+    if (op == '/' && left == right) return _create_node(_create_field(1, NUM, DiffCONST), NULL, NULL);
+
+    return NULL;
 }
 
-int _tree_simplify(Tree * tree, Node ** node)
+// puts detached children back into a node that is out of the unique table;
+// returns the interned node, which is another one if an equal node exists
+Node * _rehash_node(Node * node, Node * left, Node * right)
 {
-    if (!tree) return -1;
-    if (!(*node)) return -1;
+    node->left = left;
+    node->right = right;
+    if (!CurrentTable) return node;
 
-    if (FindVar(*node) != VAR)
-    {
-        field_t count = _node_count((*node), 0);
-        _destroy_tree(tree, (*node));
-        Field * field = _create_field(count, NUM, DiffCONST);
-        if (!field) return -1;
-        Node * new_node = _create_node(field, NULL, NULL);
-        if (!new_node) return -1;
-        *node = new_node;
-    }
+    Field * field = (Field*) node->value;
+    node->hash = _node_hash(field, left, right);
 
-    if ((int)NodeValue((*node)) == '*' && NodeValue((*node)->left) == 1 && NodeType((*node)->left) == NUM)
-    {
-        Node * new_node = _copy_branch((*node)->right);
-        if (!new_node) return -1;
-        _destroy_tree(tree, (*node));
-        *node = new_node;
-    }
-    if ((int)NodeValue((*node)) == '*' && NodeValue((*node)->left) == 0 && NodeType((*node)->left) == NUM)
+    Node * found = _table_find(CurrentTable, node->hash, field, left, right);
+    if (found)
     {
-        Node * new_node = _copy_node((*node)->left);
-        if (!new_node) return -1;
-        _destroy_tree(tree, (*node));
-        *node = new_node;
+        found->refs++;
+        _release_node(node);
+        return found;
     }
 
-    if ((int)NodeValue((*node)) == '*' && NodeValue((*node)->right) == 0 && NodeType((*node)->right) == NUM)
-    {
-        Node * new_node = _copy_node((*node)->right);
-        if (!new_node) return -1;
-        _destroy_tree(tree, (*node));
-        *node = new_node;
-    }
+    if (_table_insert(CurrentTable, node)) return NULL;
+    return node;
+}
 
-    if ((int)NodeValue((*node)) == '*' && NodeValue((*node)->right) == 1 && NodeType((*node)->right) == NUM)
-    {
-        Node * new_node = _copy_branch((*node)->left);
-        if (!new_node) return -1;
-        _destroy_tree(tree, (*node));
-        *node = new_node;
-    }
-    if ((int)NodeValue((*node)) == '/' && NodeValue((*node)->left) == 0 && NodeType((*node)->left) == NUM)
-        {
-            Node * new_node = _copy_node((*node)->left);
-            if (!new_node) return -1;
-            _destroy_tree(tree, (*node));
-            *node = new_node;
-        }
+// a node of _tree_simplify waiting for its children
+typedef struct _simplify_frame
+{
+    Node * node;            // the reference taken over
+    Node * result;          // copy of a shared node, its children are relinked
+    Node * left;            // simplified left child
+    int shared;
+    int memo;
+    int right;              // the right child is being simplified
 
-    if ((int)NodeValue((*node)) == '/' && NodeValue((*node)->right) == 0 && NodeType((*node)->right) == NUM)
-        return -1;
+} SimplifyFrame;
 
+// One post-order pass: takes over the reference to node and returns the
+// simplified one. A node nobody else references is relinked in place,
+// a shared one is simplified once per pass and remembered in done.
+// The nodes waiting for their children are on a stack, not the call stack.
+Node * _tree_simplify(Node * node, Map * done, size_t * rewrites, int * error)
+{
+    // a thread of a fork holds one more reference to every node it walks
+    // (see _fork_task), only nodes shared beyond it are worth remembering
+    int forked = CurrentTable && CurrentTable->locks;
+
+    Stack stack;
+    InitStack(&stack, sizeof(SimplifyFrame));
+
+    Node * result = NULL;
+    int descend = 1;        // node is to be entered, else result is the simplified child of the top frame
+
+    for (;;)
+    {
+        if (descend)
+        {
+            descend = 0;
+            result = node;
+            if (!node || (!node->left && !node->right)) continue;
+
+            unsigned int refs = __atomic_load_n(&node->refs, __ATOMIC_RELAXED);
+            int shared = refs > 1;
+            int memo = forked ? refs > 2 : shared;
+
+            if (memo)
+            {
+                Node * known = (Node*) MapFind(done, node);
+                if (known)
+                {
+                    _release_node(node);
+                    result = _copy_branch(known);
+                    continue;
+                }
+            }
+
+            // out of memory the subtree stays as it is
+            SimplifyFrame * frame = (SimplifyFrame*) StackPush(&stack);
+            if (!frame)
+            {
+                *error = ALLOCATE_MEMORY_ERROR;
+                continue;
+            }
+
+            *frame = (SimplifyFrame) {node, NULL, NULL, shared, memo, 0};
+            if (!shared)
+            {
+                // take the children out, the node is rehashed once they are back
+                if (CurrentTable) _table_remove(CurrentTable, node);
+                _release_node(node->diffed);
+                node->diffed = NULL;
+                node = node->left;
+            }
+            else
+            {
+                frame->result = _copy_branch(node);
+                node = _copy_branch(node->left);
+            }
+
+            descend = 1;
+            continue;
+        }
+
+        SimplifyFrame * frame = (SimplifyFrame*) StackTop(&stack);
+        if (!frame) break;
+
+        if (!frame->right)
+        {
+            frame->left = result;
+            frame->right = 1;
+            node = frame->shared ? _copy_branch(frame->node->right) : frame->node->right;
+            descend = 1;
+            continue;
+        }
+
+        StackPop(&stack);
+        result = _simplify_node(frame, result, done, rewrites, error);
+    }
+
+    DestroyStack(&stack);
+    return result;
+}
+
+// the node of frame with its simplified children and the rules applied to it
+Node * _simplify_node(SimplifyFrame * frame, Node * right, Map * done, size_t * rewrites, int * error)
+{
+    Node * result = NULL;
+    if (!frame->shared) result = _rehash_node(frame->node, frame->left, right);
+    else
+    {
+        result = frame->result;
+        if (_relink_node(&result, frame->left, right) < 0) *error = ALLOCATE_MEMORY_ERROR;
+    }
+
+    if (!result)
+    {
+        *error = ALLOCATE_MEMORY_ERROR;
+        return NULL;
+    }
+
+    Node * rule = _simplify_rule(result, error);
+    if (rule)
+    {
+        TRACE_SIMPLIFY(TRACE_DEBUG, "%p rewritten to %p", result, rule);
+        _release_node(result);
+        result = rule;
+        (*rewrites)++;
+    }
+
+    // the map keeps the references to both, so neither address is reused;
+    // a shared node that is not remembered gives back the reference taken over
+    if (frame->memo && MapInsert(done, frame->node, _copy_branch(result))) *error = ALLOCATE_MEMORY_ERROR;
+    else if (frame->shared && !frame->memo) _release_node(frame->node);
+
+    return result;
+}
+
+void _release_done(void * key, void * value)
+{
+    _release_node((Node*) key);
+    _release_node((Node*) value);
+}
+
+int TreeSimplify(Tree * tree, SimplifyStats * stats)
+{
+    return _simplify_tree(tree, 0, stats);
+}
+
+// TreeSimplify with the subtrees of a big tree simplified by threads
+// (0 is one per CPU), a small tree is simplified by the calling thread
+int TreeSimplifyParallel(Tree * tree, size_t threads, SimplifyStats * stats)
+{
+    return _simplify_tree(tree, threads ? threads : (size_t) -1, stats);
+}
+
+int _simplify_tree(Tree * tree, size_t threads, SimplifyStats * stats)
+{
+    if (!tree) return -1;
+
+    SimplifyStats total = {};
+    int error = SUCCESS;
+
+    // every pass reaches a local normal form, the next one confirms it
+    while (total.passes < SIMPLIFY_MAX_PASSES)
+    {
+        Map * done = CreateMap(0);
+        if (!done)
+        {
+            error = ALLOCATE_MEMORY_ERROR;
+            break;
+        }
+
+        size_t rewrites = 0;
+        Fork fork = {};
+        fork.tree = tree;
+
+        // the simplified tasks go to done, where the pass picks them up
+        if (threads) error = _fork_tree(&fork, threads == (size_t) -1 ? 0 : threads);
+        for (size_t i = 0; i < fork.count; i++)
+        {
+            rewrites += fork.rewrites[i];
+            if (!error) error = fork.errors[i];
+            if (fork.results[i] && MapInsert(done, fork.tasks[i], fork.results[i])) error = ALLOCATE_MEMORY_ERROR;
+            else if (fork.results[i]) _copy_branch(fork.tasks[i]);
+        }
+        _fork_free(&fork);
+
+        ENTER_TREE(tree);
+        if (!error) tree->root = _tree_simplify(tree->root, done, &rewrites, &error);
+        tree->hashed = 0;
+        tree->canonical = 0;
+
+        MapWalk(done, _release_done);
+        LEAVE_TREE;
+        DestroyMap(done);
+
+        total.passes++;
+        total.rewrites += rewrites;
+        TRACE_SIMPLIFY(TRACE_INFO, "pass %zu of tree %p: %zu rewrites", total.passes, tree, rewrites);
+        if (!rewrites || error) break;
+    }
+
+    if (stats) *stats = total;
+    return error;
+}
+
+// CANONICAL
+
+// the finalizer of splitmix64, a bijection, so a sum of mixed hashes keeps them apart
+uint64_t _mix_hash(uint64_t hash)
+{
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+// ADD or MUL for a node of an associative and commutative chain, 0 otherwise
+int _chain_op(Node * node)
+{
+    if (NodeType(node) != OPER) return 0;
+
+    int op = (int) NodeValue(node);
+    return op == ADD || op == MUL ? op : 0;
+}
+
+// not NaN and not another value, without comparing floats for equality
+int _same_value(field_t value, field_t expected)
+{
+    return value >= expected && value <= expected;
+}
+
+// type and value, a named variable by its name: the same in every process
+uint64_t _field_hash(Node * node)
+{
+    Field * field = (Field*) node->value;
+    uint64_t hash = _mix_hash((uint64_t) field->type + 1);
+
+    if (field->type == VAR && field->value >= VAR_NAMES)
+    {
+        for (const char * name = VarName((int) field->value); *name; name++)
+            hash = (hash ^ (unsigned char) *name) * 1099511628211ULL;
+        return _mix_hash(hash);
+    }
+
+    field_t value = _same_value(field->value, 0) ? 0 : field->value;      // -0 is 0
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    return _mix_hash(hash ^ bits);
+}
+
+// the hash of a node _hash_nodes has walked
+uint64_t _hash_of(Node * node, Map * hashes)
+{
+    uint64_t value = (uintptr_t) MapFind(hashes, node);
+
+    int op = _chain_op(node);
+    return op ? _mix_hash(value ^ (uint64_t) op) : value;
+}
+
+// what an operand adds to the sum of the op chain it is in,
+// an operand that is a chain of op itself adds its own sum
+uint64_t _chain_term(Node * node, int op, Map * hashes)
+{
+    if (_chain_op(node) == op) return (uintptr_t) MapFind(hashes, node);
+    return _mix_hash(_hash_of(node, hashes));
+}
+
+// What hashes keeps for node: the sum of the terms of its operands for a
+// + or * chain, so any order and grouping of it give the same sum; the
+// hash of the field and the children in their order for anything else.
+uint64_t _structure_hash(Node * node, Map * hashes)
+{
+    int op = _chain_op(node);
+    if (op) return _chain_term(node->left, op, hashes) + _chain_term(node->right, op, hashes);
+
+    uint64_t hash = _field_hash(node);
+    if (node->left) hash = _mix_hash(hash ^ _hash_of(node->left, hashes));
+    if (node->right) hash = _mix_hash(_mix_hash(hash) ^ _hash_of(node->right, hashes));
+    return hash;
+}
+
+// node into hashes if it is not there, its children are;
+// 0 is kept for no entry, so a value of 0 is stored as 1
+int _hash_node(Node * node, Map * hashes)
+{
+    if (MapFind(hashes, node)) return SUCCESS;
+
+    uint64_t hash = _structure_hash(node, hashes);
+    return MapInsert(hashes, node, (void*) (hash ? hash : 1)) ? ALLOCATE_MEMORY_ERROR : SUCCESS;
+}
+
+// every node under root that is not in hashes yet, children first
+int _hash_nodes(Node * root, Map * hashes)
+{
+    Stack stack;
+    InitStack(&stack, sizeof(NodeFrame));
+
+    int error = _push_frame(&stack, root);
+    NodeFrame * frame = NULL;
+    while (!error && (frame = (NodeFrame*) StackTop(&stack)))
+    {
+        Node * current = frame->node;
+        if (MapFind(hashes, current))
+        {
+            StackPop(&stack);
+            continue;
+        }
+
+        if (!frame->expanded)
+        {
+            frame->expanded = 1;
+            error = _push_frame(&stack, current->left);
+            if (!error) error = _push_frame(&stack, current->right);
+            continue;
+        }
+
+        StackPop(&stack);
+        error = _hash_node(current, hashes);
+    }
+
+    DestroyStack(&stack);
+    return error;
+}
 
-    if ((int)NodeValue((*node)) == '/' && NodeValue((*node)->right) == 1 && NodeType((*node)->right) == NUM)
+// by CanonRanks, then by value, a variable by its name
+int _canon_field_cmp(Node * a, Node * b)
+{
+    Field * x = (Field*) a->value;
+    Field * y = (Field*) b->value;
+
+    if (x->type != y->type) return CanonRanks[x->type] < CanonRanks[y->type] ? -1 : 1;
+    if (x->type == VAR) return strcmp(VarName((int) x->value), VarName((int) y->value));
+
+    if (x->value < y->value) return -1;
+    if (x->value > y->value) return 1;
+    return 0;
+}
+
+// the fields of the two trees in pre-order until one differs
+int _canon_deep_cmp(Node * a, Node * b)
+{
+    Stack stack;
+    InitStack(&stack, 2 * sizeof(Node*));
+
+    Node ** pair = (Node**) StackPush(&stack);
+    if (pair)
+    {
+        pair[0] = a;
+        pair[1] = b;
+    }
+
+    int order = 0;
+    while (!order && (pair = (Node**) StackPop(&stack)))
+    {
+        Node * x = pair[0];
+        Node * y = pair[1];
+        if (x == y) continue;
+
+        if (!x || !y) order = x ? 1 : -1;
+        else order = _canon_field_cmp(x, y);
+        if (order) break;
+
+        Node * sides[][2] = {{x->right, y->right}, {x->left, y->left}};
+        for (size_t side = 0; side < 2; side++)
+        {
+            Node ** next = (Node**) StackPush(&stack);
+            if (!next) break;
+            next[0] = sides[side][0];
+            next[1] = sides[side][1];
+        }
+    }
+
+    DestroyStack(&stack);
+    return order;
+}
+
+// The total order of the operands of a chain: by field first, so numbers
+// and variables lead and sin(x) comes before x^2, then by hash, and two
+// different nodes of one hash are told apart by their structure.
+int _canon_cmp(const void * a, const void * b)
+{
+    const CanonItem * x = (const CanonItem*) a;
+    const CanonItem * y = (const CanonItem*) b;
+    if (x->node == y->node) return 0;
+
+    int order = _canon_field_cmp(x->node, y->node);
+    if (order) return order;
+
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return _canon_deep_cmp(x->node, y->node);
+}
+
+// a number goes into constant, anything else into items
+int _canon_operand(Stack * items, Node * operand, int op, field_t * constant, Map * hashes)
+{
+    if (NodeType(operand) == NUM)
+    {
+        *constant = _apply_oper(op, *constant, NodeValue(operand));
+        return SUCCESS;
+    }
+
+    CanonItem * item = (CanonItem*) StackPush(items);
+    if (!item) return ALLOCATE_MEMORY_ERROR;
+
+    *item = (CanonItem) {operand, _hash_of(operand, hashes)};
+    return SUCCESS;
+}
+
+// the operands of the op chain at node, the nodes of the chain are walked through
+int _chain_operands(Node * node, int op, Stack * operands)
+{
+    Stack chain;
+    InitStack(&chain, sizeof(Node*));
+
+    int error = SUCCESS;
+    Node ** slot = (Node**) StackPush(&chain);
+    if (slot) *slot = node;
+    else error = ALLOCATE_MEMORY_ERROR;
+
+    while (!error && (slot = (Node**) StackPop(&chain)))
+    {
+        Node * current = *slot;
+        Node * sides[] = {current->right, current->left};
+        size_t count = _chain_op(current) == op ? 2 : 0;
+
+        if (!count)
+        {
+            Node ** operand = (Node**) StackPush(operands);
+            if (operand) *operand = current;
+            else error = ALLOCATE_MEMORY_ERROR;
+        }
+
+        for (size_t side = 0; side < count && !error; side++)
+        {
+            Node ** next = (Node**) StackPush(&chain);
+            if (next) *next = sides[side];
+            else error = ALLOCATE_MEMORY_ERROR;
+        }
+    }
+
+    DestroyStack(&chain);
+    return error;
+}
+
+// The canonical forms of the operands of the op chain at node in one chain
+// to the left: the folded constant first unless it is 0 for + or 1 for *,
+// then the rest in the order of _canon_cmp. An operand may turn into a
+// chain of op itself, (a+b)*1 is a+b, its operands join this chain.
+Node * _canon_chain(Node * node, int op, Map * done, Map * hashes, int * error)
+{
+    field_t identity = op == ADD ? 0 : 1;
+    field_t constant = identity;
+
+    Stack operands;
+    InitStack(&operands, sizeof(Node*));
+    Stack items;
+    InitStack(&items, sizeof(CanonItem));
+
+    *error = _chain_operands(node, op, &operands);
+    for (size_t i = 0; !*error && i < StackCount(&operands); i++)
+    {
+        Node * chain = (Node*) MapFind(done, *(Node**) StackAt(&operands, i));
+        for (; !*error && _chain_op(chain) == op; chain = chain->left)
+            *error = _canon_operand(&items, chain->right, op, &constant, hashes);
+
+        if (!*error) *error = _canon_operand(&items, chain, op, &constant, hashes);
+    }
+
+    size_t count = StackCount(&items);
+    Node * result = NULL;
+
+    if (!*error)
+    {
+        // 0 * u is 0, as TreeSimplify has it
+        if (op == MUL && _same_value(constant, 0)) count = 0;
+        // the sums of _structure_hash are kept as the chain grows
+        uint64_t sum = 0;
+        if (!count || !_same_value(constant, identity))
         {
-            Node * new_node = _copy_branch((*node)->left);
-            if (!new_node) return -1;
-            _destroy_tree(tree, (*node));
-            *node = new_node;
+            result = _create_node(_create_field(constant, NUM, DiffCONST), NULL, NULL);
+            if (result && _hash_node(result, hashes)) *error = ALLOCATE_MEMORY_ERROR;
+            if (result) sum = _mix_hash(_hash_of(result, hashes));
         }
 
-        if ((int)NodeValue((*node)) == '+' && NodeValue((*node)->left) == 0 && NodeType((*node)->left) == NUM)
-        {
-            Node * new_node = _copy_branch((*node)->right);
-            if (!new_node) return -1;
-            _destroy_tree(tree, (*node));
-            *node = new_node;
-        }
+        CanonItem * sorted = count ? (CanonItem*) StackAt(&items, 0) : NULL;
+        if (count) qsort(sorted, count, sizeof(CanonItem), _canon_cmp);
+
+        for (size_t i = 0; i < count && !*error; i++)
+        {
+            Node * operand = _copy_branch(sorted[i].node);
+            if (!result)
+            {
+                result = operand;
+                sum = _mix_hash(sorted[i].hash);
+                continue;
+            }
+
+            Node * joined = _create_node(_parse_field(op, result, operand), result, operand);
+            if (!joined)
+            {
+                _release_node(result);
+                _release_node(operand);
+            }
+            result = joined;
+            if (!result) break;
+
+            sum += _mix_hash(sorted[i].hash);
+            if (!sum) sum = 1;
+            if (MapInsert(hashes, result, (void*) sum)) *error = ALLOCATE_MEMORY_ERROR;
+        }
+
+        if (!result && !*error) *error = ALLOCATE_MEMORY_ERROR;
+    }
+
+    DestroyStack(&items);
+    DestroyStack(&operands);
+    return result;
+}
+
+// node on the canonical forms of its children or operands, which are in done;
+// the result is in hashes too
+Node * _canon_node(Node * node, Map * done, Map * hashes, int * error)
+{
+    if (!node->left && !node->right)
+    {
+        if (_hash_node(node, hashes)) *error = ALLOCATE_MEMORY_ERROR;
+        return _copy_branch(node);
+    }
+
+    int op = _chain_op(node);
+    if (op) return _canon_chain(node, op, done, hashes, error);
+
+    Node * left = node->left ? (Node*) MapFind(done, node->left) : NULL;
+    Node * right = node->right ? (Node*) MapFind(done, node->right) : NULL;
+
+    Field * field = (Field*) node->value;
+    if (field->type == OPER && (int) field->value == DIV && NodeType(right) == NUM && _same_value(NodeValue(right), 0))
+    {
+        *error = DIVISION_BY_ZERO;
+        return NULL;
+    }
+
+    Node * result = NULL;
+    if (field->type == OPER && NodeType(left) == NUM && NodeType(right) == NUM)
+        result = _create_node(_create_field(_apply_oper((int) field->value, NodeValue(left), NodeValue(right)),
+                                            NUM, DiffCONST), NULL, NULL);
+    else
+    {
+        // the rule of ^ follows its operands, as the parser picks it
+        Field * copy = field->type == OPER ? _parse_field((int) field->value, left, right) : _copy_field(field);
+        result = _create_node(copy, _copy_branch(left), _copy_branch(right));
+        if (!result)
+        {
+            _release_node(left);
+            _release_node(right);
+        }
+    }
+
+    if (!result || _hash_node(result, hashes)) *error = ALLOCATE_MEMORY_ERROR;
+    return result;
+}
+
+// A new reference to the canonical form of the root, hash is its TreeHash;
+// the tree itself is left as it is.
+Node * _canon_root(Tree * tree, uint64_t * hash, int * error)
+{
+    size_t size = tree->table ? tree->table->count : 0;
+    Map * done = CreateMap(size);           // node -> its canonical form, both referenced
+    Map * hashes = CreateMap(2 * size);     // of the canonical nodes, for their order
+    if (!done || !hashes)
+    {
+        DestroyMap(done);
+        DestroyMap(hashes);
+        *error = ALLOCATE_MEMORY_ERROR;
+        return NULL;
+    }
+
+    ENTER_TREE(tree);
+
+    Stack stack;
+    InitStack(&stack, sizeof(NodeFrame));
+
+    *error = _push_frame(&stack, tree->root);
+    NodeFrame * frame = NULL;
+    while (!*error && (frame = (NodeFrame*) StackTop(&stack)))
+    {
+        Node * current = frame->node;
+        if (MapFind(done, current))
+        {
+            StackPop(&stack);
+            continue;
+        }
+
+        // a chain is one node to its operands, the nodes inside it get no canonical form
+        if (!frame->expanded)
+        {
+            frame->expanded = 1;
+            int op = _chain_op(current);
+            if (!op)
+            {
+                *error = _push_frame(&stack, current->left);
+                if (!*error) *error = _push_frame(&stack, current->right);
+                continue;
+            }
+
+            Stack operands;
+            InitStack(&operands, sizeof(Node*));
+            *error = _chain_operands(current, op, &operands);
+            for (size_t i = 0; !*error && i < StackCount(&operands); i++)
+                *error = _push_frame(&stack, *(Node**) StackAt(&operands, i));
+            DestroyStack(&operands);
+            continue;
+        }
+
+        StackPop(&stack);
+
+        Node * canon = _canon_node(current, done, hashes, error);
+        if (!*error && MapInsert(done, current, canon)) *error = ALLOCATE_MEMORY_ERROR;
+
+        if (*error) _release_node(canon);
+        else _copy_branch(current);
+    }
+
+    DestroyStack(&stack);
+
+    Node * root = NULL;
+    if (!*error)
+    {
+        root = _copy_branch((Node*) MapFind(done, tree->root));
+        *hash = _hash_of(root, hashes);
+    }
+
+    MapWalk(done, _release_done);
+    LEAVE_TREE;
+
+    DestroyMap(done);
+    DestroyMap(hashes);
+    return root;
+}
+
+// One expression, one tree: chains of + and * are flattened, their
+// constants folded and their operands sorted, operators on two numbers are
+// computed. Equal canonical subtrees of a table are then one node, and
+// TreeEqual of two canonical trees of one table compares their roots.
+int TreeCanonical(Tree * tree)
+{
+    if (!tree) return INVALID_ARGUMENT;
+    if (!tree->root || tree->canonical) return SUCCESS;
+
+    int error = SUCCESS;
+    uint64_t hash = 0;
+    Node * root = _canon_root(tree, &hash, &error);
+
+    if (!error)
+    {
+        ENTER_TREE(tree);
+        _release_node(tree->root);
+        LEAVE_TREE;
+
+        tree->root = root;
+        tree->hash = hash;
+        tree->hashed = 1;
+        tree->canonical = 1;
+    }
+
+    TRACE_SIMPLIFY(TRACE_INFO, "tree %p is canonical, error %d", tree, error);
+    return error;
+}
+
+// A 64-bit structural hash: + and * sum the hashes of their operands, so
+// a+b and b+a, or (a*b)*c and a*(b*c), hash the same. Kept on the tree
+// until it changes; 0 if it is out of memory.
+uint64_t TreeHash(Tree * tree)
+{
+    if (!tree) return 0;
+    if (tree->hashed) return tree->hash;
+    if (!tree->root) return 0;
+
+    Map * hashes = CreateMap(tree->table ? tree->table->count : 0);
+    if (!hashes) return 0;
+
+    if (!_hash_nodes(tree->root, hashes))
+    {
+        tree->hash = _hash_of(tree->root, hashes);
+        tree->hashed = 1;
+    }
+
+    DestroyMap(hashes);
+    return tree->hashed ? tree->hash : 0;
+}
+
+// the canonical forms of the two, field by field
+int _canon_equal(Tree * a, Tree * b)
+{
+    Tree * trees[] = {a, b};
+    Node * roots[] = {NULL, NULL};      // made here for the trees not canonical yet
+    int error = SUCCESS;
+    uint64_t hash = 0;
+    for (size_t i = 0; i < 2 && !error; i++)
+        if (!trees[i]->canonical) roots[i] = _canon_root(trees[i], &hash, &error);
+
+    int equal = !error && !_canon_deep_cmp(roots[0] ? roots[0] : a->root, roots[1] ? roots[1] : b->root);
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (!roots[i]) continue;
+        ENTER_TREE(trees[i]);
+        _release_node(roots[i]);
+        LEAVE_TREE;
+    }
+
+    return equal;
+}
+
+// The same expression up to the order and grouping of + and * and the
+// constants folded by TreeCanonical. The root pointers only tell two trees
+// apart when both are canonical in one unique table, which interns each
+// canonical form once; otherwise a difference of TreeHash, computed once
+// per tree, does it in O(1). Equal hashes are checked on the canonical
+// forms, so a collision is not taken for equality.
+int TreeEqual(Tree * a, Tree * b)
+{
+    if (!a || !b) return 0;
+    if (a->root == b->root) return 1;
+    if (a->canonical && b->canonical && a->table && a->table == b->table) return 0;
+
+    uint64_t hash = TreeHash(a);
+    if (!a->hashed || TreeHash(b) != hash || !b->hashed) return 0;
+
+    return _canon_equal(a, b);
+}
+
+// STORE
+
+// the Diff rules of the nodes, a stored node keeps its place in here
+static const Diff StoredRules[] =
+{
+    DiffCONST, DiffX, DiffPLUS, DiffMUL, DiffDIV, DiffPOW, DiffAX, DiffHARDPOW,
+    DiffSIN, DiffCOS, DiffTG, DiffCTG, DiffSH, DiffCH, DiffTH, DiffCTH, DiffEX, DiffLN, DiffLOG,
+};
+
+// The distinct nodes under root in post-order, right subtrees first: in
+// reverse it is the pre-order of a tree, for a DAG every parent still comes
+// before its children. index maps a node to its place in order + 1.
+int _store_order(Node * root, Map * index, Stack * order)
+{
+    Stack stack;
+    InitStack(&stack, sizeof(NodeFrame));
+
+    int error = _push_frame(&stack, root);
+    NodeFrame * frame = NULL;
+    while (!error && (frame = (NodeFrame*) StackTop(&stack)))
+    {
+        Node * current = frame->node;
+        if (MapFind(index, current))
+        {
+            StackPop(&stack);
+            continue;
+        }
+
+        if (!frame->expanded)
+        {
+            frame->expanded = 1;
+            error = _push_frame(&stack, current->left);
+            if (!error) error = _push_frame(&stack, current->right);
+            continue;
+        }
+
+        StackPop(&stack);
+
+        Node ** slot = (Node**) StackPush(order);
+        if (!slot || MapInsert(index, current, (void*) StackCount(order))) error = ALLOCATE_MEMORY_ERROR;
+        else *slot = current;
+    }
+
+    DestroyStack(&stack);
+    return error;
+}
+
+// The tree as a StoredHeader and its arrays, written at the position of out
+// which is left open. A shared subtree is stored once; the nodes of a tree
+// with a unique table are all distinct.
+int TreeSaveTo(Tree * tree, FILE * out)
+{
+    if (!tree || !out) return INVALID_ARGUMENT;
+
+    // no more nodes than the table holds, so the map never grows
+    Map * index = CreateMap(tree->table ? tree->table->count : 0);
+    if (!index) return ALLOCATE_MEMORY_ERROR;
+
+    Stack order;
+    InitStack(&order, sizeof(Node*));
+    Stack names;                    // ids of the named variables, in the order of the file
+    InitStack(&names, sizeof(int));
+
+    int error = tree->root ? _store_order(tree->root, index, &order) : SUCCESS;
+    size_t count = StackCount(&order);
+    if (!error && count >= STORED_NONE) error = INVALID_ARGUMENT;
+
+    field_t * values = NULL;
+    uint32_t * children = NULL;     // the left ones, then the right ones
+    uint8_t * kinds = NULL;         // the types, then the rules
+    if (!error && count)
+    {
+        values = (field_t*) calloc(count, sizeof(field_t));
+        children = (uint32_t*) calloc(2 * count, sizeof(uint32_t));
+        kinds = (uint8_t*) calloc(2 * count, sizeof(uint8_t));
+        if (!values || !children || !kinds) error = ALLOCATE_MEMORY_ERROR;
+    }
+
+    for (size_t i = 0; !error && i < count; i++)
+    {
+        Node * node = *(Node**) StackAt(&order, count - 1 - i);
+        Field * field = (Field*) node->value;
+
+        size_t rule = 0;
+        while (rule < sizeof(StoredRules) / sizeof(StoredRules[0]) && StoredRules[rule] != field->diff) rule++;
+        if (rule == sizeof(StoredRules) / sizeof(StoredRules[0])) error = UNKNOWN_NODE;
+
+        values[i] = field->value;
+        if (field->type == VAR && field->value >= VAR_NAMES)
+        {
+            int var = (int) field->value;
+            size_t name = 0;
+            while (name < StackCount(&names) && *(int*) StackAt(&names, name) != var) name++;
+            if (name == StackCount(&names))
+            {
+                int * slot = (int*) StackPush(&names);
+                if (slot) *slot = var;
+                else error = ALLOCATE_MEMORY_ERROR;
+            }
+
+            values[i] = (field_t) (VAR_NAMES + (int) name);
+        }
+
+        kinds[i] = (uint8_t) field->type;
+        kinds[count + i] = (uint8_t) rule;
+
+        Node * sides[] = {node->left, node->right};
+        for (size_t side = 0; side < 2; side++)
+            children[side * count + i] = sides[side] ? (uint32_t) (count - (size_t) MapFind(index, sides[side]))
+                                                     : STORED_NONE;
+    }
+
+    if (!error)
+    {
+        StoredHeader header = {};
+        memcpy(header.magic, STORED_MAGIC, sizeof(header.magic));
+        header.version = STORED_VERSION;
+        header.order = STORED_ORDER;
+        header.count = count;
+        header.flags = tree->table ? STORED_UNIQUE : 0;
+        header.names = (uint32_t) StackCount(&names);
+
+        if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+            fwrite(values, sizeof(field_t), count, out) != count ||
+            fwrite(children, sizeof(uint32_t), 2 * count, out) != 2 * count ||
+            fwrite(kinds, sizeof(uint8_t), 2 * count, out) != 2 * count) error = FOPEN_ERROR;
+
+        for (size_t name = 0; !error && name < header.names; name++)
+        {
+            const char * var = VarName(*(int*) StackAt(&names, name));
+            if (fwrite(var, 1, strlen(var) + 1, out) != strlen(var) + 1) error = FOPEN_ERROR;
+        }
+    }
+
+    TRACE_DUMP(TRACE_INFO, "%zu nodes stored, error %d", count, error);
+
+    free(values);
+    free(children);
+    free(kinds);
+    DestroyStack(&order);
+    DestroyStack(&names);
+    DestroyMap(index);
+    return error;
+}
+
+int TreeSave(Tree * tree, const char * filename)
+{
+    if (!tree || !filename) return INVALID_ARGUMENT;
+
+    FILE * out = fopen(filename, "wb");
+    if (!out) return FOPEN_ERROR;
+
+    int error = TreeSaveTo(tree, out);
+    if (fclose(out) && !error) error = FCLOSE_ERROR;
+
+    TRACE_DUMP(TRACE_INFO, "%s: stored, error %d", filename, error);
+    return error;
+}
+
+StoredTree * OpenStoredTree(const char * filename)
+{
+    return OpenStoredTreeAt(filename, 0);
+}
+
+// Maps a file of TreeSave that starts offset bytes in, a multiple of the
+// size of a value. The arrays are checked: the children of node i are above
+// i and below count, and every node fits its type and rule.
+StoredTree * OpenStoredTreeAt(const char * filename, size_t offset)
+{
+    if (!filename || offset % sizeof(field_t)) return NULL;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st = {};
+    void * map = MAP_FAILED;
+    if (!fstat(fd, &st) && (size_t) st.st_size >= offset + sizeof(StoredHeader))
+        map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const char * base = (const char*) map + offset;
+    size_t size = (size_t) st.st_size - offset;
+    const StoredHeader * header = (const StoredHeader*) base;
+    size_t count = (size_t) header->count;
+    size_t nodes = sizeof(StoredHeader) + count * (sizeof(field_t) + 2 * sizeof(uint32_t) + 2 * sizeof(uint8_t));
+
+    int valid = !memcmp(header->magic, STORED_MAGIC, sizeof(header->magic)) &&
+                header->version == STORED_VERSION && header->order == STORED_ORDER &&
+                count < STORED_NONE && size >= nodes && header->names <= size - nodes;
+
+    StoredTree * stored = valid ? (StoredTree*) calloc(1, sizeof(StoredTree)) : NULL;
+    if (stored && header->names) stored->vars = (int*) calloc(header->names, sizeof(int));
+    if (!stored || (header->names && !stored->vars))
+    {
+        free(stored);
+        munmap(map, (size_t) st.st_size);
+        return NULL;
+    }
+
+    // the names fill the rest of the file
+    const char * name = base + nodes;
+    const char * end = base + size;
+    for (; valid && stored->names < header->names; stored->names++)
+    {
+        const char * stop = (const char*) memchr(name, '\0', (size_t) (end - name));
+        valid = stop && stop > name;
+        if (valid) stored->vars[stored->names] = VarIdSpan(name, (size_t) (stop - name));
+        if (valid) valid = stored->vars[stored->names] >= 0;
+        if (valid) name = stop + 1;
+    }
+    if (name != end) valid = 0;
+
+    const char * data = base + sizeof(StoredHeader);
+    stored->values = (const field_t*) data;
+    stored->left = (const uint32_t*) (data + count * sizeof(field_t));
+    stored->right = stored->left + count;
+    stored->types = (const uint8_t*) (stored->right + count);
+    stored->rules = stored->types + count;
+    stored->count = count;
+    stored->flags = header->flags;
+    stored->map = map;
+    stored->size = (size_t) st.st_size;
+
+    for (size_t i = 0; valid && i < count; i++)
+    {
+        uint32_t sides[] = {stored->left[i], stored->right[i]};
+        for (size_t side = 0; side < 2; side++)
+            if (sides[side] != STORED_NONE && (sides[side] <= i || sides[side] >= count)) valid = 0;
+
+        if (valid && !_stored_rule(stored, i)) valid = 0;
+    }
+
+    if (!valid)
+    {
+        TRACE_DUMP(TRACE_ERROR, "%s: a node does not fit", filename);
+        CloseStoredTree(stored);
+        return NULL;
+    }
+
+    return stored;
+}
+
+void CloseStoredTree(StoredTree * stored)
+{
+    if (!stored) return;
+
+    munmap(stored->map, stored->size);
+    free(stored->vars);
+    free(stored);
+}
+
+// the value of stored node i in this process: a named variable gets its VarId
+field_t _stored_value(const StoredTree * stored, size_t i)
+{
+    field_t value = stored->values[i];
+    if (stored->types[i] != VAR || value < VAR_NAMES) return value;
+
+    return (field_t) stored->vars[(size_t) value - VAR_NAMES];
+}
+
+// the Diff rule of stored node i, NULL if the node does not fit its type
+Diff _stored_rule(const StoredTree * stored, size_t i)
+{
+    if (stored->rules[i] >= sizeof(StoredRules) / sizeof(StoredRules[0])) return NULL;
+
+    Diff rule = StoredRules[stored->rules[i]];
+    field_t value = stored->values[i];
+    int leaf = stored->left[i] == STORED_NONE && stored->right[i] == STORED_NONE;
+
+    // operators, functions and variables are small whole numbers,
+    // a named variable is a place among the names of the file
+    int name = value >= 0 && value < VAR_NAMES + (field_t) stored->names ? (int) value : -1;
+    if (name >= 0 && (field_t) name < value) name = -1;
+    if (name >= VAR_NAMES && stored->types[i] != VAR) name = -1;
+
+    switch (stored->types[i])
+    {
+        case NUM:   return leaf && rule == DiffCONST ? rule : NULL;
+
+        // e is a variable with the rule of a constant
+        case VAR:   return leaf && (rule == DiffX || rule == DiffCONST) && name >= 0 ? rule : NULL;
+
+        case OPER:
+        {
+            if (stored->left[i] == STORED_NONE || stored->right[i] == STORED_NONE) return NULL;
+
+            Diff expected = name == MUL ? DiffMUL : name == DIV ? DiffDIV : DiffPLUS;
+            if (name == POW) return rule == DiffPOW || rule == DiffAX || rule == DiffHARDPOW ? rule : NULL;
+            if (name != ADD && name != SUB && name != MUL && name != DIV) return NULL;
+            return rule == expected ? rule : NULL;
+        }
+
+        case FUNC:  if (stored->left[i] == STORED_NONE || name < 0) return NULL;
+                    return _name_table(name).diff == rule ? rule : NULL;
+
+        default:    return NULL;
+    }
+}
+
+// A file of distinct nodes going to an empty table needs no lookups: every
+// node is made with as many references as it has parents, and then they
+// all go straight into the table, sized for them first.
+int _stored_bulk(const StoredTree * stored, Node ** nodes)
+{
+    uint32_t * refs = (uint32_t*) calloc(stored->count, sizeof(uint32_t));
+    if (!refs) return ALLOCATE_MEMORY_ERROR;
+
+    refs[0] = 1;
+    for (size_t i = 0; i < stored->count; i++)
+    {
+        if (stored->left[i] != STORED_NONE) refs[stored->left[i]]++;
+        if (stored->right[i] != STORED_NONE) refs[stored->right[i]]++;
+    }
+
+    int error = SUCCESS;
+    for (size_t i = stored->count; !error && i-- > 0; )
+    {
+        // a node no one points at is not from TreeSave
+        if (!refs[i]) error = UNKNOWN_NODE;
+
+        Field * field = error ? NULL : _create_field(_stored_value(stored, i), (enum types) stored->types[i],
+                                                     _stored_rule(stored, i));
+        Node * node = field ? (Node*) ArenaAlloc(CurrentArena, sizeof(Node)) : NULL;
+        if (!error && !node) error = ALLOCATE_MEMORY_ERROR;
+        if (error) break;
+
+        node->value = field;
+        node->left = stored->left[i] != STORED_NONE ? nodes[stored->left[i]] : NULL;
+        node->right = stored->right[i] != STORED_NONE ? nodes[stored->right[i]] : NULL;
+        node->refs = refs[i];
+        node->hash = _node_hash(field, node->left, node->right);
+        nodes[i] = node;
+    }
+
+    size_t size = CurrentTable->size;
+    while (size < stored->count) size *= 2;
+    if (!error) error = _table_grow(CurrentTable, size);
+
+    // the buckets are cache misses, they are fetched STORED_PREFETCH nodes ahead
+    for (size_t i = stored->count; !error && i-- > 0; )
+    {
+        if (i >= STORED_PREFETCH)
+            __builtin_prefetch(&CurrentTable->buckets[nodes[i - STORED_PREFETCH]->hash & (CurrentTable->size - 1)], 1);
+        _table_insert(CurrentTable, nodes[i]);
+    }
+
+    if (error)
+        for (size_t i = 0; i < stored->count; i++)
+        {
+            if (!nodes[i]) continue;
+            ArenaFree(CurrentArena, nodes[i]->value, sizeof(Field));
+            ArenaFree(CurrentArena, nodes[i], sizeof(Node));
+            nodes[i] = NULL;
+        }
+
+    free(refs);
+    return error;
+}
+
+// Builds the nodes from the last one up, so the children of each one are
+// there before it. The root takes the place of the one the tree had.
+int TreeLoadStored(Tree * tree, const StoredTree * stored)
+{
+    if (!tree || !stored) return INVALID_ARGUMENT;
+    if (!stored->count) return UNKNOWN_NODE;
+
+    Node ** nodes = (Node**) calloc(stored->count, sizeof(Node*));
+    if (!nodes) return ALLOCATE_MEMORY_ERROR;
+
+    ENTER_TREE(tree);
+
+    int error = SUCCESS;
+    if ((stored->flags & STORED_UNIQUE) && CurrentTable && !CurrentTable->count && !CurrentTable->locks)
+    {
+        error = _stored_bulk(stored, nodes);
+        if (!error)
+        {
+            _release_node(tree->root);
+            tree->root = nodes[0];
+        }
+    }
+    else
+    {
+        for (size_t i = stored->count; !error && i-- > 0; )
+        {
+            Node * left = stored->left[i] != STORED_NONE ? _copy_branch(nodes[stored->left[i]]) : NULL;
+            Node * right = stored->right[i] != STORED_NONE ? _copy_branch(nodes[stored->right[i]]) : NULL;
+
+            nodes[i] = _create_node(_create_field(_stored_value(stored, i), (enum types) stored->types[i],
+                                                  _stored_rule(stored, i)), left, right);
+            if (!nodes[i])
+            {
+                _release_node(left);
+                _release_node(right);
+                error = ALLOCATE_MEMORY_ERROR;
+            }
+        }
+
+        if (!error)
+        {
+            _release_node(tree->root);
+            tree->root = _copy_branch(nodes[0]);
+        }
+
+        for (size_t i = 0; i < stored->count; i++) _release_node(nodes[i]);
+    }
+
+    tree->hashed = 0;
+    tree->canonical = 0;
+    LEAVE_TREE;
+
+    TRACE_DUMP(TRACE_INFO, "%zu stored nodes loaded, error %d", stored->count, error);
+    free(nodes);
+    return error;
+}
+
+int TreeLoad(Tree * tree, const char * filename)
+{
+    if (!tree || !filename) return INVALID_ARGUMENT;
+
+    StoredTree * stored = OpenStoredTree(filename);
+    if (!stored) return FOPEN_ERROR;
+
+    int error = TreeLoadStored(tree, stored);
+    CloseStoredTree(stored);
+    return error;
+}
+
+// FORK-JOIN
+
+// weight of a leaf or of a node already weighed, 0 for the others
+size_t _known_weight(Node * node, Map * weights)
+{
+    if (!node) return 0;
+    if (!node->left && !node->right) return 1;
+    return (size_t) MapFind(weights, node);
+}
+
+// size of the subtree as a tree, a shared node is walked once
+// but counted for every parent; saturates instead of overflowing
+size_t _node_weight(Node * node, Map * weights)
+{
+    const size_t limit = (size_t) -1 / 4;
+
+    size_t weight = _known_weight(node, weights);
+    if (weight || !node) return weight;
+
+    Stack stack;
+    InitStack(&stack, sizeof(NodeFrame));
+
+    int error = _push_frame(&stack, node);
+    NodeFrame * frame = NULL;
+    while (!error && (frame = (NodeFrame*) StackTop(&stack)))
+    {
+        Node * current = frame->node;
+        if (_known_weight(current, weights))
+        {
+            StackPop(&stack);
+            continue;
+        }
+
+        if (!frame->expanded)
+        {
+            frame->expanded = 1;
+            if (!_known_weight(current->right, weights)) error = _push_frame(&stack, current->right);
+            if (!error && !_known_weight(current->left, weights)) error = _push_frame(&stack, current->left);
+            continue;
+        }
+
+        StackPop(&stack);
+        weight = 1 + _known_weight(current->left, weights) + _known_weight(current->right, weights);
+        if (weight > limit) weight = limit;
+
+        if (MapInsert(weights, current, (void*) weight)) error = ALLOCATE_MEMORY_ERROR;
+    }
+
+    DestroyStack(&stack);
+
+    // out of memory the tree is too big to tell
+    return error ? limit : _known_weight(node, weights);
+}
+
+// the tasks in pre-order, left subtrees first
+int _fork_collect(Fork * fork, Node * node, Map * weights, Map * seen)
+{
+    Stack stack;
+    InitStack(&stack, sizeof(Node*));
+
+    int error = _push_node(&stack, node);
+    Node ** top = NULL;
+    while (!error && (top = (Node**) StackPop(&stack)))
+    {
+        node = *top;
+        if (!node->left && !node->right) continue;
+        if (MapFind(seen, node)) continue;
+        if (MapInsert(seen, node, node))
+        {
+            error = ALLOCATE_MEMORY_ERROR;
+            break;
+        }
+
+        // a memo is as good as a finished task
+        if (fork->diff && node->diffed) continue;
+
+        if (_node_weight(node, weights) > PARALLEL_CUTOFF)
+        {
+            error = _push_node(&stack, node->right);
+            if (!error) error = _push_node(&stack, node->left);
+            continue;
+        }
+
+        if (fork->count == fork->cap)
+        {
+            size_t cap = fork->cap ? fork->cap * 2 : DEF_SIZE;
+            Node ** tasks = (Node**) realloc(fork->tasks, cap * sizeof(Node*));
+            if (!tasks)
+            {
+                error = ALLOCATE_MEMORY_ERROR;
+                break;
+            }
+
+            fork->tasks = tasks;
+            fork->cap = cap;
+        }
+
+        fork->tasks[fork->count++] = node;
+    }
+
+    DestroyStack(&stack);
+    return error;
+}
+
+void _fork_task(void * arg, size_t index, size_t worker)
+{
+    Fork * fork = (Fork*) arg;
+
+    Arena * saved_arena = CurrentArena;
+    Table * saved_table = CurrentTable;
+    CurrentArena = fork->arenas[worker];
+    CurrentTable = fork->tree->table;
+
+    Node * task = fork->tasks[index];
+    if (fork->diff) fork->results[index] = _diff_tree(task);
+    else
+    {
+        // with the extra reference every node of the task is shared,
+        // so nothing is relinked in place under another thread
+        fork->results[index] = _tree_simplify(_copy_branch(task), fork->done[worker], &fork->rewrites[index], &fork->errors[index]);
+    }
+
+    if (!fork->results[index] && !fork->errors[index]) fork->errors[index] = ALLOCATE_MEMORY_ERROR;
+
+    LEAVE_TREE;
+}
+
+// Runs the tasks under the root of fork->tree, a tree within the cutoff has none.
+// The table is shared by the threads meanwhile, and each of them allocates
+// from an arena of its own, so the only locks taken are the bucket stripes.
+int _fork_tree(Fork * fork, size_t threads)
+{
+    Tree * tree = fork->tree;
+
+    Map * weights = CreateMap(0);
+    Map * seen = CreateMap(0);
+    int error = weights && seen ? SUCCESS : ALLOCATE_MEMORY_ERROR;
+
+    if (!error && _node_weight(tree->root, weights) > PARALLEL_CUTOFF)
+        error = _fork_collect(fork, tree->root, weights, seen);
+
+    DestroyMap(weights);
+    DestroyMap(seen);
+    if (error || !fork->count) return error;
+
+    Pool * pool = CreatePool(threads);
+    if (!pool) return ALLOCATE_MEMORY_ERROR;
+
+    size_t workers = PoolThreads(pool);
+    fork->arenas = (Arena**) calloc(workers, sizeof(Arena*));
+    fork->done = (Map**) calloc(workers, sizeof(Map*));
+    fork->results = (Node**) calloc(fork->count, sizeof(Node*));
+    fork->rewrites = (size_t*) calloc(fork->count, sizeof(size_t));
+    fork->errors = (int*) calloc(fork->count, sizeof(int));
+    if (!fork->arenas || !fork->done || !fork->results || !fork->rewrites || !fork->errors) error = ALLOCATE_MEMORY_ERROR;
+
+    for (size_t i = 0; !error && i < workers; i++)
+    {
+        if (!(fork->arenas[i] = CreateArena(ARENA_BLOCK_SIZE))) error = ALLOCATE_MEMORY_ERROR;
+        if (!fork->diff && !(fork->done[i] = CreateMap(0))) error = ALLOCATE_MEMORY_ERROR;
+    }
+
+    ENTER_TREE(tree);
+    if (!error) error = _table_share(tree->table, TABLE_FORK_GROWTH * tree->table->count);
+    if (!error) error = PoolRun(pool, fork->count, _fork_task, fork);
+    _table_unshare(tree->table);
 
-        if ((int)NodeValue((*node)) == '+' && NodeValue((*node)->right) == 0 && NodeType((*node)->right) == NUM)
-        {
-            Node * new_node = _copy_branch((*node)->left);
-            if (!new_node) return -1;
-            _destroy_tree(tree, (*node));
-            *node = new_node;
-        }
+    for (size_t i = 0; fork->done && i < workers; i++)
+    {
+        if (!fork->done[i]) continue;
+        MapWalk(fork->done[i], _release_done);
+        DestroyMap(fork->done[i]);
+    }
+    LEAVE_TREE;
 
-        if ((int)NodeValue((*node)) == '-' && NodeValue((*node)->right) == 0 && NodeType((*node)->right) == NUM)
-        {
-            Node * new_node = _copy_branch((*node)->left);
-            if (!new_node) return -1;
-            _destroy_tree(tree, (*node));
-            *node = new_node;
-        }
+    DestroyPool(pool);
 
-    if (_need_to_simplify(&(*node))) _tree_simplify(tree, &(*node));
-    if ((*node)->left && ((Field*)((*node)->left->value))->type == OPER) _tree_simplify(tree, &(*node)->left);
-    if ((*node)->right && ((Field*)((*node)->right->value))->type == OPER) _tree_simplify(tree, &(*node)->right);
+    // the nodes made by the threads are the tree's from now on
+    for (size_t i = 0; fork->arenas && i < workers; i++)
+        if (fork->arenas[i]) ArenaAdopt(tree->arena, fork->arenas[i]);
 
-    return 1;
+    free(fork->arenas);
+    free(fork->done);
+    fork->arenas = NULL;
+    fork->done = NULL;
+
+    // results of a failed run are dropped by _fork_free
+    if (error) fork->count = 0;
+    return error;
 }
 
-int TreeSimplify(Tree * tree)
+void _fork_free(Fork * fork)
 {
-    return _tree_simplify(tree, &tree->root);
+    free(fork->tasks);
+    free(fork->results);
+    free(fork->rewrites);
+    free(fork->errors);
+    *fork = (Fork) {};
 }
 
 // PARSER
 
-#define SYNTAX_ERROR(exp, real)                     \
-    {                                               \
-        SyntaxError(exp, real, __func__, __LINE__); \
-    }                                               \
+// the parse fails with UNKNOWN_NODE, the caller tells the user; the token
+// is given by its offset, its value is no character for a number or variable
+#define SYNTAX_ERROR(exp, token)                                                \
+    TRACE_PARSE(TRACE_ERROR, "syntax error: expected %s at offset %zu", exp, (token).start)
 
-#ifdef DEBUG
-#define PARSER(...)                                                             \
-    {                                                                            \
-    fprintf(stderr, ">>> %s:%d: ", __func__, __LINE__);                          \
-    fprintf(stderr, __VA_ARGS__);                                                \
-    fprintf(stderr, "\n");                                                       \
-    }
-#else
-#define PARSER(...)
-#endif
 
 #define N_FUNC(NAME) _create_field((field_t)NAME, FUNC, Diff##NAME)
 
@@ -639,9 +2537,10 @@ int TreeSimplify(Tree * tree)
 #define N_ADD _create_field((field_t) ADD, OPER, DiffPLUS)
 #define N_SUB _create_field((field_t) SUB, OPER, DiffPLUS)
 #define N_POW _create_field((field_t) POW, OPER, DiffPOW)
-#define N_E   _create_field((field_t) EX, VAR, DiffAX)
+#define N_E   _create_field((field_t) EX, VAR, DiffCONST)
+#define N_EXP _create_field((field_t) POW, OPER, DiffAX)
 
-#define DIFF(node, todiff) (Node*)((Field*)(((Node*)node)->value))->diff((todiff))
+#define DIFF(node, todiff) _diff_tree((Node*)(todiff))
 #define LEFT(node) ((Node*)node)->left
 #define RIGHT(node) ((Node*)node)->right
 
@@ -649,7 +2548,7 @@ int TreeSimplify(Tree * tree)
 
 Field * _create_field(field_t val, enum types type, Diff diff)
 {
-    Field * field = (Field*) calloc(1, sizeof(Field));
+    Field * field = (Field*) ArenaAlloc(CurrentArena, sizeof(Field));
     if (!field) return NULL;
 
     field->value = val;
@@ -659,21 +2558,240 @@ Field * _create_field(field_t val, enum types type, Diff diff)
     return field;
 }
 
+Table * _create_table(Arena * arena)
+{
+    Table * table = (Table*) ArenaAlloc(arena, sizeof(Table));
+    if (!table) return NULL;
+
+    table->buckets = (Node**) ArenaAlloc(arena, TABLE_SIZE * sizeof(Node*));
+    if (!table->buckets) return NULL;
+
+    table->size = TABLE_SIZE;
+    table->count = 0;
+    table->var = DIFF_VAR;
+    return table;
+}
+
+unsigned int _node_hash(Field * field, Node * left, Node * right)
+{
+    unsigned long long bits = 0;
+    memcpy(&bits, &field->value, sizeof(bits));
+
+    unsigned long long hash = (unsigned long long) field->type * 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ bits)                                * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (unsigned long long) field->diff)    * 0x94D049BB133111EBULL;
+    hash = (hash ^ (unsigned long long) left)           * 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ (unsigned long long) right)          * 0xBF58476D1CE4E5B9ULL;
+
+    return (unsigned int) (hash ^ (hash >> 32));
+}
+
+Node * _table_find(Table * table, unsigned int hash, Field * field, Node * left, Node * right)
+{
+    for (Node * node = table->buckets[hash & (table->size - 1)]; node; node = node->next)
+    {
+        Field * other = (Field*) node->value;
+        if (node->hash == hash && node->left == left && node->right == right &&
+            other->type == field->type && other->diff == field->diff &&
+            !memcmp(&other->value, &field->value, sizeof(field_t)))
+            return node;
+    }
+
+    return NULL;
+}
+
+// size is a power of two
+int _table_grow(Table * table, size_t size)
+{
+    if (size <= table->size) return SUCCESS;
+
+    // the old bucket array is too big for the free lists and stays in the arena
+    Node ** buckets = (Node**) ArenaAlloc(CurrentArena, size * sizeof(Node*));
+    if (!buckets) return ALLOCATE_MEMORY_ERROR;
+
+    for (size_t i = 0; i < table->size; i++)
+    {
+        Node * chain = table->buckets[i];
+        while (chain)
+        {
+            Node * next = chain->next;
+            chain->next = buckets[chain->hash & (size - 1)];
+            buckets[chain->hash & (size - 1)] = chain;
+            chain = next;
+        }
+    }
+
+    table->buckets = buckets;
+    table->size = size;
+    return SUCCESS;
+}
+
+// the caller holds the lock of the bucket while the table is shared
+int _table_insert(Table * table, Node * node)
+{
+    // a shared table keeps its buckets, chains only get longer
+    if (!table->locks && table->count >= table->size && _table_grow(table, table->size * 2))
+        return ALLOCATE_MEMORY_ERROR;
+
+    Node ** bucket = &table->buckets[node->hash & (table->size - 1)];
+    node->next = *bucket;
+    *bucket = node;
+
+    if (table->locks) __atomic_add_fetch(&table->count, 1, __ATOMIC_RELAXED);
+    else table->count++;
+
+    return SUCCESS;
+}
+
+void _table_remove(Table * table, Node * node)
+{
+    pthread_mutex_t * lock = _table_lock(table, node->hash);
+    if (lock) pthread_mutex_lock(lock);
+
+    Node ** link = &table->buckets[node->hash & (table->size - 1)];
+    while (*link && *link != node) link = &(*link)->next;
+
+    if (*link)
+    {
+        *link = node->next;
+        if (table->locks) __atomic_sub_fetch(&table->count, 1, __ATOMIC_RELAXED);
+        else table->count--;
+    }
+
+    if (lock) pthread_mutex_unlock(lock);
+}
+
+// NULL while the table belongs to one thread
+pthread_mutex_t * _table_lock(Table * table, unsigned int hash)
+{
+    if (!table->locks) return NULL;
+    return &table->locks[hash & (TABLE_LOCKS - 1)];
+}
+
+// Makes the table safe for the threads of a fork: it gets at least size
+// buckets up front and a lock per stripe of them. A bucket always maps to
+// the same stripe since the table does not grow until _table_unshare.
+int _table_share(Table * table, size_t size)
+{
+    if (table->locks) return INVALID_ARGUMENT;
+
+    size_t buckets = table->size;
+    while (buckets < size || buckets < TABLE_LOCKS) buckets *= 2;
+    if (_table_grow(table, buckets)) return ALLOCATE_MEMORY_ERROR;
+
+    pthread_mutex_t * locks = (pthread_mutex_t*) calloc(TABLE_LOCKS, sizeof(pthread_mutex_t));
+    if (!locks) return ALLOCATE_MEMORY_ERROR;
+
+    for (size_t i = 0; i < TABLE_LOCKS; i++) pthread_mutex_init(&locks[i], NULL);
+    table->locks = locks;
+    return SUCCESS;
+}
+
+void _table_unshare(Table * table)
+{
+    if (!table->locks) return;
+
+    for (size_t i = 0; i < TABLE_LOCKS; i++) pthread_mutex_destroy(&table->locks[i]);
+    free(table->locks);
+    table->locks = NULL;
+}
+
+// One more reference to a node found in the table. A node of a shared table
+// may be dropping its last reference in another thread, such a node is
+// not revived: 0 is returned and the caller makes a new one.
+int _retain_node(Node * node)
+{
+    if (!CurrentTable || !CurrentTable->locks)
+    {
+        node->refs++;
+        return 1;
+    }
+
+    unsigned int refs = __atomic_load_n(&node->refs, __ATOMIC_RELAXED);
+    while (refs)
+        if (__atomic_compare_exchange_n(&node->refs, &refs, refs + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return 1;
+
+    return 0;
+}
+
+// Memoized derivatives are taken by table->var, they are dropped before
+// the table is used for another variable.
+int _table_forget_diffs(Table * table)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < table->size; i++)
+        for (Node * node = table->buckets[i]; node; node = node->next)
+            if (node->diffed) count++;
+
+    if (!count) return SUCCESS;
+
+    // releasing a memo unhashes nodes, so the table is not walked meanwhile
+    Node ** diffs = (Node**) calloc(count, sizeof(Node*));
+    if (!diffs) return ALLOCATE_MEMORY_ERROR;
+
+    count = 0;
+    for (size_t i = 0; i < table->size; i++)
+        for (Node * node = table->buckets[i]; node; node = node->next)
+            if (node->diffed)
+            {
+                diffs[count++] = node->diffed;
+                node->diffed = NULL;
+            }
+
+    for (size_t i = 0; i < count; i++) _release_node(diffs[i]);
+
+    free(diffs);
+    return SUCCESS;
+}
+
+// takes over val and the references to left and right;
+// returns the node already interned for them if there is one
 Node * _create_node(Field * val, Node * left, Node * right)
 {
-    Node * node = (Node*) calloc(1, sizeof(Node));
-    if (!node) return NULL;
-    node->value = val;
+    if (!val) return NULL;
+
+    unsigned int hash = 0;
+    pthread_mutex_t * lock = NULL;
+    if (CurrentTable)
+    {
+        // lookup and insert are one step, so two threads never add the same node
+        hash = _node_hash(val, left, right);
+        lock = _table_lock(CurrentTable, hash);
+        if (lock) pthread_mutex_lock(lock);
+
+        Node * found = _table_find(CurrentTable, hash, val, left, right);
+        if (found && _retain_node(found))
+        {
+            if (lock) pthread_mutex_unlock(lock);
+            _release_node(left);
+            _release_node(right);
+            ArenaFree(CurrentArena, val, sizeof(Field));
+            return found;
+        }
+    }
+
+    Node * node = (Node*) ArenaAlloc(CurrentArena, sizeof(Node));
+    if (node)
+    {
+        node->value = val;
+        node->refs = 1;
+        node->hash = hash;
 
-    if (left) node->left = left;
-    if (right) node->right = right;
+        if (left) node->left = left;
+        if (right) node->right = right;
+
+        if (CurrentTable && _table_insert(CurrentTable, node)) node = NULL;
+    }
+
+    if (lock) pthread_mutex_unlock(lock);
     return node;
 }
 
 Field * _copy_field(Field * field)
 {
     if (!field) return NULL;
-    Field * copy_field = (Field*) calloc(1, sizeof(Field));
+    Field * copy_field = (Field*) ArenaAlloc(CurrentArena, sizeof(Field));
     if (!copy_field) return NULL;
 
     copy_field->value = field->value;
@@ -683,85 +2801,84 @@ Field * _copy_field(Field * field)
     return copy_field;
 }
 
-Node * _copy_node(Node * node)
+// subtrees are immutable, so a copy is one more reference to the same nodes
+Node * _copy_branch(Node * node)
 {
     if (!node) return NULL;
-    PARSER("Copying node %p with value %lg...", node, ((Field*)node->value)->value);
-    Field * copy_field = _copy_field((Field*)node->value);
-    if (!copy_field) return NULL;
-    Node * copy_node = (Node*) calloc(1, sizeof(Node));
-    if (!copy_node) return NULL;
+    TRACE_TREE(TRACE_DEBUG, "Copying branch %p with value %lg...", node, ((Field*)node->value)->value);
+    if (CurrentTable && CurrentTable->locks) __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+    else node->refs++;
+
+    return node;
+}
 
-    copy_node->value = copy_field;
-    PARSER("Created node with value %lg", copy_field->value);
-    if (node->left)  copy_node->left = node->left;
-    if (node->right) copy_node->right = node->right;
+// drops a reference, a node that loses the last one is taken out of the table
+int _unref_node(Node * node)
+{
+    if (CurrentTable && CurrentTable->locks)
+    {
+        if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL)) return 0;
+    }
+    else if (--node->refs) return 0;
 
-    return copy_node;
+    if (CurrentTable) _table_remove(CurrentTable, node);
+    return 1;
 }
 
-Node * _copy_branch(Node * node)
+// Dead nodes are out of the table, so their chain links are free to make
+// the list of the nodes still to be released: no recursion and no stack.
+void _release_node(Node * node)
 {
-    if (!node) return NULL;
-    PARSER("Copying branch %p with value %lg...", node, ((Field*)node->value)->value);
-    Node * result = _copy_node(node);
-    if (!result) return NULL;
+    if (!node || !_unref_node(node)) return;
 
-    result->left = _copy_branch(node->left);
-    result->right = _copy_branch(node->right);
+    node->next = NULL;
+    while (node)
+    {
+        Node * dead = node;
+        node = node->next;
 
-    return result;
-}
+        Node * children[] = {dead->left, dead->right, dead->diffed};
+        for (size_t i = 0; i < sizeof(children) / sizeof(*children); i++)
+        {
+            if (!children[i] || !_unref_node(children[i])) continue;
 
-#define SKIPSPACE while(isspace(string[*p])) (*p)++;
+            children[i]->next = node;
+            node = children[i];
+        }
 
-int SyntaxError(char exp, char real, const char * func, int line)
-{
-    fprintf(stderr, ">>> SyntaxError: <expected %c> <got %c>", exp, real);
-    assert(0);
+        ArenaFree(CurrentArena, dead->value, sizeof(Field));
+        ArenaFree(CurrentArena, dead, sizeof(Node));
+    }
 }
 
-
-Node * _oper_token(const char * string, int * p)
+// replaces *node by the node with its field and the given children,
+// takes over the references to left and right
+int _relink_node(Node ** node, Node * left, Node * right)
 {
-    SKIPSPACE
+    if ((*node)->left == left && (*node)->right == right)
+    {
+        _release_node(left);
+        _release_node(right);
+        return 0;
+    }
 
-    Field * field = _create_field((field_t)string[*p], OPER, NULL);
-    if  (!field) return NULL;
-    Node * result = _create_node(field, NULL, NULL);
-    if (!result) return NULL;
-    (*p)++;
-    return result;
+    Node * relinked = _create_node(_copy_field((Field*)(*node)->value), left, right);
+    if (!relinked) return -1;
+
+    _release_node(*node);
+    *node = relinked;
+    return 1;
 }
 
 Field _name_table(int name)
 {
     Field ret = {.type = NUM, .value = -1, .diff = NULL};
-    for (int i = 0; i < DEF_SIZE; i++)
-        if (NameTable[i].value == (field_t) name) return NameTable[i];
+    // the initialized entries are the ones with a rule, the rest is zero
+    for (int i = 0; i < DEF_SIZE && NameTable[i].diff; i++)
+        if (_same_value(NameTable[i].value, (field_t) name)) return NameTable[i];
     return ret;
 }
 
-int _name_to_enum(char * name)
-{
-    if (strcmp(name, "sin") == 0)       return SIN;
-    if (strcmp(name, "cos") == 0)       return COS;
-    if (strcmp(name, "tg") == 0)        return TG;
-    if (strcmp(name, "ctg") == 0)       return CTG;
-    if (strcmp(name, "e") == 0)         return EX;
-    if (strcmp(name, "sh") == 0)        return SH;
-    if (strcmp(name, "ch") == 0)        return CH;
-    if (strcmp(name, "ln") == 0)        return LN;
-    if (strcmp(name, "log") == 0)       return LOG;
-    if (strcmp(name, "arcsin") == 0)    return ARCSIN;
-    if (strcmp(name, "arccos") == 0)    return ARCCOS;
-    if (strcmp(name, "arctg") == 0)     return ARCTG;
-    if (strcmp(name, "arcctg") == 0)    return ARCCTG;
-    if (strcmp(name, "e") == 0)         return EX;
-
-    return -1;
-}
-
 const char * enum_to_name(int name)
 {
     if (name == SIN) return "sin";
@@ -783,266 +2900,427 @@ const char * enum_to_name(int name)
     return "notfound";
 }
 
-Node * _find_name(char * result)
-{
-    printf("Need to find name %s... ", result);
-    Field name = _name_table(_name_to_enum(result));
+// Longer variable names are interned after the one-letter ones, the table
+// lives as long as the program so ids stay valid across trees and threads.
+static char ** VarNames = NULL;
+static size_t VarCount = 0;
+static size_t VarCap = 0;
+static pthread_mutex_t VarLock = PTHREAD_MUTEX_INITIALIZER;
 
-    Field * field = NULL;
-    if (name.value < 0) field = _create_field((field_t) result[0], VAR, DiffX);
-    else field = _create_field(name.value, name.type, name.diff);
-    if (!field) return NULL;
-    Node * node = _create_node(field, NULL, NULL);
-    if (!node) return NULL;
-    return node;
-}
+static char VarLetters[VAR_NAMES][2] = {};
+static pthread_once_t VarLettersOnce = PTHREAD_ONCE_INIT;
 
-Node * _name_token(const char * string, int * p)
+static void _var_letters(void)
 {
-    SKIPSPACE
-    int start_p = *p;
-
-    while(isalpha(string[*p])) (*p)++;
-
-    char * result = (char*) calloc((*p) - start_p + 1, 1);
-    memcpy(result, &string[start_p], (*p) - start_p);
-
-    Node * name = _find_name(result);
-    free(result);
-    if (!name) return NULL;
-    return name;
+    for (int i = 0; i < VAR_NAMES; i++) VarLetters[i][0] = (char) i;
 }
 
-Node * _number_token(const char * string, int * p)
+int VarId(const char * name)
 {
-    SKIPSPACE
-    char * end = NULL;
-    field_t number = strtod(&(string[*p]), &end);
-    if (!end) return NULL;
-    *p += (int)(end - &string[*p]);
-    Field * field = _create_field(number, NUM, DiffCONST);
-    if (!field) return NULL;
-    Node * num = _create_node(field, NULL, NULL);
-    if (!num) return NULL;
-    return num;
+    if (!name) return -1;
+    return VarIdSpan(name, strlen(name));
 }
 
-Node * _get_token(const char * string, int * p)
+// the id of the first length characters of name, they need no terminator
+int VarIdSpan(const char * name, size_t length)
 {
-    SKIPSPACE
-    if (string[*p] == '(' ||
-        string[*p] == ')' ||
-        string[*p] == '+' ||
-        string[*p] == '-' ||
-        string[*p] == '/' ||
-        string[*p] == '*' ||
-        string[*p] == '^')
-        {printf("operator %c! ", string[*p]); return _oper_token(string, p);}
+    if (!name || !length) return -1;
+    if (length == 1) return (unsigned char) name[0];
+
+    int id = -1;
+    pthread_mutex_lock(&VarLock);
+
+    for (size_t i = 0; i < VarCount && id < 0; i++)
+        if (!strncmp(VarNames[i], name, length) && !VarNames[i][length]) id = VAR_NAMES + (int) i;
 
-    if (isalpha(string[*p])) {printf("name %c! ", string[*p]); return _name_token(string, p);}
+    if (id < 0 && VarCount == VarCap)
+    {
+        size_t cap = VarCap ? VarCap * 2 : 16;
+        char ** names = (char**) realloc(VarNames, cap * sizeof(char*));
+        if (names)
+        {
+            VarNames = names;
+            VarCap = cap;
+        }
+    }
 
-    if (isdigit(string[*p])) {printf("number %c! ", string[*p]); return _number_token(string, p);}
+    if (id < 0 && VarCount < VarCap && (VarNames[VarCount] = strndup(name, length)))
+        id = VAR_NAMES + (int) VarCount++;
 
+    pthread_mutex_unlock(&VarLock);
+    return id;
 }
 
-Node ** StringTokenize(const char * string, int * p)
+const char * VarName(int var)
 {
-    SKIPSPACE
-    int size = 0;
-    size_t arr_size = DEF_SIZE;
-    Node ** nodes = (Node**) calloc(arr_size, sizeof(Node*));
-    while (string[*p] != 0)
+    if (var >= 0 && var < VAR_NAMES)
     {
-        *(nodes + size) = _get_token(string, p);
-        printf("got node %u %p with value %lg!\n", size+1, *(nodes + size), NodeValue(*nodes));
-        size++;
+        pthread_once(&VarLettersOnce, _var_letters);
+        return VarLetters[var];
     }
-    printf("%p\n");
-    return nodes;
-}
 
-Node * GetG(Node ** nodes, int * p)
-{
-    PARSER("Got node %p", nodes[*p]);
-    Node * result = GetE(nodes, p);
-    PARSER("Got result!");
-    if (!nodes[*p]) return result;
-    if (nodes[*p]) SYNTAX_ERROR(0, NodeValue(nodes[*p]));
-    PARSER("PARSING ENDED");
-    (*p)++;
-    return result;
+    const char * name = "?";
+    pthread_mutex_lock(&VarLock);
+    if (var >= VAR_NAMES && (size_t) (var - VAR_NAMES) < VarCount) name = VarNames[var - VAR_NAMES];
+    pthread_mutex_unlock(&VarLock);
+
+    return name;
 }
 
-Node * GetE(Node ** nodes, int * p)
+// Pratt parsing straight from the lexer, one token at a time: the
+// operators waiting for their right operand are on a stack, so the nesting
+// depth is limited by memory only. A '(' left open is closed by the end of
+// the input.
+Node * GetG(Lexer * lex)
 {
-    if (!nodes[*p]) return NULL;
-    PARSER("Getting E... Got node %p", nodes[*p]);
-    Node * val1 = GetT(nodes, p);
-    if (!nodes[*p]) return val1;
+    Stack frames;
+    InitStack(&frames, sizeof(ParseFrame));
 
-    while ((int)NodeValue(nodes[*p]) == '+' || (int)NodeValue(nodes[*p]) == '-')
-    {
-        PARSER("Got node %p", nodes[*p]);
-        int op = (int) NodeValue(nodes[*p]);
+    Token token = {};
+    LexerRead(lex, &token);
 
-        Field * operation = NULL;
-        if (!(operation = _create_field((field_t) op, OPER, DiffPLUS))) return NULL;
+    Node * left = NULL;
+    int operand = 1;        // a primary or a prefix comes next
+    int error = SUCCESS;
 
-        (*p)++;
-        if (!nodes[*p]) return NULL;
+    while (!error)
+    {
+        TRACE_PARSE(TRACE_DEBUG, "Got token at %zu", token.start);
 
-        Node * val2 = GetT(nodes, p);
-        PARSER("Got val2");
+        if (operand)
+        {
+            int right = _parse_prefix(&token);
+            if (right >= 0)
+            {
+                ParseFrame * frame = (ParseFrame*) StackPush(&frames);
+                if (!frame) error = ALLOCATE_MEMORY_ERROR;
+                else *frame = (ParseFrame) {NULL, token.kind, (int) token.value, right};
 
-        if (!(val1 = _create_node(operation, val1, val2))) return NULL;
-    }
-    PARSER("GetE Finished");
-    return val1;
-}
+                LexerRead(lex, &token);
+                continue;
+            }
 
-Node * GetT(Node ** nodes, int * p)
-{
-    if (!nodes[*p]) return NULL;
-    PARSER("Getting T... Got node %p", nodes[*p]);
-    PARSER("Getting pow in T val1..."); Node * val1 = GetPow(nodes, p);
-    if (!nodes[*p]) {PARSER("GetT Finished!"); return val1;}
+            // the end or an operator
+            if (token.kind != TOKEN_NUM && token.kind != TOKEN_VAR)
+            {
+                error = UNKNOWN_NODE;
+                break;
+            }
 
-    while ((int)NodeValue(nodes[*p]) == '*' || (int)NodeValue(nodes[*p]) == '/')
-    {
-        int op = (int)NodeValue(nodes[*p]);
+            left = token.kind == TOKEN_NUM ? GetN(&token) : GetX(&token);
+            if (!left) error = ALLOCATE_MEMORY_ERROR;
 
-        Field * operation = NULL;
+            LexerRead(lex, &token);
+            operand = 0;
+            continue;
+        }
 
-        if (op == '*') operation = _create_field((field_t) op, OPER, DiffMUL);
-        else if (op == '/') operation = _create_field((field_t) op, OPER, DiffDIV);
+        ParseFrame * top = (ParseFrame*) StackTop(&frames);
+        const Binding * infix = _parse_binding(&token);
 
-        if (!operation) return NULL;
+        // the operator after left takes it if it binds tighter than the waiting one
+        if (infix && infix->left > (top ? top->right : PARSE_GROUP))
+        {
+            ParseFrame * frame = (ParseFrame*) StackPush(&frames);
+            if (!frame) error = ALLOCATE_MEMORY_ERROR;
+            else *frame = (ParseFrame) {left, TOKEN_OPER, infix->op, infix->right};
+
+            if (frame) left = NULL;
+            LexerRead(lex, &token);
+            operand = 1;
+            continue;
+        }
 
+        // else left is the whole right operand of the waiting one
+        if (!top)
+        {
+            if (token.kind != TOKEN_END)
+            {
+                SYNTAX_ERROR("the end", token);
+                error = UNKNOWN_NODE;
+            }
+            break;
+        }
 
-        (*p)++;
-        if (!nodes[*p]) return val1;
+        if (top->kind == TOKEN_OPER && top->op == '(')
+        {
+            if (token.kind == TOKEN_OPER && (int) token.value == ')')
+            {
+                TRACE_PARSE(TRACE_DEBUG, "Got ')'");
+                LexerRead(lex, &token);
+            }
+            else if (token.kind != TOKEN_END)
+            {
+                SYNTAX_ERROR("')'", token);
+                error = UNKNOWN_NODE;
+                break;
+            }
 
-        PARSER("Getting pow in T val2..."); Node * val2 = GetPow(nodes, p);
+            StackPop(&frames);
+            continue;
+        }
 
-        if (!(val1 = _create_node(operation, val1, val2))) return NULL;
+        left = _parse_apply((ParseFrame*) StackPop(&frames), left);
+        if (!left) error = ALLOCATE_MEMORY_ERROR;
     }
-    PARSER("GetT Finished");
-    return val1;
-}
 
-Node * GetPow(Node ** nodes, int * p)
-{
-    if (!nodes[*p]) return NULL;
-    PARSER("Getting pow... Got node %p", nodes[*p]);
-    Node * val1 = GetP(nodes, p);
-    if (!nodes[*p]) {PARSER("GetPow Finished"); return val1;}
-    while ((int)NodeValue(nodes[(*p)]) == '^')
+    if (error)
     {
-        PARSER("Got '^'");
-        int op = (int) NodeValue(nodes[(*p)]);
+        _release_node(left);
+        left = NULL;
+    }
 
-        Field * operation = NULL;
-        Diff diff = NULL;
-        if (NodeType(val1) == NUM) diff = DiffAX;
+    ParseFrame * frame = NULL;
+    while ((frame = (ParseFrame*) StackPop(&frames))) _release_node(frame->left);
 
-        (*p)++;
-        if (!nodes[*p]) return val1;
+    DestroyStack(&frames);
+    TRACE_PARSE(TRACE_INFO, "parsed %p", left);
+    return left;
+}
 
-        Node * val2 = GetP(nodes, p);
+const Binding * _parse_binding(const Token * token)
+{
+    if (token->kind != TOKEN_OPER) return NULL;
 
-        if (NodeType(val1) == NUM) diff = DiffAX;
-        else if (NodeType(val2) == NUM) diff = DiffPOW;
-        else diff = DiffHARDPOW;
-        if (!(operation = _create_field((field_t) op, OPER, diff))) return NULL;
+    for (size_t i = 0; i < sizeof(Bindings) / sizeof(Bindings[0]); i++)
+        if (Bindings[i].op == (int) token->value) return &Bindings[i];
 
-        if (!(val1 = _create_node(operation, val1, val2))) return NULL;
-    }
-    PARSER("GetPow Finished");
-    return val1;
+    return NULL;
 }
 
+// the right power of a prefix, -1 if token is none
+int _parse_prefix(const Token * token)
+{
+    if (token->kind == TOKEN_FUNC) return PARSE_FUNC;
+    if (token->kind != TOKEN_OPER) return -1;
+
+    if ((int) token->value == '(') return PARSE_GROUP;
+    if ((int) token->value == SUB) return PARSE_NEG;
+    return -1;
+}
 
-Node * GetP(Node ** nodes, int * p)
+// The node of frame once its right operand is complete. The operands are
+// taken over, both are released if there is no memory for the node.
+Node * _parse_apply(const ParseFrame * frame, Node * right)
 {
-    if (!nodes[*p]) return NULL;
-    PARSER("node = %p. Getting P...", nodes[*p]);
-    if ((int) NodeValue(nodes[*p]) == '(')
+    Node * left = frame->left;
+    Node * node = NULL;
+
+    if (frame->kind == TOKEN_FUNC)
+    {
+        Field func = _name_table(frame->op);
+        node = _create_node(_create_field(func.value, func.type, func.diff), right, NULL);
+    }
+    else if (!left && NodeType(right) == NUM)
+    {
+        // -2 is a number, 0 - v since -0 would print as "-0"
+        node = _create_node(_create_field(0 - NodeValue(right), NUM, DiffCONST), NULL, NULL);
+        _release_node(right);
+        return node;
+    }
+    else
     {
-        (*p)++;
-        PARSER("Got '('");
-        Node * val = GetE(nodes, p);
-        PARSER("Got node %p", nodes[*p]);
-        if (!nodes[*p]) return val;
-        if ((int) NodeValue(nodes[(*p)]) != ')') SYNTAX_ERROR(')', (int) NodeValue(nodes[(*p)]));
-        PARSER("Got ')'");
-        (*p)++;
-        return val;
+        // -x is 0 - x
+        if (!left) left = _create_node(_create_field(0, NUM, DiffCONST), NULL, NULL);
+        if (left) node = _create_node(_parse_field(frame->op, left, right), left, right);
     }
 
-    else if (NodeType(nodes[*p]) == FUNC) return GetFunc(nodes, p);
-    else if (NodeType(nodes[*p]) == VAR) return GetX(nodes, p);
-    else return GetN(nodes, p);
+    if (!node)
+    {
+        _release_node(left);
+        _release_node(right);
+    }
+
+    return node;
 }
 
-Node * GetFunc(Node ** nodes, int * p)
+// the Diff rule of '^' depends on the side that is a number
+Field * _parse_field(int op, Node * left, Node * right)
 {
-    if (!nodes[*p]) return NULL;
-    PARSER("Got node %p", nodes[*p]);
-    Node * result = _copy_node(nodes[*p]);
-    (*p)++;
+    Diff diff = DiffPLUS;
+    if (op == MUL) diff = DiffMUL;
+    else if (op == DIV) diff = DiffDIV;
+    else if (op == POW)
+    {
+        if (NodeType(left) == NUM) diff = DiffAX;
+        else if (NodeType(right) == NUM) diff = DiffPOW;
+        else diff = DiffHARDPOW;
+    }
 
-    Node * val = GetP(nodes, p);
-    if (!val) return NULL;
-    result->left = val;
-    return result;
+    return _create_field((field_t) op, OPER, diff);
 }
 
-Node * GetN(Node ** nodes, int * p)
+Node * GetN(const Token * token)
 {
-    if (!nodes[*p]) return NULL;
-    PARSER("Got node %p", nodes[*p]);
-    Node * result = _copy_node(nodes[*p]);
-    (*p)++;
-    if (!result) return NULL;
-    return result;
+    TRACE_PARSE(TRACE_DEBUG, "Got number at %zu", token->start);
+    return _create_node(_create_field(token->value, NUM, DiffCONST), NULL, NULL);
 }
 
-Node * GetX(Node ** nodes, int * p)
+Node * GetX(const Token * token)
 {
-    PARSER("Got node %p", nodes[*p]);
-    Node * result = _copy_node(nodes[*p]);
-    (*p)++;
-    if (!result) return NULL;
-    return result;
+    TRACE_PARSE(TRACE_DEBUG, "Got variable at %zu", token->start);
+    return _create_node(_create_field(token->value, VAR, DiffX), NULL, NULL);
 }
 
 
 // Differentiate Functions
 
+// Every unique node is differentiated once, later calls get the memo.
+// The nodes under node are differentiated first, bottom up, and leave their
+// memos behind, so a Diff rule finds the derivatives it asks for at hand
+// instead of recursing for them.
 Node * _diff_tree(Node * node)
 {
-    PARSER("Calling subfunction...");
-    // PARSER("left value = %lg, right value = %lg", ((Field*)node->left->value)->value, ((Field*)(node->right->value))->value);
-    Node * result = (Node*)((Field*)(node->value))->diff(node);
+    if (!node) return NULL;
+
+    Node * memo = __atomic_load_n(&node->diffed, __ATOMIC_ACQUIRE);
+    if (memo) return _copy_branch(memo);
+
+    // without a table there are no memos and the rules recurse
+    if (!CurrentTable || (!node->left && !node->right)) return _diff_node(node);
+
+    Stack stack;
+    InitStack(&stack, sizeof(NodeFrame));
+
+    Node * result = NULL;
+    int error = _push_frame(&stack, node);
+    NodeFrame * frame = NULL;
+    while (!error && (frame = (NodeFrame*) StackTop(&stack)))
+    {
+        Node * current = frame->node;
+
+        // a shared node may be on the stack twice, it is done by the first one
+        if (current != node && __atomic_load_n(&current->diffed, __ATOMIC_ACQUIRE))
+        {
+            StackPop(&stack);
+            continue;
+        }
+
+        // leaves are left to the rules, they need nothing
+        if (!frame->expanded)
+        {
+            frame->expanded = 1;
+            if (current->right && (current->right->left || current->right->right))
+                error = _push_frame(&stack, current->right);
+            if (!error && current->left && (current->left->left || current->left->right))
+                error = _push_frame(&stack, current->left);
+            continue;
+        }
+
+        StackPop(&stack);
+        Node * diffed = _diff_node(current);
+        if (!diffed) error = ALLOCATE_MEMORY_ERROR;
+        else if (current == node) result = diffed;
+        else _release_node(diffed);
+    }
+
+    DestroyStack(&stack);
     return result;
 }
 
+// the rule of node, memoized; the derivatives of the children are memos by now
+Node * _diff_node(Node * node)
+{
+    Node * memo = NULL;
+
+    TRACE_DIFF(TRACE_DEBUG, "Calling subfunction...");
+    Node * result = (Node*)((Field*)(node->value))->diff(node);
+    if (!result || !CurrentTable) return result;
+
+    if (!CurrentTable->locks)
+    {
+        node->diffed = _copy_branch(result);
+        return result;
+    }
+
+    // threads of a fork may differentiate a shared node at the same time,
+    // the first memo stays and the other result is dropped for it
+    Node * mine = _copy_branch(result);
+    if (__atomic_compare_exchange_n(&node->diffed, &memo, mine, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return result;
+
+    _release_node(mine);
+    _release_node(result);
+    return _copy_branch(memo);
+}
+
 Tree * DiffTree(Tree * tree)
+{
+    return DiffTreeBy(tree, DIFF_VAR);
+}
+
+// n-th derivative by x, simplified after every order so the next one starts
+// from the smallest tree instead of the expanded output of the previous one.
+Tree * DiffTreeN(Tree * tree, int n)
+{
+    if (!tree || n < 1) return NULL;
+
+    Tree * current = NULL;
+    for (int order = 0; order < n; order++)
+    {
+        Tree * next = DiffTree(current ? current : tree);
+        if (current) DestroyTree(current);
+        if (!next) return NULL;
+
+        current = next;
+        if (TreeSimplify(current, NULL))
+        {
+            DestroyTree(current);
+            return NULL;
+        }
+    }
+
+    return current;
+}
+
+// Derivative by the variable var (see VarId), every other variable is a constant.
+Tree * DiffTreeBy(Tree * tree, int var)
+{
+    return _diff_tree_by(tree, var, 0);
+}
+
+// DiffTree with the subtrees of a big tree differentiated by threads
+// (0 is one per CPU), a small tree is differentiated by the calling thread
+Tree * DiffTreeParallel(Tree * tree, size_t threads)
+{
+    return _diff_tree_by(tree, DIFF_VAR, threads ? threads : (size_t) -1);
+}
+
+Tree * _diff_tree_by(Tree * tree, int var, size_t threads)
 {
     if (!tree) return NULL;
     if (!tree->root) return NULL;
 
-    PARSER("\n<<<DIFFERENTIATING TREE START>>>\n");
+    TRACE_DIFF(TRACE_INFO, "differentiating tree %p", tree);
 
-    Tree * new_tree = CreateTree(tree->init, tree->cmp, tree->free);
-    PARSER("Created new tree %p...", new_tree);
+    // the derivative references the nodes of the source, so both share the arena
+    Tree * new_tree = (Tree*) malloc(sizeof(Tree));
+    TRACE_DIFF(TRACE_DEBUG, "Created new tree %p...", new_tree);
     if (!new_tree) return NULL;
+    *new_tree = (Tree) {NULL, tree->init, tree->cmp, tree->free, RetainArena(tree->arena), tree->table, 0};
+
+    // the tasks leave memos behind, the nodes above them are differentiated on top
+    Fork fork = {};
+    fork.tree = tree;
+    fork.diff = 1;
+    int error = SUCCESS;
+
+    ENTER_TREE(tree);
+    if (tree->table->var != var && !_table_forget_diffs(tree->table)) tree->table->var = var;
+    if (threads && tree->table->var == var) error = _fork_tree(&fork, threads == (size_t) -1 ? 0 : threads);
+
+    for (size_t i = 0; i < fork.count; i++) _release_node(fork.results[i]);
+    if (!error && tree->table->var == var) new_tree->root = _diff_tree(tree->root);
+    LEAVE_TREE;
+    _fork_free(&fork);
+    TRACE_DIFF(TRACE_DEBUG, "Differentiated tree root %p", new_tree->root);
+    if (!new_tree->root)
+    {
+        DestroyTree(new_tree);
+        return NULL;
+    }
 
-    new_tree->root = _diff_tree(tree->root);
-    PARSER("Differentiated tree root %p", new_tree->root);
-    if (!tree->root) return NULL;
-
-    PARSER("\n<<<DIFFERENTIATING TREE END>>>\n");
+    TRACE_DIFF(TRACE_INFO, "differentiated tree %p", new_tree);
 
     return new_tree;
 }
@@ -1050,62 +3328,60 @@ Tree * DiffTree(Tree * tree)
 void * DiffCONST(void * node)
 {
     if (!node) return NULL;
-    PARSER("<DIFFERENTIATING CONSTANT %lg.>", ((Field*)((Node*)node)->value)->value);
+    TRACE_DIFF(TRACE_DEBUG, "<DIFFERENTIATING CONSTANT %lg.>", ((Field*)((Node*)node)->value)->value);
 
     Field * field = _create_field(0, NUM, DiffCONST);
     if (!field) return NULL;
 
-    PARSER("Created field %p...", field);
+    TRACE_DIFF(TRACE_DEBUG, "Created field %p...", field);
 
     Node * result = _create_node(field, NULL, NULL);
     if (!result) return NULL;
 
-    PARSER("Created node %p...", result);
+    TRACE_DIFF(TRACE_DEBUG, "Created node %p...", result);
 
-    PARSER("<DIFFERENTIATING CONSTANT ENDED.>");
+    TRACE_DIFF(TRACE_DEBUG, "<DIFFERENTIATING CONSTANT ENDED.>");
     return (void*) result;
 }
 
 void * DiffX(void * node)
 {
     if (!node) return NULL;
-    PARSER("<DIFFERENTIATING VARIABLE %c %p.>", (int)((Field*)((Node*)node)->value)->value, node);
+    TRACE_DIFF(TRACE_DEBUG, "<DIFFERENTIATING VARIABLE %s %p.>", VarName((int) NodeValue((Node*) node)), node);
 
-    Field * field = _create_field(1, NUM, DiffCONST);
+    int var = CurrentTable ? CurrentTable->var : DIFF_VAR;
+    Field * field = _create_field((int) NodeValue((Node*) node) == var ? 1 : 0, NUM, DiffCONST);
     if (!field) return NULL;
 
-    PARSER("Created field %p...", field);
+    TRACE_DIFF(TRACE_DEBUG, "Created field %p...", field);
 
     Node * result = _create_node(field, NULL, NULL);
     if (!result) return NULL;
 
-    PARSER("Created node %p...", result);
+    TRACE_DIFF(TRACE_DEBUG, "Created node %p...", result);
 
-    PARSER("<DIFFERENTIATING VARIABLE ENDED.>");
+    TRACE_DIFF(TRACE_DEBUG, "<DIFFERENTIATING VARIABLE ENDED.>");
     return (void*)result;
 }
 
 void * DiffPLUS(void * node)
 {
     if (!node) return NULL;
-    PARSER("<DIFFERENTIATING %c.>", (int)((Field*)((Node*)node)->value)->value);
+    TRACE_DIFF(TRACE_DEBUG, "<DIFFERENTIATING %c.>", (int)((Field*)((Node*)node)->value)->value);
 
-    Node * diff_left = (Node*)((Field*)((Node*)node)->left->value)->diff(((Node*)node)->left);
+    Node * diff_left = _diff_tree(((Node*)node)->left);
     if (!diff_left) return NULL;
-    PARSER("Created differentiated subnode %p...", diff_left);
-    PARSER("%p ", (Node*)((Field*)((Node*)node)->right->value)->diff);
-    Node * diff_right = (Node*)((Field*)((Node*)node)->right->value)->diff(((Node*)node)->right);
+    TRACE_DIFF(TRACE_DEBUG, "Created differentiated subnode %p...", diff_left);
+    TRACE_DIFF(TRACE_DEBUG, "%p ", (Node*)((Field*)((Node*)node)->right->value)->diff);
+    Node * diff_right = _diff_tree(((Node*)node)->right);
     if (!diff_right) return NULL;
-    PARSER("Created differentiated subnode %p...", diff_right);
-
-    Node * plus = _copy_node((Node*)node);
-    PARSER("Created node plus %p", plus);
+    TRACE_DIFF(TRACE_DEBUG, "Created differentiated subnode %p...", diff_right);
 
-    plus->left = diff_left;
-    plus->right = diff_right;
+    Node * plus = _create_node(_copy_field((Field*)((Node*)node)->value), diff_left, diff_right);
+    TRACE_DIFF(TRACE_DEBUG, "Created node plus %p", plus);
 
 
-    PARSER("<DIFFERENTIATING %c ENDED.>", (int)((Field*)((Node*)node)->value)->value);
+    TRACE_DIFF(TRACE_DEBUG, "<DIFFERENTIATING %c ENDED.>", (int)((Field*)((Node*)node)->value)->value);
 
     return (void*)plus;
 
@@ -1122,9 +3398,9 @@ void * DiffMUL(void * node)
 
     // u' and v'
 
-    Node * diff_left = (Node*) ((Field*)(left_cp->value))->diff(left_cp);
+    Node * diff_left = _diff_tree(left_cp);
     if (!diff_left) return NULL;
-    Node * diff_right = (Node*) ((Field*)(right_cp->value))->diff(right_cp);
+    Node * diff_right = _diff_tree(right_cp);
     if (!diff_right) return NULL;
 
     // '+' field
@@ -1158,110 +3434,110 @@ void * DiffDIV(void * node)
 {
     if (!node) return NULL;
 
-    PARSER("<DIFFERENTIATING %c %p.>", (int)((Field*)(((Node*)node)->value))->value, node);
+    TRACE_DIFF(TRACE_DEBUG, "<DIFFERENTIATING %c %p.>", (int)((Field*)(((Node*)node)->value))->value, node);
 
     // u and v
     if (!((Node*)node)->left) return NULL;
     Node * left_cp = _copy_branch(((Node*)node)->left);
     if (!left_cp) return NULL;
-    PARSER("Created copy of left node %p: %p", ((Node*)node)->left, left_cp)
+    TRACE_DIFF(TRACE_DEBUG, "Created copy of left node %p: %p", ((Node*)node)->left, left_cp);
 
     if (!((Node*)node)->right) return NULL;
     Node * right_cp = _copy_branch(((Node*)node)->right);
     if (!right_cp) return NULL;
-    PARSER("Created copy of right node %p: %p", ((Node*)node)->right, right_cp)
+    TRACE_DIFF(TRACE_DEBUG, "Created copy of right node %p: %p", ((Node*)node)->right, right_cp);
 
-    PARSER("Differentiating node %p...", left_cp);
-    Node * diff_left = (Node*)((Field*)(left_cp->value))->diff(left_cp);
+    TRACE_DIFF(TRACE_DEBUG, "Differentiating node %p...", left_cp);
+    Node * diff_left = _diff_tree(left_cp);
     if (!diff_left) return NULL;
-    PARSER("Differentiated node %p: %p", left_cp, diff_left);
+    TRACE_DIFF(TRACE_DEBUG, "Differentiated node %p: %p", left_cp, diff_left);
 
-    PARSER("Differentiating node %p...", right_cp);
-    Node * diff_right = (Node*)((Field*)(right_cp->value))->diff(right_cp);
+    TRACE_DIFF(TRACE_DEBUG, "Differentiating node %p...", right_cp);
+    Node * diff_right = _diff_tree(right_cp);
     if (!diff_right) return NULL;
-    PARSER("Differentiated node %p: %p", right_cp, diff_right);
+    TRACE_DIFF(TRACE_DEBUG, "Differentiated node %p: %p", right_cp, diff_right);
 
     // '-' field and two '*' fields
     Field * minus = _create_field((field_t) '-', OPER, DiffPLUS);
     if (!minus) return NULL;
-    PARSER("Created '-' field %p", minus);
+    TRACE_DIFF(TRACE_DEBUG, "Created '-' field %p", minus);
 
     Field * mul_left = _create_field((field_t) '*', OPER, DiffMUL);
     if (!mul_left) return NULL;
-    PARSER("Created left '*' field %p", mul_left);
+    TRACE_DIFF(TRACE_DEBUG, "Created left '*' field %p", mul_left);
 
     Field * mul_right = _create_field((field_t) '*', OPER, DiffMUL);
     if (!mul_right) return NULL;
-    PARSER("Created right '*' field %p", mul_right);
+    TRACE_DIFF(TRACE_DEBUG, "Created right '*' field %p", mul_right);
 
     // u'v and v'u
     Node * left = _create_node(mul_left, diff_left, right_cp);
     if (!left) return NULL;
-    PARSER("Created left node %p with '*' field and left:%p, right:%p", left, mul_left, diff_left, right_cp);
+    TRACE_DIFF(TRACE_DEBUG, "Created left node %p with '*' field %p and left:%p, right:%p", left, mul_left, diff_left, right_cp);
 
     Node * right = _create_node(mul_right, diff_right, left_cp);
     if (!right) return NULL;
-    PARSER("Created left node %p with '*' field and left:%p, right:%p", right, mul_right, diff_right, left_cp);
+    TRACE_DIFF(TRACE_DEBUG, "Created right node %p with '*' field %p and left:%p, right:%p", right, mul_right, diff_right, left_cp);
 
     // u'v - v'u
     Node * higher = _create_node(minus, left, right);
     if (!higher) return NULL;
-    PARSER("Created node %p with '-' field and left:%p. right:%p", higher, minus, left, right);
+    TRACE_DIFF(TRACE_DEBUG, "Created node %p with '-' field %p and left:%p, right:%p", higher, minus, left, right);
 
 
     // v and field of number 2
     Node * lower_right_cp = _copy_branch(((Node*)node)->right);
     if (!lower_right_cp) return NULL;
-    PARSER("Created lower copy of right node %p: %p", ((Node*)node)->right, lower_right_cp)
+    TRACE_DIFF(TRACE_DEBUG, "Created lower copy of right node %p: %p", ((Node*)node)->right, lower_right_cp);
 
     Field * two = _create_field(2, NUM, DiffCONST);
     if (!two) return NULL;
-    PARSER("Created field %p with number 2", two);
+    TRACE_DIFF(TRACE_DEBUG, "Created field %p with number 2", two);
 
     // '^' field and v^2
     Field * pw = _create_field((field_t) '^', OPER, DiffPOW);
     if (!pw) return NULL;
-    PARSER("Created field %p with '^'", pw);
+    TRACE_DIFF(TRACE_DEBUG, "Created field %p with '^'", pw);
 
     Node * twof = _create_node(two, NULL, NULL);
     if (!twof) return NULL;
-    PARSER("Created node %p with number 2", twof);
+    TRACE_DIFF(TRACE_DEBUG, "Created node %p with number 2", twof);
     Node * lower = _create_node(pw, lower_right_cp, twof);
-    PARSER("Created node %p with field '^' and left:%p, right:%p", lower, lower_right_cp, twof);
+    TRACE_DIFF(TRACE_DEBUG, "Created node %p with field '^' and left:%p, right:%p", lower, lower_right_cp, twof);
     if (!lower) return NULL;
 
     // '/' field and (u'v - v'u) / (v^2)
     Field * div = _create_field((field_t) '/', OPER, DiffDIV);
     if (!div) return NULL;
-    PARSER("Created field %p with '/'", div);
+    TRACE_DIFF(TRACE_DEBUG, "Created field %p with '/'", div);
 
     Node * result = _create_node(div, higher, lower);
     if (!result) return NULL;
 
-    PARSER("Created node %p with field '/' and left:%p, right:%p", result, higher, lower);
+    TRACE_DIFF(TRACE_DEBUG, "Created node %p with field '/' and left:%p, right:%p", result, higher, lower);
 
-    PARSER("<DIFFERENTIATING %c ENDED.>", (int)((Field*)((Node*)node)->value)->value);
+    TRACE_DIFF(TRACE_DEBUG, "<DIFFERENTIATING %c ENDED.>", (int)((Field*)((Node*)node)->value)->value);
     return (void*) result;
 }
 
 void * DiffPOW(void * node)
 {
-    PARSER("<DIFFERENTIATING %c, func = %p.>", (int)((Field*)((Node*)node)->value)->value, ((Field*)((Node*)node)->value)->diff);
-    PARSER("Copying node %p with value %lg and field %p...", node, ((Field*)((Node*)node)->right->value)->value, ((Node*)node)->right->value);
+    TRACE_DIFF(TRACE_DEBUG, "<DIFFERENTIATING %c, func = %p.>", (int)((Field*)((Node*)node)->value)->value, ((Field*)((Node*)node)->value)->diff);
+    TRACE_DIFF(TRACE_DEBUG, "Copying node %p with value %lg and field %p...", node, ((Field*)((Node*)node)->right->value)->value, ((Node*)node)->right->value);
 
     Field * n1 = _copy_field((Field*)((Node*)node)->right->value);
     if (!n1) return NULL;
 
 
-    PARSER("Copying node %p with value %lg and field %p...", node, ((Field*)((Node*)node)->right->value)->value, ((Node*)node)->right->value);
+    TRACE_DIFF(TRACE_DEBUG, "Copying node %p with value %lg and field %p...", node, ((Field*)((Node*)node)->right->value)->value, ((Node*)node)->right->value);
     Field * n2 = _copy_field((Field*)((Node*)node)->right->value);
     if (!n2) return NULL;
     n2->value -= 1;
 
-    PARSER("Copying node %p...", ((Node*)node)->left);
+    TRACE_DIFF(TRACE_DEBUG, "Copying node %p...", ((Node*)node)->left);
     Node * x_node = _copy_branch(((Node*)node)->left);
     if (!x_node) return NULL;
-    PARSER("Copyied node %p: %p", ((Node*)node)->left, x_node);
+    TRACE_DIFF(TRACE_DEBUG, "Copyied node %p: %p", ((Node*)node)->left, x_node);
 
     Field * mul = _create_field((field_t) '*', OPER, DiffMUL);
     if (!mul) return NULL;
@@ -1281,10 +3557,8 @@ void * DiffPOW(void * node)
     Node * mul_node = _create_node(mul, n1_node, pow_node);
     if (!mul_node) return NULL;
 
-    Node * x_diff = (Node*)((Field*)((x_node)->value))->diff(x_node);
-    Node * result = _copy_node(mul_node);
-    result->left = mul_node;
-    result->right = x_diff;
+    Node * x_diff = _diff_tree(x_node);
+    Node * result = _create_node(_create_field((field_t) '*', OPER, DiffMUL), mul_node, x_diff);
 
     return (void*)result;
 }
@@ -1321,14 +3595,14 @@ void * DiffEX(void * node)
 void * DiffTG(void * node)
 {
     return _create_node(N_MUL,
-                        _create_node(N_DIV, NUM_NODE(1), _create_node(N_POW, _copy_branch(LEFT(node)), NUM_NODE(2))),
+                        _create_node(N_DIV, NUM_NODE(1), _create_node(N_POW, _create_node(N_FUNC(COS), _copy_branch(LEFT(node)), NULL), NUM_NODE(2))),
                         DIFF(LEFT(node), LEFT(node)));
 }
 
 void * DiffCTG(void * node)
 {
     return _create_node(N_MUL,
-                        (_create_node(N_DIV, _create_node(N_SUB, NUM_NODE(0), NUM_NODE(1)), _create_node(N_POW, _copy_branch(LEFT(node)), NUM_NODE(2)))),
+                        (_create_node(N_DIV, _create_node(N_SUB, NUM_NODE(0), NUM_NODE(1)), _create_node(N_POW, _create_node(N_FUNC(SIN), _copy_branch(LEFT(node)), NULL), NUM_NODE(2)))),
                         DIFF(LEFT(node), LEFT(node)));
 }
 
@@ -1356,21 +3630,21 @@ void * DiffAX(void * node)
 void * DiffTH(void * node)
 {
     return _create_node(N_MUL,
-                _create_node(N_DIV, NUM_NODE(1), _create_node(N_POW, _create_node(N_FUNC(CH), LEFT(node), NULL), NUM_NODE(2))),
+                _create_node(N_DIV, NUM_NODE(1), _create_node(N_POW, _create_node(N_FUNC(CH), _copy_branch(LEFT(node)), NULL), NUM_NODE(2))),
                 DIFF(LEFT(node), LEFT(node)));
 }
 
 void * DiffCTH(void * node)
 {
     return _create_node(N_MUL,
-                _create_node(N_DIV, NUM_NODE(1), _create_node(N_POW, _create_node(N_FUNC(SH), LEFT(node), NULL), NUM_NODE(2))),
+                _create_node(N_DIV, _create_node(N_SUB, NUM_NODE(0), NUM_NODE(1)), _create_node(N_POW, _create_node(N_FUNC(SH), _copy_branch(LEFT(node)), NULL), NUM_NODE(2))),
                 DIFF(LEFT(node), LEFT(node)));
 }
 
 void * DiffLOG(void * node)
 {
     return _create_node(N_MUL,
-            (_create_node(N_DIV, NUM_NODE(1), _create_node(N_MUL, _create_node(N_FUNC(LN), LEFT(node), NULL), _copy_node(RIGHT(node))))),
+            (_create_node(N_DIV, NUM_NODE(1), _create_node(N_MUL, _copy_branch(LEFT(node)), _create_node(N_FUNC(LN), NUM_NODE(10), NULL)))),
             DIFF(LEFT(node), LEFT(node)));
 }
 
@@ -1378,8 +3652,8 @@ void * DiffHARDPOW(void * node)
 {
     Node * toDiff = _create_node(N_MUL, _create_node(N_FUNC(LN), _copy_branch(LEFT(node)), NULL), _copy_branch(RIGHT(node)));
     Node * Diffed = (Node*)DiffMUL(toDiff);
-    _destroy_node(toDiff);
-    return _create_node(N_MUL, _create_node(N_POW, _create_node(N_E, NULL, NULL), _create_node(N_MUL, _create_node(N_FUNC(LN), _copy_branch(LEFT(node)), NULL), _copy_branch(RIGHT(node)))),
+    // e^(ln(u) * v) has a non constant exponent, DiffPOW would not do for it
+    return _create_node(N_MUL, _create_node(N_EXP, _create_node(N_E, NULL, NULL), toDiff),
         Diffed);
 }
 
@@ -1,7 +1,14 @@
 #ifndef DIFF_H
 #define DIFF_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "render.h"
+
 typedef struct _tree Tree;
+typedef struct _tex_report TexReport;
 
 enum types
 {
@@ -73,9 +80,91 @@ enum errors
     ALLOCATE_MEMORY_ERROR,
     MEMCPY_ERROR,
     FOPEN_ERROR,
-    FCLOSE_ERROR
+    FCLOSE_ERROR,
+    DIVISION_BY_ZERO,
+    UNKNOWN_NODE,
+    INVALID_ARGUMENT
+};
+
+typedef struct _simplify_stats
+{
+    size_t passes;
+    size_t rewrites;
+
+} SimplifyStats;
+
+const size_t SIMPLIFY_MAX_PASSES = 64;
+
+// subtrees of at most that many nodes are the tasks of the parallel versions
+const size_t PARALLEL_CUTOFF = 4096;
+
+enum dump_dot
+{
+    DUMP_NO_DOT,
+    DUMP_DOT_WAIT,
+    DUMP_DOT_ASYNC          // dot is left running, TreeDumpWith returns at once
 };
 
+// What TreeDumpWith writes: a subtree deeper than max_depth levels or past
+// max_nodes nodes in breadth-first order is one box with its size.
+typedef struct _dump_options
+{
+    size_t max_depth;       // 0 is no limit
+    size_t max_nodes;       // 0 is no limit
+    int dot;                // enum dump_dot
+    const char * format;    // of the picture: png, svg...
+
+} DumpOptions;
+
+const DumpOptions DUMP_DEFAULTS = {0, 2000, DUMP_DOT_WAIT, "png"};
+const size_t DUMP_BUFFER = 64 * 1024;
+
+// File of TreeSave: the header, then count values, count left and count
+// right child indices, count types and count Diff rules, then the names of
+// the variables longer than a letter, each ending with '\0'. Node 0 is the
+// root and the children of a node come after it; STORED_NONE is no child.
+// Such a variable is stored as VAR_NAMES + its place among the names, ids
+// of VarId are only good in the process that made them.
+typedef struct _stored_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t order;         // STORED_ORDER as written, so a file of another byte order is refused
+    uint64_t count;
+    uint32_t flags;
+    uint32_t names;
+
+} StoredHeader;
+
+const char STORED_MAGIC[8] = {'D', 'I', 'F', 'F', 'T', 'R', 'E', 'E'};
+const uint32_t STORED_VERSION = 2;
+const uint32_t STORED_ORDER = 0x01020304;
+const uint32_t STORED_NONE = 0xFFFFFFFF;
+const uint32_t STORED_UNIQUE = 0x1;        // no two nodes are equal, they come from a unique table
+const size_t STORED_PREFETCH = 16;
+
+// the arrays of a mapped file, read in place
+typedef struct _stored_tree
+{
+    const field_t * values;     // number, operator, function or variable name
+    const uint32_t * left;
+    const uint32_t * right;
+    const uint8_t * types;      // enum types
+    const uint8_t * rules;      // the Diff of a node, a place in a fixed list of the rules
+    size_t count;
+    uint32_t flags;
+    int * vars;                 // VarId of each name of the file
+    size_t names;
+
+    void * map;
+    size_t size;
+
+} StoredTree;
+
+// DiffTree differentiates by x, one-letter variables are their own id
+const int DIFF_VAR = 'x';
+const int VAR_NAMES = 256;
+
 Tree * CreateTree(TreeInit init, TreeCmp cmp, TreeFree free);
 
 int CreateNode(Tree * t, const void * pair);
@@ -84,16 +173,74 @@ int InsertTree(Tree * t, const void * pair);
 
 int TreeParse(Tree * tree, const char * filename);
 
+int TreeParseString(Tree * tree, const char * expression);
+
 Tree * TreeDump(Tree * tree, const char * FileName);
 
+int TreeDumpWith(Tree * tree, const char * FileName, const DumpOptions * options);
+
 Tree * TexDump(Tree * tree, const char * filename);
 
-int TreeSimplify(Tree * tree);
+int TexDumpWith(Tree * tree, const char * filename, Render * render);
+
+TexReport * TexReportBegin(const char * filename);
+
+int TexReportAdd(TexReport * report, Tree * tree, const char * caption);
+
+int TexReportEnd(TexReport * report, Render * render);
+
+int TreePrint(Tree * tree, FILE * out);
+
+int TreeTex(Tree * tree, FILE * out);
+
+char * TreeTexString(Tree * tree, size_t * length);
+
+int TreeSimplify(Tree * tree, SimplifyStats * stats);
+
+int TreeSimplifyParallel(Tree * tree, size_t threads, SimplifyStats * stats);
+
+int TreeCanonical(Tree * tree);
+
+uint64_t TreeHash(Tree * tree);
+
+int TreeEqual(Tree * a, Tree * b);
 
 field_t CountTree(Tree * tree);
 
+int TreeSaveTo(Tree * tree, FILE * out);
+
+int TreeSave(Tree * tree, const char * filename);
+
+int TreeLoad(Tree * tree, const char * filename);
+
+StoredTree * OpenStoredTree(const char * filename);
+
+StoredTree * OpenStoredTreeAt(const char * filename, size_t offset);
+
+int TreeLoadStored(Tree * tree, const StoredTree * stored);
+
+void CloseStoredTree(StoredTree * stored);
+
+size_t TreeSize(Tree * tree);
+
+size_t TreeNodes(Tree * tree);
+
+size_t TreeMemory(Tree * tree);
+
 Tree * DiffTree(Tree * tree);
 
+Tree * DiffTreeBy(Tree * tree, int var);
+
+Tree * DiffTreeN(Tree * tree, int n);
+
+Tree * DiffTreeParallel(Tree * tree, size_t threads);
+
+int VarId(const char * name);
+
+int VarIdSpan(const char * name, size_t length);
+
+const char * VarName(int var);
+
 void DestroyTree(Tree * t);
 
 
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "lexer.h"
+#include "trace.h"
+
+typedef struct _func_name
+{
+    const char * name;
+    size_t length;
+    int func;
+
+} FuncName;
+
+// The input comes in pieces: the whole string, the mapping of a file or
+// the chunks of a pipe. A lexeme that runs past the end of a piece is
+// moved to carry, the only place the input is ever copied to.
+struct _lexer
+{
+    Buff * buff;            // NULL for a string
+    const char * data;      // the current piece
+    size_t size;
+    size_t pos;
+    size_t offset;          // of data in the input
+    char * carry;           // the start of a lexeme from the earlier pieces
+    size_t carried;
+    size_t carry_cap;
+    char pending[LEXER_LOOKAHEAD];  // read ahead past a lexeme into the next piece
+    const char * saved;             // that piece, it goes on after pending
+    size_t saved_size;
+    int error;
+};
+
+// The arc functions have no derivative rules yet, their names read as variables.
+static const FuncName FuncNames[] =
+{
+    {"sin", 3, SIN},
+    {"cos", 3, COS},
+    {"tg",  2, TG},
+    {"ctg", 3, CTG},
+    {"sh",  2, SH},
+    {"ch",  2, CH},
+    {"th",  2, TH},
+    {"cth", 3, CTH},
+    {"ln",  2, LN},
+    {"log", 3, LOG},
+    {"e",   1, EX},
+};
+
+static int _func_id(const char * name, size_t length);
+static Token * _push_token(Tokens * tokens);
+static int _lex_fill(Lexer * lex);
+static int _lex_carry(Lexer * lex, const char * data, size_t size);
+static char _lex_at(Lexer * lex, size_t k);
+static const char * _lex_take(Lexer * lex, size_t length);
+static size_t _number_length(Lexer * lex);
+static int _lex_token(Lexer * lex, Token * token);
+
+static int _func_id(const char * name, size_t length)
+{
+    for (size_t i = 0; i < sizeof(FuncNames) / sizeof(FuncNames[0]); i++)
+        if (FuncNames[i].length == length && !memcmp(FuncNames[i].name, name, length))
+            return FuncNames[i].func;
+
+    return -1;
+}
+
+static Token * _push_token(Tokens * tokens)
+{
+    if (tokens->count == tokens->cap)
+    {
+        size_t cap = tokens->cap ? tokens->cap * 2 : TOKENS_FIRST;
+        Token * grown = (Token*) realloc(tokens->tokens, cap * sizeof(Token));
+        if (!grown) return NULL;
+
+        tokens->tokens = grown;
+        tokens->cap = cap;
+    }
+
+    Token * token = &tokens->tokens[tokens->count++];
+    *token = (Token) {};
+    return token;
+}
+
+Lexer * CreateLexer(const char * string)
+{
+    if (!string) return NULL;
+
+    Lexer * lex = (Lexer*) calloc(1, sizeof(Lexer));
+    if (!lex) return NULL;
+
+    lex->data = string;
+    lex->size = strlen(string);
+    return lex;
+}
+
+// the lexer reads buff, which is still closed by the caller
+Lexer * CreateBuffLexer(Buff * buff)
+{
+    if (!buff) return NULL;
+
+    Lexer * lex = (Lexer*) calloc(1, sizeof(Lexer));
+    if (!lex) return NULL;
+
+    lex->buff = buff;
+    return lex;
+}
+
+// moves on to the next piece, 0 at the end of the input
+static int _lex_fill(Lexer * lex)
+{
+    lex->offset += lex->size;
+    lex->pos = 0;
+
+    if (lex->saved)
+    {
+        lex->data = lex->saved;
+        lex->size = lex->saved_size;
+        lex->saved = NULL;
+        return lex->size > 0;
+    }
+
+    lex->size = lex->buff ? BuffNext(lex->buff, &lex->data) : 0;
+    TRACE_LEX(TRACE_INFO, "piece of %zu bytes at %zu", lex->size, lex->offset);
+
+    if (lex->buff && BuffError(lex->buff)) lex->error = FOPEN_ERROR;
+    return lex->size > 0;
+}
+
+static int _lex_carry(Lexer * lex, const char * data, size_t size)
+{
+    if (lex->carried + size + 1 > lex->carry_cap)
+    {
+        size_t cap = lex->carry_cap ? lex->carry_cap : DEF_SIZE;
+        while (cap < lex->carried + size + 1) cap *= 2;
+
+        char * grown = (char*) realloc(lex->carry, cap);
+        if (!grown) return ALLOCATE_MEMORY_ERROR;
+
+        lex->carry = grown;
+        lex->carry_cap = cap;
+    }
+
+    memcpy(lex->carry + lex->carried, data, size);
+    lex->carried += size;
+    lex->carry[lex->carried] = '\0';
+    return SUCCESS;
+}
+
+// character k of the lexeme that starts at pos, '\0' past the end of the input
+static char _lex_at(Lexer * lex, size_t k)
+{
+    while (1)
+    {
+        if (k < lex->carried) return lex->carry[k];
+
+        // once something is carried the rest of the lexeme starts the piece
+        size_t i = lex->pos + k - lex->carried;
+        if (i < lex->size) return lex->data[i];
+
+        if (!lex->buff || lex->error) return '\0';
+        if (_lex_carry(lex, lex->data + lex->pos, lex->size - lex->pos))
+        {
+            lex->error = ALLOCATE_MEMORY_ERROR;
+            return '\0';
+        }
+
+        if (!_lex_fill(lex)) return '\0';
+    }
+}
+
+// Consumes the lexeme of the given length. The text is in the piece if it
+// fits there, else in carry; it stays valid until the next lexeme.
+static const char * _lex_take(Lexer * lex, size_t length)
+{
+    const char * text = lex->data + lex->pos;
+
+    if (lex->carried > length)
+    {
+        // the look ahead of _number_length went on into the next piece,
+        // what it took past the lexeme is read again before that piece
+        size_t extra = lex->carried - length;
+        memcpy(lex->pending, lex->carry + length, extra);
+        lex->carry[length] = '\0';
+
+        lex->saved = lex->data;
+        lex->saved_size = lex->size;
+        lex->data = lex->pending;
+        lex->size = extra;
+        lex->pos = 0;
+        lex->offset -= extra;
+
+        text = lex->carry;
+        lex->carried = 0;
+    }
+    else if (lex->carried)
+    {
+        size_t rest = length - lex->carried;
+        if (_lex_carry(lex, lex->data, rest))
+        {
+            lex->error = ALLOCATE_MEMORY_ERROR;
+            return NULL;
+        }
+
+        text = lex->carry;
+        lex->pos = rest;
+        lex->carried = 0;
+    }
+    else lex->pos += length;
+
+    return text;
+}
+
+// what strtod reads of a decimal number, it is scanned before it is
+// converted since a mapped file has no terminator after its last digit
+static size_t _number_length(Lexer * lex)
+{
+    size_t n = 0;
+    while (isdigit((unsigned char) _lex_at(lex, n))) n++;
+
+    if (_lex_at(lex, n) == '.')
+        for (n++; isdigit((unsigned char) _lex_at(lex, n)); ) n++;
+
+    char c = _lex_at(lex, n);
+    if (c == 'e' || c == 'E')
+    {
+        size_t m = n + 1;
+        if (_lex_at(lex, m) == '+' || _lex_at(lex, m) == '-') m++;
+
+        if (isdigit((unsigned char) _lex_at(lex, m)))
+            for (n = m; isdigit((unsigned char) _lex_at(lex, n)); ) n++;
+    }
+
+    return n;
+}
+
+// An unknown character ends the input with lexer->error set.
+static int _lex_token(Lexer * lex, Token * token)
+{
+    while (1)
+    {
+        if (lex->pos == lex->size && !_lex_fill(lex)) return SUCCESS;
+        if (!isspace((unsigned char) lex->data[lex->pos])) break;
+        lex->pos++;
+    }
+
+    token->start = lex->offset + lex->pos;
+    char c = lex->data[lex->pos];
+    size_t length = 0;
+
+    if (strchr("()+-*/^", c))
+    {
+        token->kind = TOKEN_OPER;
+        token->value = c;
+        length = 1;
+        _lex_take(lex, length);
+    }
+    else if (isalpha((unsigned char) c))
+    {
+        while (isalnum((unsigned char) _lex_at(lex, length)) || _lex_at(lex, length) == '_') length++;
+
+        const char * name = _lex_take(lex, length);
+        if (!name) return ALLOCATE_MEMORY_ERROR;
+
+        int func = _func_id(name, length);
+        token->kind = func < 0 ? TOKEN_VAR : TOKEN_FUNC;
+        token->value = func < 0 ? VarIdSpan(name, length) : func;
+        if (token->value < 0) return ALLOCATE_MEMORY_ERROR;
+    }
+    else if (isdigit((unsigned char) c))
+    {
+        length = _number_length(lex);
+
+        // strtod needs a terminator, so the number goes through carry
+        const char * text = _lex_take(lex, length);
+        if (!text) return ALLOCATE_MEMORY_ERROR;
+
+        if (text != lex->carry && _lex_carry(lex, text, length)) return ALLOCATE_MEMORY_ERROR;
+        lex->carried = 0;
+
+        token->kind = TOKEN_NUM;
+        token->value = strtod(lex->carry, NULL);
+    }
+    else return UNKNOWN_NODE;
+
+    token->length = (unsigned int) length;
+    return SUCCESS;
+}
+
+// The next lexeme straight from the input, nothing is lexed ahead of the
+// caller. TOKEN_END at the end of the input and from the first error on.
+void LexerRead(Lexer * lexer, Token * token)
+{
+    *token = (Token) {};
+    if (lexer->error) return;
+
+    int error = _lex_token(lexer, token);
+    if (error)
+    {
+        lexer->error = error;
+        *token = (Token) {};
+    }
+    TRACE_LEX(TRACE_DEBUG, "token %d of %u at %zu", (int) token->kind, token->length, token->start);
+}
+
+int LexerError(const Lexer * lexer)
+{
+    if (!lexer) return INVALID_ARGUMENT;
+    return lexer->error;
+}
+
+void DestroyLexer(Lexer * lexer)
+{
+    if (!lexer) return;
+
+    free(lexer->carry);
+    free(lexer);
+}
+
+// Replaces the contents of tokens with all the lexemes of string.
+int Tokenize(const char * string, Tokens * tokens)
+{
+    if (!string || !tokens) return INVALID_ARGUMENT;
+    tokens->count = 0;
+
+    Lexer * lex = CreateLexer(string);
+    if (!lex) return ALLOCATE_MEMORY_ERROR;
+
+    // an error shows up as the end of the input, the tokens before it are kept
+    int error = SUCCESS;
+    while (!error)
+    {
+        Token * token = _push_token(tokens);
+        if (!token)
+        {
+            error = ALLOCATE_MEMORY_ERROR;
+            break;
+        }
+
+        LexerRead(lex, token);
+        if (token->kind == TOKEN_END) break;
+    }
+
+    if (!error) error = LexerError(lex);
+
+    DestroyLexer(lex);
+    return error;
+}
+
+void DestroyTokens(Tokens * tokens)
+{
+    if (!tokens) return;
+
+    free(tokens->tokens);
+    *tokens = (Tokens) {};
+}
@@ -0,0 +1,56 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stddef.h>
+
+#include "diff.h"
+#include "buff.h"
+
+enum token_kinds
+{
+    TOKEN_END,
+    TOKEN_NUM,
+    TOKEN_VAR,
+    TOKEN_FUNC,
+    TOKEN_OPER
+};
+
+// a lexeme is a span of the input, it is never copied out of it
+typedef struct _token
+{
+    enum token_kinds kind;
+    unsigned int length;
+    size_t start;
+    field_t value;          // the number, the variable id (see VarId), the function or the character
+
+} Token;
+
+// grows as needed and ends with a TOKEN_END token
+typedef struct _tokens
+{
+    Token * tokens;
+    size_t count;
+    size_t cap;
+
+} Tokens;
+
+typedef struct _lexer Lexer;
+
+const size_t TOKENS_FIRST = 256;
+const size_t LEXER_LOOKAHEAD = 4;      // characters a lexeme is read past its end at most
+
+Lexer * CreateLexer(const char * string);
+
+Lexer * CreateBuffLexer(Buff * buff);
+
+void LexerRead(Lexer * lexer, Token * token);
+
+int LexerError(const Lexer * lexer);
+
+void DestroyLexer(Lexer * lexer);
+
+int Tokenize(const char * string, Tokens * tokens);
+
+void DestroyTokens(Tokens * tokens);
+
+#endif
@@ -1,12 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "diff.h"
 #include "buff.h"
+#include "batch.h"
+#include "trace.h"
 
 void * FieldInit(const void * field);
 int FieldCmp(const void * f1, const void * f2);
 void FieldDestroy(void * field);
+int BatchMain(int argc, char ** argv);
 
 void * FieldInit(const void * field)
 {
@@ -30,25 +34,94 @@ void FieldDestroy(void * field)
     free((Field*) field);
 }
 
-int main(void)
+// a.out [-i input] [-o output] [-f infix|tex|none] [-j threads] [-c cache]:
+// derivatives of every line of input (stdin by default) streamed to output
+// (stdout by default), -j runs them on a thread pool, -j 0 on every CPU,
+// -c keeps them in the cache directory across runs
+int BatchMain(int argc, char ** argv)
 {
+    const char * input = NULL;
+    const char * output = NULL;
+    int format = BATCH_INFIX;
+    long threads = -1;
+    const char * cache_dir = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-i") == 0)         input = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-o") == 0)    output = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-f") == 0)    format = BatchFormat(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-j") == 0)    threads = strtol(argv[++i], NULL, 10);
+        else if (i + 1 < argc && strcmp(argv[i], "-c") == 0)    cache_dir = argv[++i];
+        else format = -1;
+    }
+
+    if (format < 0 || threads < -1)
+    {
+        fprintf(stderr, "usage: %s [-i input] [-o output] [-f infix|tex|none] [-j threads] [-c cache]\n", argv[0]);
+        return INVALID_ARGUMENT;
+    }
+
+    FILE * in = input && strcmp(input, "-") ? fopen(input, "rb") : stdin;
+    FILE * out = output && strcmp(output, "-") ? fopen(output, "wb") : stdout;
+    if (!in || !out)
+    {
+        fprintf(stderr, "can not open %s\n", in ? output : input);
+        if (in && in != stdin) fclose(in);
+        return FOPEN_ERROR;
+    }
+
+    static char buffer[BATCH_OUT_BUFFER];
+    setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+
+    DiffCache * cache = NULL;
+    if (cache_dir)
+    {
+        cache = CreateDiffCache(cache_dir, DIFF_CACHE_SIZE);
+        if (!cache) fprintf(stderr, "can not open the cache %s, running without it\n", cache_dir);
+        BatchUseCache(cache);
+    }
+
+    BatchStats stats = {};
+    int error = threads < 0 ? BatchRun(in, out, format, &stats)
+                            : BatchRunParallel(in, out, format, (size_t) threads, &stats);
+    BatchReport(&stats, stderr);
+
+    if (cache)
+    {
+        CacheStats cached = {};
+        DiffCacheGetStats(cache, &cached);
+        fprintf(stderr, "cache: %zu hits, %zu misses, %zu stores, %zu evictions\n",
+                cached.hits, cached.misses, cached.stores, cached.evictions);
+        BatchUseCache(NULL);
+        DestroyDiffCache(cache);
+    }
+
+    if (in != stdin) fclose(in);
+    if (out != stdout && fclose(out)) error = FCLOSE_ERROR;
+    return error;
+}
+
+// DIFF_TRACE=parse,diff:3 turns on the traces compiled in (see trace.h)
+int main(int argc, char ** argv)
+{
+    const char * trace = getenv("DIFF_TRACE");
+    if (trace && TraceSetupSpec(trace))
+    {
+        fprintf(stderr, "DIFF_TRACE is categories (lex, parse, diff, simplify, dump, tree, all) and :level\n");
+        return INVALID_ARGUMENT;
+    }
+
+    if (argc > 1) return BatchMain(argc, argv);
+
     Tree * tree = CreateTree(FieldInit, FieldCmp, free);
     TreeParse(tree, "toparse.txt");
     TreeDump(tree, "tree");
     Tree * new_tree = DiffTree(tree);
 
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
-    TreeSimplify(new_tree);
+    SimplifyStats stats = {};
+    TreeSimplify(new_tree, &stats);
+    printf("simplified in %zu passes, %zu rewrites\n", stats.passes, stats.rewrites);
 
 
 
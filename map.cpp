@@ -0,0 +1,113 @@
+#include <stdlib.h>
+
+#include "map.h"
+#include "diff.h"
+
+// open addressing table from pointers to pointers, keys are never removed
+typedef struct _entry
+{
+    void * key;
+    void * value;
+
+} Entry;
+
+struct _map
+{
+    Entry * entries;
+    size_t size;
+    size_t count;
+};
+
+static size_t _map_index(const Map * map, const void * key);
+static int _map_grow(Map * map);
+
+static size_t _map_index(const Map * map, const void * key)
+{
+    unsigned long long hash = ((unsigned long long) key >> 4) * 0x9E3779B97F4A7C15ULL;
+    size_t index = (size_t) (hash >> 32) & (map->size - 1);
+
+    while (map->entries[index].key && map->entries[index].key != key)
+        index = (index + 1) & (map->size - 1);
+
+    return index;
+}
+
+static int _map_grow(Map * map)
+{
+    Entry * old = map->entries;
+    size_t old_size = map->size;
+
+    map->entries = (Entry*) calloc(old_size * 2, sizeof(Entry));
+    if (!map->entries)
+    {
+        map->entries = old;
+        return ALLOCATE_MEMORY_ERROR;
+    }
+    map->size = old_size * 2;
+
+    for (size_t i = 0; i < old_size; i++)
+        if (old[i].key) map->entries[_map_index(map, old[i].key)] = old[i];
+
+    free(old);
+    return SUCCESS;
+}
+
+Map * CreateMap(size_t size)
+{
+    Map * map = (Map*) calloc(1, sizeof(Map));
+    if (!map) return NULL;
+
+    map->size = 16;
+    while (map->size < size * 2) map->size *= 2;
+
+    map->entries = (Entry*) calloc(map->size, sizeof(Entry));
+    if (!map->entries)
+    {
+        free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+void * MapFind(const Map * map, const void * key)
+{
+    if (!map || !key) return NULL;
+    return map->entries[_map_index(map, key)].value;
+}
+
+int MapInsert(Map * map, void * key, void * value)
+{
+    if (!map || !key) return ALLOCATE_MEMORY_ERROR;
+
+    if (2 * (map->count + 1) > map->size && _map_grow(map)) return ALLOCATE_MEMORY_ERROR;
+
+    Entry * entry = &map->entries[_map_index(map, key)];
+    if (!entry->key) map->count++;
+
+    entry->key = key;
+    entry->value = value;
+    return SUCCESS;
+}
+
+size_t MapCount(const Map * map)
+{
+    if (!map) return 0;
+    return map->count;
+}
+
+void MapWalk(Map * map, MapCb cb)
+{
+    if (!map || !cb) return;
+
+    for (size_t i = 0; i < map->size; i++)
+        if (map->entries[i].key) cb(map->entries[i].key, map->entries[i].value);
+}
+
+void DestroyMap(Map * map)
+{
+    if (!map) return;
+
+    free(map->entries);
+    free(map);
+}
@@ -0,0 +1,22 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include <stddef.h>
+
+typedef struct _map Map;
+
+typedef void (*MapCb) (void * key, void * value);
+
+Map * CreateMap(size_t size);
+
+void * MapFind(const Map * map, const void * key);
+
+int MapInsert(Map * map, void * key, void * value);
+
+size_t MapCount(const Map * map);
+
+void MapWalk(Map * map, MapCb cb);
+
+void DestroyMap(Map * map);
+
+#endif
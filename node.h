@@ -0,0 +1,68 @@
+#ifndef NODE_H
+#define NODE_H
+
+#include <pthread.h>
+
+#include "diff.h"
+#include "arena.h"
+
+// Nodes built by the parser and the Diff* rules are immutable and shared:
+// a copy is a new reference, the node is released with the last one.
+// Structurally equal nodes are the same node (see Table).
+typedef struct _node
+{
+    void * value;
+    struct _node * left;
+    struct _node * right;
+    unsigned int refs;
+    unsigned int hash;
+    struct _node * next;        // chain of the unique table bucket
+    struct _node * diffed;      // memoized derivative
+
+} Node;
+
+// unique table: every node of an arena is interned by its field and children
+typedef struct _table
+{
+    Node ** buckets;
+    size_t size;
+    size_t count;
+    int var;                    // variable the memoized derivatives are taken by
+    pthread_mutex_t * locks;    // bucket stripes while the table is shared by threads
+
+} Table;
+
+const size_t TABLE_SIZE = 64;
+const size_t TABLE_LOCKS = 256;
+const size_t TABLE_FORK_GROWTH = 4;     // buckets per node a table gets before a fork
+
+struct _tree
+{
+    Node * root;
+    TreeInit init;
+    TreeCmp cmp;
+    TreeFree free;
+    Arena * arena;      // storage of every Node and Field of the tree
+    Table * table;      // lives in the arena, shared the same way
+    size_t owned;       // values created by init, they still need free
+    uint64_t hash;      // of TreeHash, good while hashed is set
+    int hashed;         // cleared by everything that changes root
+    int canonical;      // root is of TreeCanonical, cleared with hashed
+};
+
+Node * _create_node(Field * val, Node * left, Node * right);
+Field * _create_field(field_t val, enum types type, Diff diff);
+Node * _copy_branch(Node * node);
+void _release_node(Node * node);
+
+field_t _node_count(Node * node, field_t val);
+field_t _apply_oper(int oper, field_t left, field_t right);
+field_t _apply_func(int func, field_t left, field_t right);
+
+field_t NodeValue(Node * node);
+enum types NodeType(Node * node);
+Diff NodeDiff(Node * node);
+
+const char * enum_to_name(int name);
+
+#endif
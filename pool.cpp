@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "diff.h"
+
+// tasks of a job not taken yet by one worker: [begin, end)
+typedef struct _deque
+{
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+
+} Deque;
+
+typedef struct _worker
+{
+    Pool * pool;
+    size_t id;
+
+} Worker;
+
+struct _pool
+{
+    pthread_t * threads;
+    Worker * workers;
+    Deque * deques;
+    size_t nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t generation;      // bumped for every job
+    size_t running;         // workers still in the current job
+    int stop;
+
+    PoolTask task;
+    void * arg;
+};
+
+static int _pool_next(Pool * pool, size_t id, size_t * index);
+static void * _pool_worker(void * arg);
+
+// A worker takes tasks from the front of its own range. When that is empty
+// it steals the back half of the range of another worker, so tasks are
+// handed out in runs and a slow expression does not hold up the others.
+static int _pool_next(Pool * pool, size_t id, size_t * index)
+{
+    Deque * own = &pool->deques[id];
+
+    pthread_mutex_lock(&own->lock);
+    int found = own->begin < own->end;
+    if (found) *index = own->begin++;
+    pthread_mutex_unlock(&own->lock);
+    if (found) return 1;
+
+    for (size_t step = 1; step < pool->nthreads; step++)
+    {
+        Deque * victim = &pool->deques[(id + step) % pool->nthreads];
+
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end - victim->begin;
+        size_t from = victim->end - (left + 1) / 2;
+        size_t to = victim->end;
+        if (left) victim->end = from;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (!left) continue;
+
+        pthread_mutex_lock(&own->lock);
+        own->begin = from + 1;
+        own->end = to;
+        pthread_mutex_unlock(&own->lock);
+
+        *index = from;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void * _pool_worker(void * arg)
+{
+    Worker * worker = (Worker*) arg;
+    Pool * pool = worker->pool;
+    size_t seen = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->stop) pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        size_t index = 0;
+        while (_pool_next(pool, worker->id, &index)) pool->task(pool->arg, index, worker->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// threads = 0 takes one per online CPU
+Pool * CreatePool(size_t threads)
+{
+    if (!threads)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t) cpus : 1;
+    }
+
+    Pool * pool = (Pool*) calloc(1, sizeof(Pool));
+    if (!pool) return NULL;
+
+    pool->threads = (pthread_t*) calloc(threads, sizeof(pthread_t));
+    pool->workers = (Worker*) calloc(threads, sizeof(Worker));
+    pool->deques = (Deque*) calloc(threads, sizeof(Deque));
+    if (!pool->threads || !pool->workers || !pool->deques)
+    {
+        free(pool->threads);
+        free(pool->workers);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (size_t i = 0; i < threads; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i] = (Worker) {pool, i};
+    }
+
+    for (size_t i = 0; i < threads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, _pool_worker, &pool->workers[i])) break;
+        pool->nthreads++;
+    }
+
+    if (!pool->nthreads)
+    {
+        DestroyPool(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+size_t PoolThreads(const Pool * pool)
+{
+    if (!pool) return 0;
+    return pool->nthreads;
+}
+
+// Runs task for every index below count and returns when all are done.
+int PoolRun(Pool * pool, size_t count, PoolTask task, void * arg)
+{
+    if (!pool || !task) return INVALID_ARGUMENT;
+    if (!count) return SUCCESS;
+
+    // every worker starts with an equal slice, stealing evens out the rest
+    size_t n = pool->nthreads;
+    for (size_t i = 0; i < n; i++)
+    {
+        pool->deques[i].begin = count * i / n;
+        pool->deques[i].end = count * (i + 1) / n;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->running = n;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+
+    while (pool->running) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    return SUCCESS;
+}
+
+void DestroyPool(Pool * pool)
+{
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->nthreads; i++) pthread_join(pool->threads[i], NULL);
+
+    for (size_t i = 0; i < pool->nthreads; i++) pthread_mutex_destroy(&pool->deques[i].lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->deques);
+    free(pool);
+}
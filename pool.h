@@ -0,0 +1,19 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+typedef struct _pool Pool;
+
+// runs task index of a job on the worker with id worker
+typedef void (*PoolTask) (void * arg, size_t index, size_t worker);
+
+Pool * CreatePool(size_t threads);
+
+size_t PoolThreads(const Pool * pool);
+
+int PoolRun(Pool * pool, size_t count, PoolTask task, void * arg);
+
+void DestroyPool(Pool * pool);
+
+#endif
@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "render.h"
+#include "diff.h"
+#include "trace.h"
+
+typedef struct _render_job
+{
+    struct _render_job * next;
+    char * filename;
+    char * stem;            // of the .pdf, one pdflatex per stem at a time
+    int running;
+
+} RenderJob;
+
+struct _render
+{
+    pthread_t * threads;
+    size_t nthreads;
+    char * directory;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // a job can be taken or the render stops
+    pthread_cond_t idle;    // the queue is empty
+    RenderJob * head;
+    RenderJob * tail;
+    int stop;
+
+    RenderStats stats;
+};
+
+static Render * Shared = NULL;
+static pthread_once_t SharedOnce = PTHREAD_ONCE_INIT;
+
+static char * _render_stem(const char * filename);
+static RenderJob * _render_take(Render * render);
+static void _render_drop(Render * render, RenderJob * job);
+static unsigned long long _file_snapshot(const char * filename, const char * copy_name, int * error);
+static int _render_cached(const char * hash_name, const char * pdf_name, unsigned long long hash);
+static int _render_file(Render * render, RenderJob * job, int * cached);
+static void * _render_worker(void * arg);
+static void _shared_create(void);
+static void _shared_destroy(void);
+
+// "dir/name.tex" -> "name", as pdflatex names its output
+static char * _render_stem(const char * filename)
+{
+    const char * slash = strrchr(filename, '/');
+    const char * base = slash ? slash + 1 : filename;
+
+    size_t length = strlen(base);
+    if (length > 4 && !strcmp(base + length - 4, ".tex")) length -= 4;
+
+    return strndup(base, length);
+}
+
+// the first job queued that is not compiled yet and whose stem is free,
+// the caller holds the lock
+static RenderJob * _render_take(Render * render)
+{
+    for (RenderJob * job = render->head; job; job = job->next)
+    {
+        if (job->running) continue;
+
+        int busy = 0;
+        for (RenderJob * other = render->head; other && !busy; other = other->next)
+            busy = other->running && !strcmp(other->stem, job->stem);
+
+        if (!busy) return job;
+    }
+
+    return NULL;
+}
+
+// the caller holds the lock
+static void _render_drop(Render * render, RenderJob * job)
+{
+    RenderJob ** link = &render->head;
+    while (*link != job) link = &(*link)->next;
+
+    *link = job->next;
+    if (render->tail == job)
+    {
+        render->tail = NULL;
+        for (RenderJob * last = render->head; last; last = last->next) render->tail = last;
+    }
+
+    free(job->filename);
+    free(job->stem);
+    free(job);
+}
+
+// Copies filename to copy_name and returns FNV-1a of the bytes copied, so
+// the hash is of what pdflatex compiles even if filename is replaced.
+static unsigned long long _file_snapshot(const char * filename, const char * copy_name, int * error)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+
+    FILE * file = fopen(filename, "rb");
+    FILE * copy = file ? fopen(copy_name, "wb") : NULL;
+    if (!copy)
+    {
+        if (file) fclose(file);
+        *error = FOPEN_ERROR;
+        return hash;
+    }
+
+    char chunk[BUFSIZ] = "";
+    size_t size = 0;
+    while ((size = fread(chunk, 1, sizeof(chunk), file)))
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= (unsigned char) chunk[i];
+            hash *= 1099511628211ULL;
+        }
+        if (fwrite(chunk, 1, size, copy) != size) *error = FOPEN_ERROR;
+    }
+
+    if (ferror(file)) *error = FOPEN_ERROR;
+    if (fclose(file) && !*error) *error = FCLOSE_ERROR;
+    if (fclose(copy) && !*error) *error = FCLOSE_ERROR;
+    return hash;
+}
+
+// the .pdf is there and was compiled from a .tex with this hash
+static int _render_cached(const char * hash_name, const char * pdf_name, unsigned long long hash)
+{
+    if (access(pdf_name, F_OK)) return 0;
+
+    FILE * file = fopen(hash_name, "rb");
+    if (!file) return 0;
+
+    unsigned long long last = 0;
+    int found = fscanf(file, "%llx", &last) == 1;
+    fclose(file);
+
+    return found && last == hash;
+}
+
+// pdflatex compiles a copy of the .tex made when the job is taken, named
+// as the stem by -jobname, and the hash is of that copy: a document dumped
+// again meanwhile is compiled by the next job. The hash is written only
+// after pdflatex succeeded, under a name of this process first, so a
+// concurrent run never reads half of it.
+static int _render_file(Render * render, RenderJob * job, int * cached)
+{
+    char hash_name[DEF_SIZE] = "";
+    char pdf_name[DEF_SIZE] = "";
+    char copy_name[DEF_SIZE + 64] = "";
+    char tmp_name[DEF_SIZE + 32] = "";
+    char command[4 * DEF_SIZE] = "";
+
+    snprintf(hash_name, sizeof(hash_name), "%s/%s.hash", render->directory, job->stem);
+    snprintf(pdf_name, sizeof(pdf_name), "%s/%s.pdf", render->directory, job->stem);
+    snprintf(copy_name, sizeof(copy_name), "%s/%s.%ld.%llx.tex", render->directory, job->stem,
+             (long) getpid(), (unsigned long long) pthread_self());
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", hash_name, (long) getpid());
+
+    int error = SUCCESS;
+    unsigned long long hash = _file_snapshot(job->filename, copy_name, &error);
+
+    *cached = !error && _render_cached(hash_name, pdf_name, hash);
+    if (error || *cached)
+    {
+        if (*cached) TRACE_DUMP(TRACE_INFO, "%s is up to date", pdf_name);
+        remove(copy_name);
+        return error;
+    }
+
+    snprintf(command, sizeof(command),
+             "pdflatex -interaction=batchmode -jobname='%s' --output-directory='%s' '%s' >/dev/null",
+             job->stem, render->directory, copy_name);
+
+    TRACE_DUMP(TRACE_INFO, "%s", command);
+    error = system(command) ? FOPEN_ERROR : SUCCESS;
+    remove(copy_name);
+    if (error) return error;
+
+    FILE * file = fopen(tmp_name, "wb");
+    if (!file) return FOPEN_ERROR;
+    fprintf(file, "%llx\n", hash);
+    if (fclose(file) || rename(tmp_name, hash_name))
+    {
+        remove(tmp_name);
+        return FCLOSE_ERROR;
+    }
+
+    return SUCCESS;
+}
+
+// takes the jobs until the render stops and nothing is queued
+static void * _render_worker(void * arg)
+{
+    Render * render = (Render*) arg;
+
+    pthread_mutex_lock(&render->lock);
+    for (;;)
+    {
+        RenderJob * job = _render_take(render);
+        if (!job)
+        {
+            if (render->stop && !render->head) break;
+            pthread_cond_wait(&render->ready, &render->lock);
+            continue;
+        }
+
+        job->running = 1;
+        pthread_mutex_unlock(&render->lock);
+
+        int cached = 0;
+        int error = _render_file(render, job, &cached);
+        if (error) TRACE_DUMP(TRACE_ERROR, "%s is not compiled: %d", job->filename, error);
+
+        pthread_mutex_lock(&render->lock);
+        if (error) render->stats.failed++;
+        else if (cached) render->stats.cached++;
+        else render->stats.compiled++;
+
+        _render_drop(render, job);
+
+        // a job of the same stem may be free now
+        pthread_cond_broadcast(&render->ready);
+        if (!render->head) pthread_cond_broadcast(&render->idle);
+    }
+    pthread_mutex_unlock(&render->lock);
+
+    return NULL;
+}
+
+// jobs = 0 takes RENDER_JOBS, directory = NULL takes RENDER_DIR
+Render * CreateRender(size_t jobs, const char * directory)
+{
+    if (!jobs) jobs = RENDER_JOBS;
+    if (!directory) directory = RENDER_DIR;
+
+    if (mkdir(directory, 0755) && errno != EEXIST) return NULL;
+
+    Render * render = (Render*) calloc(1, sizeof(Render));
+    if (!render) return NULL;
+
+    render->threads = (pthread_t*) calloc(jobs, sizeof(pthread_t));
+    render->directory = strdup(directory);
+    if (!render->threads || !render->directory)
+    {
+        free(render->threads);
+        free(render->directory);
+        free(render);
+        return NULL;
+    }
+
+    pthread_mutex_init(&render->lock, NULL);
+    pthread_cond_init(&render->ready, NULL);
+    pthread_cond_init(&render->idle, NULL);
+
+    for (size_t i = 0; i < jobs; i++)
+    {
+        if (pthread_create(&render->threads[i], NULL, _render_worker, render)) break;
+        render->nthreads++;
+    }
+
+    if (!render->nthreads)
+    {
+        DestroyRender(render);
+        return NULL;
+    }
+
+    return render;
+}
+
+// Queues filename and returns at once. A document already waiting is not
+// queued twice, the worker reads the .tex when it takes the job.
+int RenderSubmit(Render * render, const char * filename)
+{
+    if (!render || !filename) return INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&render->lock);
+
+    for (RenderJob * job = render->head; job; job = job->next)
+        if (!job->running && !strcmp(job->filename, filename))
+        {
+            pthread_mutex_unlock(&render->lock);
+            return SUCCESS;
+        }
+
+    RenderJob * job = (RenderJob*) calloc(1, sizeof(RenderJob));
+    if (job)
+    {
+        job->filename = strdup(filename);
+        job->stem = _render_stem(filename);
+    }
+
+    if (!job || !job->filename || !job->stem)
+    {
+        pthread_mutex_unlock(&render->lock);
+        if (job)
+        {
+            free(job->filename);
+            free(job->stem);
+        }
+        free(job);
+        return ALLOCATE_MEMORY_ERROR;
+    }
+
+    if (render->tail) render->tail->next = job;
+    else render->head = job;
+    render->tail = job;
+
+    pthread_cond_signal(&render->ready);
+    pthread_mutex_unlock(&render->lock);
+
+    TRACE_DUMP(TRACE_DEBUG, "%s queued", filename);
+    return SUCCESS;
+}
+
+// until every document queued so far is done, stats count them all
+int RenderWait(Render * render, RenderStats * stats)
+{
+    if (!render) return INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&render->lock);
+    while (render->head) pthread_cond_wait(&render->idle, &render->lock);
+    if (stats) *stats = render->stats;
+    pthread_mutex_unlock(&render->lock);
+
+    return SUCCESS;
+}
+
+// the documents still queued are compiled first
+void DestroyRender(Render * render)
+{
+    if (!render) return;
+
+    pthread_mutex_lock(&render->lock);
+    render->stop = 1;
+    pthread_cond_broadcast(&render->ready);
+    pthread_mutex_unlock(&render->lock);
+
+    for (size_t i = 0; i < render->nthreads; i++) pthread_join(render->threads[i], NULL);
+
+    pthread_mutex_destroy(&render->lock);
+    pthread_cond_destroy(&render->ready);
+    pthread_cond_destroy(&render->idle);
+
+    free(render->threads);
+    free(render->directory);
+    free(render);
+}
+
+static void _shared_create(void)
+{
+    Shared = CreateRender(RENDER_JOBS, RENDER_DIR);
+    if (Shared && atexit(_shared_destroy))
+    {
+        DestroyRender(Shared);
+        Shared = NULL;
+    }
+}
+
+static void _shared_destroy(void)
+{
+    DestroyRender(Shared);
+    Shared = NULL;
+}
+
+// The queue of TexDump, made on first use; the process waits for it at exit.
+Render * RenderShared(void)
+{
+    pthread_once(&SharedOnce, _shared_create);
+    return Shared;
+}
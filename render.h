@@ -0,0 +1,32 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+
+// pdflatex in the background: documents are queued by name and compiled by
+// at most jobs workers at once into directory. A document whose .tex has
+// the hash of its last compiled one is not compiled again.
+typedef struct _render Render;
+
+typedef struct _render_stats
+{
+    size_t compiled;
+    size_t cached;
+    size_t failed;
+
+} RenderStats;
+
+const char * const RENDER_DIR = "./tmp";
+const size_t RENDER_JOBS = 2;
+
+Render * CreateRender(size_t jobs, const char * directory);
+
+int RenderSubmit(Render * render, const char * filename);
+
+int RenderWait(Render * render, RenderStats * stats);
+
+void DestroyRender(Render * render);
+
+Render * RenderShared(void);
+
+#endif
@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "stack.h"
+
+// doubles the room, the items move from local to the heap the first time
+int StackGrow(Stack * stack)
+{
+    size_t cap = stack->cap * 2;
+    char * items = NULL;
+
+    if (stack->items == stack->local)
+    {
+        items = (char*) malloc(cap * stack->size);
+        if (items) memcpy(items, stack->local, stack->count * stack->size);
+    }
+    else items = (char*) realloc(stack->items, cap * stack->size);
+
+    if (!items) return -1;
+
+    stack->items = items;
+    stack->cap = cap;
+    return 0;
+}
+
+void InitStack(Stack * stack, size_t size)
+{
+    stack->items = stack->local;
+    stack->size = size;
+    stack->count = 0;
+    stack->cap = STACK_LOCAL / size;
+}
+
+size_t StackCount(const Stack * stack)
+{
+    return stack->count;
+}
+
+void DestroyStack(Stack * stack)
+{
+    if (stack->items != stack->local) free(stack->items);
+    InitStack(stack, stack->size);
+}
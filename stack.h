@@ -0,0 +1,58 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <stddef.h>
+
+const size_t STACK_LOCAL = 1024;
+
+// Frames of the traversals that would otherwise recurse on tree depth.
+// The first STACK_LOCAL bytes are inside the struct, so a shallow tree is
+// walked without malloc; items points into it, the struct is never copied.
+typedef struct _stack
+{
+    char * items;
+    size_t size;        // of one item
+    size_t count;
+    size_t cap;
+    char local[STACK_LOCAL];
+
+} Stack;
+
+void InitStack(Stack * stack, size_t size);
+
+int StackGrow(Stack * stack);
+
+size_t StackCount(const Stack * stack);
+
+void DestroyStack(Stack * stack);
+
+// push and pop are on the path of every node of a walk, so they are inline
+
+// the new item is uninitialized, pointers to items stay valid until the next push
+inline void * StackPush(Stack * stack)
+{
+    if (stack->count == stack->cap && StackGrow(stack)) return NULL;
+    return stack->items + stack->size * stack->count++;
+}
+
+inline void * StackTop(Stack * stack)
+{
+    if (!stack->count) return NULL;
+    return stack->items + stack->size * (stack->count - 1);
+}
+
+// a walk that reads the items as a queue keeps its own head
+inline void * StackAt(Stack * stack, size_t index)
+{
+    if (index >= stack->count) return NULL;
+    return stack->items + stack->size * index;
+}
+
+// the popped item can still be read until the next push
+inline void * StackPop(Stack * stack)
+{
+    if (!stack->count) return NULL;
+    return stack->items + stack->size * --stack->count;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "diff.h"
+#include "trace.h"
+
+typedef struct _trace_name
+{
+    const char * name;
+    unsigned int category;
+
+} TraceName;
+
+static const TraceName TraceNames[] =
+{
+    {"lex",      LEX_TRACE},
+    {"parse",    PARSE_TRACE},
+    {"diff",     DIFF_TRACE},
+    {"simplify", SIMPLIFY_TRACE},
+    {"dump",     DUMP_TRACE},
+    {"tree",     TREE_TRACE},
+    {"all",      ALL_TRACES},
+};
+
+unsigned int TraceMask = 0;
+int TraceLevel = 0;
+
+// Lines gather here and reach the sink TRACE_BUFFER bytes at a time,
+// threads of a pool append under the lock.
+static pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+static char TraceBuffer[TRACE_BUFFER];
+static size_t TraceUsed = 0;
+static FILE * TraceOut = NULL;
+
+static const char * _category_name(unsigned int category);
+static void _trace_flush(void);
+
+static const char * _category_name(unsigned int category)
+{
+    for (size_t i = 0; i < sizeof(TraceNames) / sizeof(TraceNames[0]); i++)
+        if (TraceNames[i].category == category) return TraceNames[i].name;
+
+    return "?";
+}
+
+// the caller holds TraceLock
+static void _trace_flush(void)
+{
+    if (!TraceUsed) return;
+
+    FILE * out = TraceOut ? TraceOut : stderr;
+    fwrite(TraceBuffer, 1, TraceUsed, out);
+    fflush(out);
+    TraceUsed = 0;
+}
+
+// what the categories compiled in (see TRACES) write from now on,
+// level 0 turns them off; the buffer is flushed at exit
+void TraceSetup(unsigned int categories, int level)
+{
+    static int registered = 0;
+
+    pthread_mutex_lock(&TraceLock);
+    if (!registered) registered = !atexit(TraceFlush);
+
+    TraceMask = categories & TRACES;
+    TraceLevel = level;
+    pthread_mutex_unlock(&TraceLock);
+}
+
+// "parse,diff:3": the names of the categories and an optional level,
+// TRACE_INFO if there is none
+int TraceSetupSpec(const char * spec)
+{
+    if (!spec) return INVALID_ARGUMENT;
+
+    unsigned int categories = 0;
+    int level = TRACE_INFO;
+
+    while (*spec)
+    {
+        size_t length = strcspn(spec, ",:");
+        size_t i = 0;
+        for (; i < sizeof(TraceNames) / sizeof(TraceNames[0]); i++)
+            if (strlen(TraceNames[i].name) == length && !strncmp(TraceNames[i].name, spec, length)) break;
+
+        if (i == sizeof(TraceNames) / sizeof(TraceNames[0])) return INVALID_ARGUMENT;
+        categories |= TraceNames[i].category;
+
+        spec += length;
+        if (*spec == ':')
+        {
+            char * end = NULL;
+            level = (int) strtol(spec + 1, &end, 10);
+            if (end == spec + 1 || *end) return INVALID_ARGUMENT;
+            break;
+        }
+
+        if (*spec == ',') spec++;
+    }
+
+    TraceSetup(categories, level);
+    return SUCCESS;
+}
+
+// stderr by default, what is buffered goes to the old sink first
+void TraceSink(FILE * out)
+{
+    pthread_mutex_lock(&TraceLock);
+    _trace_flush();
+    TraceOut = out;
+    pthread_mutex_unlock(&TraceLock);
+}
+
+// one line "[category] func:line: message", cut to TRACE_BUFFER bytes
+void TraceWrite(unsigned int category, const char * func, int line, const char * format, ...)
+{
+    pthread_mutex_lock(&TraceLock);
+
+    for (int retry = 0; retry < 2; retry++)
+    {
+        char * at = TraceBuffer + TraceUsed;
+        size_t room = TRACE_BUFFER - TraceUsed;
+
+        int head = snprintf(at, room, "[%s] %s:%d: ", _category_name(category), func, line);
+        int body = 0;
+        if (head >= 0 && (size_t) head < room)
+        {
+            va_list args;
+            va_start(args, format);
+            body = vsnprintf(at + head, room - (size_t) head, format, args);
+            va_end(args);
+        }
+
+        size_t length = (size_t) head + (size_t) (body > 0 ? body : 0) + 1;
+        if (head >= 0 && length < room)
+        {
+            at[length - 1] = '\n';
+            TraceUsed += length;
+            break;
+        }
+
+        // a line longer than the whole buffer is cut
+        if (!TraceUsed || retry)
+        {
+            TraceBuffer[TRACE_BUFFER - 1] = '\n';
+            TraceUsed = TRACE_BUFFER;
+            break;
+        }
+
+        _trace_flush();
+    }
+
+    if (TraceUsed == TRACE_BUFFER) _trace_flush();
+    pthread_mutex_unlock(&TraceLock);
+}
+
+void TraceFlush(void)
+{
+    pthread_mutex_lock(&TraceLock);
+    _trace_flush();
+    pthread_mutex_unlock(&TraceLock);
+}
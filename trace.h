@@ -0,0 +1,92 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+// Trace categories, the ones not in TRACES are compiled out:
+// g++ -D TRACES=0x06 -D TRACE_LEVEL=2 keeps the parse and diff lines
+// up to TRACE_INFO. Debug builds get every category, NDEBUG ones none.
+#define LEX_TRACE       0x01
+#define PARSE_TRACE     0x02
+#define DIFF_TRACE      0x04
+#define SIMPLIFY_TRACE  0x08
+#define DUMP_TRACE      0x10
+#define TREE_TRACE      0x20    // node copies and releases
+#define ALL_TRACES      0x3f
+
+#define TRACE_ERROR     1
+#define TRACE_INFO      2       // once per tree or pass
+#define TRACE_DEBUG     3       // once per node or token
+
+#ifndef TRACES
+#ifdef NDEBUG
+#define TRACES 0
+#else
+#define TRACES ALL_TRACES
+#endif
+#endif
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_DEBUG
+#endif
+
+// what is traced at run time, nothing until TraceSetup
+extern unsigned int TraceMask;
+extern int TraceLevel;
+
+const size_t TRACE_BUFFER = 64 * 1024;
+
+void TraceSetup(unsigned int categories, int level);
+
+int TraceSetupSpec(const char * spec);
+
+void TraceSink(FILE * out);
+
+void TraceWrite(unsigned int category, const char * func, int line, const char * format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+void TraceFlush(void);
+
+#define _TRACE(category, level, ...)                                            \
+    {                                                                            \
+    if ((level) <= TRACE_LEVEL && (TraceMask & (category)) && (level) <= TraceLevel) \
+        TraceWrite(category, __func__, __LINE__, __VA_ARGS__);                   \
+    }
+
+#if TRACES & LEX_TRACE
+#define TRACE_LEX(level, ...) _TRACE(LEX_TRACE, level, __VA_ARGS__)
+#else
+#define TRACE_LEX(...)
+#endif
+
+#if TRACES & PARSE_TRACE
+#define TRACE_PARSE(level, ...) _TRACE(PARSE_TRACE, level, __VA_ARGS__)
+#else
+#define TRACE_PARSE(...)
+#endif
+
+#if TRACES & DIFF_TRACE
+#define TRACE_DIFF(level, ...) _TRACE(DIFF_TRACE, level, __VA_ARGS__)
+#else
+#define TRACE_DIFF(...)
+#endif
+
+#if TRACES & SIMPLIFY_TRACE
+#define TRACE_SIMPLIFY(level, ...) _TRACE(SIMPLIFY_TRACE, level, __VA_ARGS__)
+#else
+#define TRACE_SIMPLIFY(...)
+#endif
+
+#if TRACES & DUMP_TRACE
+#define TRACE_DUMP(level, ...) _TRACE(DUMP_TRACE, level, __VA_ARGS__)
+#else
+#define TRACE_DUMP(...)
+#endif
+
+#if TRACES & TREE_TRACE
+#define TRACE_TREE(level, ...) _TRACE(TREE_TRACE, level, __VA_ARGS__)
+#else
+#define TRACE_TREE(...)
+#endif
+
+#endif
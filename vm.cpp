@@ -0,0 +1,907 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <immintrin.h>
+
+#include "vm.h"
+#include "node.h"
+#include "map.h"
+
+enum opcodes
+{
+    VM_ADD,
+    VM_SUB,
+    VM_MUL,
+    VM_DIV,
+    VM_POW,
+    VM_SIN,
+    VM_COS,
+    VM_TG,
+    VM_CTG,
+    VM_SH,
+    VM_CH,
+    VM_TH,
+    VM_CTH,
+    VM_LN,
+    VM_LOG,
+    VM_EX,
+    VM_ARCSIN,
+    VM_ARCCOS,
+    VM_ARCTG,
+    VM_ARCCTG,
+    VM_ERROR
+};
+
+typedef struct _instr
+{
+    unsigned int op;
+    unsigned int left;
+    unsigned int right;
+
+} Instr;
+
+// Registers are laid out as the constant pool, then the variables, then one
+// register per instruction: instruction i writes register base + i.
+struct _program
+{
+    Instr * code;
+    size_t size;
+    field_t * regs;
+    Dual * duals;           // register file of ProgramEvalDual
+    field_t * adjoints;     // one per register for ProgramGradient
+    size_t consts;
+    int * vars;             // variable name of every slot
+    size_t nvars;
+    unsigned int result;
+};
+
+// while compiling an operand is tagged with the pool it points into,
+// the pools get their final place in the register file at the end
+const unsigned int OPERAND_CONST    = 0U << 30;
+const unsigned int OPERAND_VAR      = 1U << 30;
+const unsigned int OPERAND_REG      = 2U << 30;
+const unsigned int OPERAND_MASK     = 3U << 30;
+
+typedef struct _compiler
+{
+    Instr * code;
+    size_t size;
+    size_t code_cap;
+    field_t * consts;
+    size_t nconsts;
+    size_t consts_cap;
+    int * vars;
+    size_t nvars;
+    size_t vars_cap;
+    Map * done;             // node -> operand + 1, every unique node is compiled once
+    int error;
+
+} Compiler;
+
+static int _vm_equal(field_t value, field_t expected);
+static field_t _vm_op(unsigned int op, field_t left, field_t right);
+static Dual _dual_op(unsigned int op, Dual left, Dual right);
+static unsigned int _oper_opcode(int oper);
+static unsigned int _func_opcode(int func);
+static int _grow(void ** array, size_t * cap, size_t need, size_t elem);
+static unsigned int _push_const(Compiler * c, field_t value);
+static unsigned int _push_var(Compiler * c, int name);
+static unsigned int _push_instr(Compiler * c, unsigned int op, unsigned int left, unsigned int right);
+static unsigned int _compile_node(Compiler * c, Node * node);
+static unsigned int _resolve(const Compiler * c, unsigned int operand);
+
+// batch evaluation runs every instruction over a block of lanes at once
+const size_t BATCH_LANES        = 64;
+const size_t BATCH_MEMORY       = 16 * 1024 * 1024;
+
+typedef size_t (*ArithKernel) (unsigned int op, field_t * dst, const field_t * left, const field_t * right, size_t lanes);
+
+static size_t _arith_scalar(unsigned int op, field_t * dst, const field_t * left, const field_t * right, size_t lanes);
+static size_t _arith_avx2(unsigned int op, field_t * dst, const field_t * left, const field_t * right, size_t lanes);
+static size_t _arith_avx512(unsigned int op, field_t * dst, const field_t * left, const field_t * right, size_t lanes);
+static ArithKernel _arith_select(void);
+static ArithKernel _arith_kernel(void);
+static void _scalar_lanes(unsigned int op, field_t * dst, const field_t * left, const field_t * right, size_t from, size_t count);
+static void _eval_block(const Program * program, field_t * lanes, size_t width, size_t count, ArithKernel arith);
+
+// A jet holds the first n Taylor coefficients of a value, every opcode maps
+// the jets of its operands to the jet of its result in O(n^2).
+const size_t JET_SCRATCH        = 2;
+const int    JET_MAX_INT_POW    = 64;
+
+static void _jet_mul(field_t * dst, const field_t * a, const field_t * b, size_t n);
+static void _jet_div(field_t * dst, const field_t * a, const field_t * b, size_t n);
+static void _jet_exp(field_t * dst, const field_t * a, size_t n);
+static void _jet_log(field_t * dst, const field_t * a, size_t n);
+static void _jet_sqrt(field_t * dst, const field_t * a, size_t n);
+static void _jet_sincos(field_t * s, field_t * c, const field_t * a, size_t n, int hyperbolic);
+static void _jet_solve(field_t * dst, const field_t * a, const field_t * q, field_t value, size_t n);
+static void _jet_pow(field_t * dst, const field_t * a, const field_t * b, size_t n, field_t * scratch);
+static void _jet_op(unsigned int op, field_t * dst, const field_t * a, const field_t * b, size_t n, field_t * scratch);
+
+// not NaN and not another value, without comparing floats for equality
+static int _vm_equal(field_t value, field_t expected)
+{
+    return value >= expected && value <= expected;
+}
+
+static field_t _vm_op(unsigned int op, field_t left, field_t right)
+{
+    switch (op)
+    {
+        case VM_ADD:    return left + right;
+        case VM_SUB:    return left - right;
+        case VM_MUL:    return left * right;
+        case VM_DIV:    return left / right;
+        case VM_POW:    return pow(left, right);
+        case VM_SIN:    return sin(left);
+        case VM_COS:    return cos(left);
+        case VM_TG:     return tan(left);
+        case VM_CTG:    return 1 / tan(left);
+        case VM_SH:     return sinh(left);
+        case VM_CH:     return cosh(left);
+        case VM_TH:     return tanh(left);
+        case VM_CTH:    return 1 / tanh(left);
+        case VM_LN:     return log(left);
+        case VM_LOG:    return log10(left);
+        case VM_EX:     return exp(left);
+        case VM_ARCSIN: return asin(left);
+        case VM_ARCCOS: return acos(left);
+        case VM_ARCTG:  return atan(left);
+        case VM_ARCCTG: return M_PI_2 - atan(left);
+        default:        return NAN;
+    }
+}
+
+// Derivative rules of every opcode, the same ones the Diff* functions build
+// as trees. Powers use the rule of DiffPOW for the base and the one of
+// DiffAX for the exponent, so a constant side adds nothing and x^n with
+// x < 0 does not take the log of a negative number.
+static Dual _dual_op(unsigned int op, Dual left, Dual right)
+{
+    field_t value = _vm_op(op, left.value, right.value);
+    field_t u = left.value;
+    field_t du = left.diff;
+
+    switch (op)
+    {
+        case VM_ADD:    return (Dual) {value, du + right.diff};
+        case VM_SUB:    return (Dual) {value, du - right.diff};
+        case VM_MUL:    return (Dual) {value, du * right.value + u * right.diff};
+        case VM_DIV:    return (Dual) {value, (du * right.value - u * right.diff) / (right.value * right.value)};
+        case VM_POW:
+        {
+            field_t diff = 0;
+            if (!_vm_equal(du, 0))          diff += right.value * pow(u, right.value - 1) * du;
+            if (!_vm_equal(right.diff, 0))  diff += value * log(u) * right.diff;
+            return (Dual) {value, diff};
+        }
+        case VM_SIN:    return (Dual) {value, cos(u) * du};
+        case VM_COS:    return (Dual) {value, -sin(u) * du};
+        case VM_TG:     return (Dual) {value, du / (cos(u) * cos(u))};
+        case VM_CTG:    return (Dual) {value, -du / (sin(u) * sin(u))};
+        case VM_SH:     return (Dual) {value, cosh(u) * du};
+        case VM_CH:     return (Dual) {value, sinh(u) * du};
+        case VM_TH:     return (Dual) {value, du / (cosh(u) * cosh(u))};
+        case VM_CTH:    return (Dual) {value, -du / (sinh(u) * sinh(u))};
+        case VM_LN:     return (Dual) {value, du / u};
+        case VM_LOG:    return (Dual) {value, du / (u * M_LN10)};
+        case VM_EX:     return (Dual) {value, value * du};
+        case VM_ARCSIN: return (Dual) {value, du / sqrt(1 - u * u)};
+        case VM_ARCCOS: return (Dual) {value, -du / sqrt(1 - u * u)};
+        case VM_ARCTG:  return (Dual) {value, du / (1 + u * u)};
+        case VM_ARCCTG: return (Dual) {value, -du / (1 + u * u)};
+        default:        return (Dual) {NAN, NAN};
+    }
+}
+
+static unsigned int _oper_opcode(int oper)
+{
+    switch (oper)
+    {
+        case ADD:   return VM_ADD;
+        case SUB:   return VM_SUB;
+        case MUL:   return VM_MUL;
+        case DIV:   return VM_DIV;
+        case POW:   return VM_POW;
+        default:    return VM_ERROR;
+    }
+}
+
+static unsigned int _func_opcode(int func)
+{
+    switch (func)
+    {
+        case SIN:       return VM_SIN;
+        case COS:       return VM_COS;
+        case TG:        return VM_TG;
+        case CTG:       return VM_CTG;
+        case SH:        return VM_SH;
+        case CH:        return VM_CH;
+        case TH:        return VM_TH;
+        case CTH:       return VM_CTH;
+        case LN:        return VM_LN;
+        case LOG:       return VM_LOG;
+        case AX:        return VM_POW;
+        case EX:        return VM_EX;
+        case ARCSIN:    return VM_ARCSIN;
+        case ARCCOS:    return VM_ARCCOS;
+        case ARCTG:     return VM_ARCTG;
+        case ARCCTG:    return VM_ARCCTG;
+        default:        return VM_ERROR;
+    }
+}
+
+field_t _apply_oper(int oper, field_t left, field_t right)
+{
+    return _vm_op(_oper_opcode(oper), left, right);
+}
+
+field_t _apply_func(int func, field_t left, field_t right)
+{
+    return _vm_op(_func_opcode(func), left, right);
+}
+
+static int _grow(void ** array, size_t * cap, size_t need, size_t elem)
+{
+    if (need <= *cap) return SUCCESS;
+
+    size_t new_cap = *cap ? *cap * 2 : 16;
+    while (new_cap < need) new_cap *= 2;
+
+    void * grown = realloc(*array, new_cap * elem);
+    if (!grown) return ALLOCATE_MEMORY_ERROR;
+
+    *array = grown;
+    *cap = new_cap;
+    return SUCCESS;
+}
+
+static unsigned int _push_const(Compiler * c, field_t value)
+{
+    if (_grow((void**) &c->consts, &c->consts_cap, c->nconsts + 1, sizeof(field_t)))
+    {
+        c->error = ALLOCATE_MEMORY_ERROR;
+        return 0;
+    }
+
+    c->consts[c->nconsts] = value;
+    return OPERAND_CONST | (unsigned int) c->nconsts++;
+}
+
+static unsigned int _push_var(Compiler * c, int name)
+{
+    for (size_t i = 0; i < c->nvars; i++)
+        if (c->vars[i] == name) return OPERAND_VAR | (unsigned int) i;
+
+    if (_grow((void**) &c->vars, &c->vars_cap, c->nvars + 1, sizeof(int)))
+    {
+        c->error = ALLOCATE_MEMORY_ERROR;
+        return 0;
+    }
+
+    c->vars[c->nvars] = name;
+    return OPERAND_VAR | (unsigned int) c->nvars++;
+}
+
+static unsigned int _push_instr(Compiler * c, unsigned int op, unsigned int left, unsigned int right)
+{
+    if (op == VM_ERROR) c->error = UNKNOWN_NODE;
+
+    if (_grow((void**) &c->code, &c->code_cap, c->size + 1, sizeof(Instr)))
+    {
+        c->error = ALLOCATE_MEMORY_ERROR;
+        return 0;
+    }
+
+    c->code[c->size] = (Instr) {op, left, right};
+    return OPERAND_REG | (unsigned int) c->size++;
+}
+
+// post-order, so the operands of an instruction are always computed before it
+static unsigned int _compile_node(Compiler * c, Node * node)
+{
+    if (!node)
+    {
+        c->error = UNKNOWN_NODE;
+        return 0;
+    }
+
+    void * known = MapFind(c->done, node);
+    if (known) return (unsigned int) ((size_t) known - 1);
+
+    unsigned int operand = 0;
+    field_t value = NodeValue(node);
+
+    switch (NodeType(node))
+    {
+        case NUM:
+            operand = _push_const(c, value);
+            break;
+
+        // e only appears as the constant made by DiffHARDPOW
+        case VAR:
+            operand = (int) value == EX ? _push_const(c, M_E) : _push_var(c, (int) value);
+            break;
+
+        case OPER:
+        {
+            unsigned int left = _compile_node(c, node->left);
+            unsigned int right = _compile_node(c, node->right);
+            operand = _push_instr(c, _oper_opcode((int) value), left, right);
+            break;
+        }
+
+        case FUNC:
+        {
+            unsigned int left = _compile_node(c, node->left);
+            unsigned int right = node->right ? _compile_node(c, node->right) : left;
+            operand = _push_instr(c, _func_opcode((int) value), left, right);
+            break;
+        }
+
+        case ERROR:
+        default:
+            c->error = UNKNOWN_NODE;
+            return 0;
+    }
+
+    if (MapInsert(c->done, node, (void*) ((size_t) operand + 1))) c->error = ALLOCATE_MEMORY_ERROR;
+    return operand;
+}
+
+static unsigned int _resolve(const Compiler * c, unsigned int operand)
+{
+    unsigned int index = operand & ~OPERAND_MASK;
+
+    switch (operand & OPERAND_MASK)
+    {
+        case OPERAND_VAR:   return (unsigned int) c->nconsts + index;
+        case OPERAND_REG:   return (unsigned int) (c->nconsts + c->nvars) + index;
+        default:            return index;
+    }
+}
+
+Program * CompileTree(Tree * tree)
+{
+    if (!tree || !tree->root) return NULL;
+
+    Compiler c = {};
+    c.done = CreateMap(0);
+    if (!c.done) return NULL;
+
+    unsigned int result = _compile_node(&c, tree->root);
+    DestroyMap(c.done);
+
+    Program * program = (Program*) calloc(1, sizeof(Program));
+    size_t nregs = c.nconsts + c.nvars + c.size;
+    field_t * regs = (field_t*) calloc(nregs ? nregs : 1, sizeof(field_t));
+    Dual * duals = (Dual*) calloc(nregs ? nregs : 1, sizeof(Dual));
+    field_t * adjoints = (field_t*) calloc(nregs ? nregs : 1, sizeof(field_t));
+
+    if (c.error || !program || !regs || !duals || !adjoints)
+    {
+        free(c.code);
+        free(c.consts);
+        free(c.vars);
+        free(program);
+        free(regs);
+        free(duals);
+        free(adjoints);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < c.size; i++)
+    {
+        c.code[i].left = _resolve(&c, c.code[i].left);
+        c.code[i].right = _resolve(&c, c.code[i].right);
+    }
+
+    // the constant pool is loaded once, nothing writes over it
+    if (c.nconsts) memcpy(regs, c.consts, c.nconsts * sizeof(field_t));
+    for (size_t i = 0; i < c.nconsts; i++) duals[i] = (Dual) {c.consts[i], 0};
+    free(c.consts);
+
+    *program = (Program) {c.code, c.size, regs, duals, adjoints, c.nconsts, c.vars, c.nvars, _resolve(&c, result)};
+    return program;
+}
+
+size_t ProgramVars(const Program * program)
+{
+    if (!program) return 0;
+    return program->nvars;
+}
+
+int ProgramVar(const Program * program, int name)
+{
+    if (!program) return -1;
+
+    for (size_t i = 0; i < program->nvars; i++)
+        if (program->vars[i] == name) return (int) i;
+
+    return -1;
+}
+
+// vars holds the value of every variable slot, see ProgramVar
+field_t ProgramEval(Program * program, const field_t * vars)
+{
+    if (!program) return NAN;
+
+    field_t * regs = program->regs;
+    if (program->nvars) memcpy(regs + program->consts, vars, program->nvars * sizeof(field_t));
+
+    field_t * out = regs + program->consts + program->nvars;
+    const Instr * code = program->code;
+    size_t size = program->size;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        field_t left = regs[code[i].left];
+        field_t right = regs[code[i].right];
+
+        switch (code[i].op)
+        {
+            case VM_ADD:    out[i] = left + right;  break;
+            case VM_SUB:    out[i] = left - right;  break;
+            case VM_MUL:    out[i] = left * right;  break;
+            case VM_DIV:    out[i] = left / right;  break;
+            default:        out[i] = _vm_op(code[i].op, left, right); break;
+        }
+    }
+
+    return regs[program->result];
+}
+
+// Forward mode: one sweep over the program gives f and its derivative by
+// the variable slot (a slot of -1 gives 0), nothing is allocated.
+Dual ProgramEvalDual(Program * program, const field_t * vars, int slot)
+{
+    if (!program || (program->nvars && !vars)) return (Dual) {NAN, NAN};
+
+    Dual * duals = program->duals;
+    Dual * in = duals + program->consts;
+    for (size_t i = 0; i < program->nvars; i++)
+        in[i] = (Dual) {vars[i], (int) i == slot ? 1.0 : 0.0};
+
+    Dual * out = in + program->nvars;
+    const Instr * code = program->code;
+    size_t size = program->size;
+
+    for (size_t i = 0; i < size; i++)
+        out[i] = _dual_op(code[i].op, duals[code[i].left], duals[code[i].right]);
+
+    return duals[program->result];
+}
+
+// ProgramEvalDual at count points, slot takes the values of xs and the other
+// variables keep the values in vars (NULL if there are none). Either of
+// values and diffs may be NULL.
+int ProgramEvalDualBatch(Program * program, const field_t * vars, int slot, const field_t * xs,
+                         field_t * values, field_t * diffs, size_t count)
+{
+    if (!program) return INVALID_ARGUMENT;
+    if (slot < 0 || slot >= (int) program->nvars || !xs) return INVALID_ARGUMENT;
+    if (program->nvars > 1 && !vars) return INVALID_ARGUMENT;
+
+    Dual * duals = program->duals;
+    Dual * in = duals + program->consts;
+    for (size_t i = 0; i < program->nvars; i++)
+        in[i] = (Dual) {vars ? vars[i] : 0, (int) i == slot ? 1.0 : 0.0};
+
+    Dual * out = in + program->nvars;
+    const Instr * code = program->code;
+    size_t size = program->size;
+
+    for (size_t point = 0; point < count; point++)
+    {
+        in[slot].value = xs[point];
+
+        for (size_t i = 0; i < size; i++)
+            out[i] = _dual_op(code[i].op, duals[code[i].left], duals[code[i].right]);
+
+        if (values) values[point] = duals[program->result].value;
+        if (diffs) diffs[point] = duals[program->result].diff;
+    }
+
+    return SUCCESS;
+}
+
+// Reverse mode: the program is the tape. ProgramEval leaves every register
+// filled, then one backward sweep pushes the adjoint of each instruction to
+// its operands and grad gets df/dvar for every variable slot.
+field_t ProgramGradient(Program * program, const field_t * vars, field_t * grad)
+{
+    if (!program || !grad || (program->nvars && !vars)) return NAN;
+
+    field_t result = ProgramEval(program, vars);
+
+    const field_t * regs = program->regs;
+    field_t * adjoints = program->adjoints;
+    size_t base = program->consts + program->nvars;
+    const Instr * code = program->code;
+
+    memset(adjoints, 0, (base + program->size) * sizeof(field_t));
+    adjoints[program->result] = 1;
+
+    for (size_t i = program->size; i-- > 0; )
+    {
+        field_t adjoint = adjoints[base + i];
+        if (_vm_equal(adjoint, 0)) continue;
+
+        Dual left = {regs[code[i].left], 1};
+        Dual right = {regs[code[i].right], 0};
+        adjoints[code[i].left] += adjoint * _dual_op(code[i].op, left, right).diff;
+
+        // functions repeat their argument as the right operand
+        if (code[i].op >= VM_SIN) continue;
+
+        left.diff = 0;
+        right.diff = 1;
+        adjoints[code[i].right] += adjoint * _dual_op(code[i].op, left, right).diff;
+    }
+
+    if (program->nvars) memcpy(grad, adjoints + program->consts, program->nvars * sizeof(field_t));
+    return result;
+}
+
+static void _jet_mul(field_t * dst, const field_t * a, const field_t * b, size_t n)
+{
+    for (size_t k = 0; k < n; k++)
+    {
+        field_t sum = 0;
+        for (size_t j = 0; j <= k; j++) sum += a[j] * b[k - j];
+        dst[k] = sum;
+    }
+}
+
+static void _jet_div(field_t * dst, const field_t * a, const field_t * b, size_t n)
+{
+    for (size_t k = 0; k < n; k++)
+    {
+        field_t sum = a[k];
+        for (size_t j = 0; j < k; j++) sum -= dst[j] * b[k - j];
+        dst[k] = sum / b[0];
+    }
+}
+
+static void _jet_exp(field_t * dst, const field_t * a, size_t n)
+{
+    dst[0] = exp(a[0]);
+    for (size_t k = 1; k < n; k++)
+    {
+        field_t sum = 0;
+        for (size_t j = 1; j <= k; j++) sum += (field_t) j * a[j] * dst[k - j];
+        dst[k] = sum / (field_t) k;
+    }
+}
+
+static void _jet_log(field_t * dst, const field_t * a, size_t n)
+{
+    dst[0] = log(a[0]);
+    for (size_t k = 1; k < n; k++)
+    {
+        field_t sum = 0;
+        for (size_t j = 1; j < k; j++) sum += (field_t) j * dst[j] * a[k - j];
+        dst[k] = (a[k] - sum / (field_t) k) / a[0];
+    }
+}
+
+static void _jet_sqrt(field_t * dst, const field_t * a, size_t n)
+{
+    dst[0] = sqrt(a[0]);
+    for (size_t k = 1; k < n; k++)
+    {
+        field_t sum = 0;
+        for (size_t j = 1; j < k; j++) sum += dst[j] * dst[k - j];
+        dst[k] = (a[k] - sum) / (2 * dst[0]);
+    }
+}
+
+// sin and cos (or sh and ch) come out together, each is the other's derivative
+static void _jet_sincos(field_t * s, field_t * c, const field_t * a, size_t n, int hyperbolic)
+{
+    s[0] = hyperbolic ? sinh(a[0]) : sin(a[0]);
+    c[0] = hyperbolic ? cosh(a[0]) : cos(a[0]);
+    field_t sign = hyperbolic ? 1 : -1;
+
+    for (size_t k = 1; k < n; k++)
+    {
+        field_t ds = 0;
+        field_t dc = 0;
+        for (size_t j = 1; j <= k; j++)
+        {
+            ds += (field_t) j * a[j] * c[k - j];
+            dc += (field_t) j * a[j] * s[k - j];
+        }
+        s[k] = ds / (field_t) k;
+        c[k] = sign * dc / (field_t) k;
+    }
+}
+
+// dst with dst' * q = a' and dst[0] = value, for the inverse functions
+static void _jet_solve(field_t * dst, const field_t * a, const field_t * q, field_t value, size_t n)
+{
+    dst[0] = value;
+    for (size_t k = 1; k < n; k++)
+    {
+        field_t sum = (field_t) k * a[k];
+        for (size_t j = 1; j < k; j++) sum -= (field_t) j * dst[j] * q[k - j];
+        dst[k] = sum / ((field_t) k * q[0]);
+    }
+}
+
+// A constant exponent takes the power rule like DiffPOW, so negative bases
+// and x^n at 0 work, any other exponent goes through exp(b * ln(a)).
+static void _jet_pow(field_t * dst, const field_t * a, const field_t * b, size_t n, field_t * scratch)
+{
+    int constant = 1;
+    for (size_t k = 1; k < n; k++)
+        if (!_vm_equal(b[k], 0)) constant = 0;
+
+    field_t r = b[0];
+
+    if (constant && !_vm_equal(a[0], 0))
+    {
+        dst[0] = pow(a[0], r);
+        for (size_t k = 1; k < n; k++)
+        {
+            field_t sum = 0;
+            for (size_t j = 0; j < k; j++) sum += (r * (field_t) (k - j) - (field_t) j) * a[k - j] * dst[j];
+            dst[k] = sum / ((field_t) k * a[0]);
+        }
+        return;
+    }
+
+    if (constant && r >= 0 && r <= JET_MAX_INT_POW && _vm_equal(r, floor(r)))
+    {
+        memset(dst, 0, n * sizeof(field_t));
+        dst[0] = 1;
+        for (int i = 0; i < (int) r; i++)
+        {
+            _jet_mul(scratch, dst, a, n);
+            memcpy(dst, scratch, n * sizeof(field_t));
+        }
+        return;
+    }
+
+    _jet_log(scratch, a, n);
+    _jet_mul(scratch + n, b, scratch, n);
+    _jet_exp(dst, scratch + n, n);
+}
+
+static void _jet_op(unsigned int op, field_t * dst, const field_t * a, const field_t * b, size_t n, field_t * scratch)
+{
+    field_t * s = scratch;
+    field_t * c = scratch + n;
+
+    switch (op)
+    {
+        case VM_ADD:    for (size_t k = 0; k < n; k++) dst[k] = a[k] + b[k];
+                        break;
+        case VM_SUB:    for (size_t k = 0; k < n; k++) dst[k] = a[k] - b[k];
+                        break;
+        case VM_MUL:    _jet_mul(dst, a, b, n);                 break;
+        case VM_DIV:    _jet_div(dst, a, b, n);                 break;
+        case VM_POW:    _jet_pow(dst, a, b, n, scratch);        break;
+        case VM_SIN:    _jet_sincos(dst, c, a, n, 0);           break;
+        case VM_COS:    _jet_sincos(s, dst, a, n, 0);           break;
+        case VM_TG:     _jet_sincos(s, c, a, n, 0);
+                        _jet_div(dst, s, c, n);                 break;
+        case VM_CTG:    _jet_sincos(s, c, a, n, 0);
+                        _jet_div(dst, c, s, n);                 break;
+        case VM_SH:     _jet_sincos(dst, c, a, n, 1);           break;
+        case VM_CH:     _jet_sincos(s, dst, a, n, 1);           break;
+        case VM_TH:     _jet_sincos(s, c, a, n, 1);
+                        _jet_div(dst, s, c, n);                 break;
+        case VM_CTH:    _jet_sincos(s, c, a, n, 1);
+                        _jet_div(dst, c, s, n);                 break;
+        case VM_LN:     _jet_log(dst, a, n);                    break;
+        case VM_LOG:    _jet_log(dst, a, n);
+                        for (size_t k = 0; k < n; k++) dst[k] /= M_LN10;
+                        break;
+        case VM_EX:     _jet_exp(dst, a, n);                    break;
+
+        // arcsin' = 1 / sqrt(1 - u^2), arctg' = 1 / (1 + u^2), the arccos
+        // and arcctg ones only differ in sign
+        case VM_ARCSIN:
+        case VM_ARCCOS:
+            _jet_mul(s, a, a, n);
+            for (size_t k = 0; k < n; k++) s[k] = -s[k];
+            s[0] += 1;
+            _jet_sqrt(c, s, n);
+            _jet_solve(dst, a, c, asin(a[0]), n);
+            break;
+
+        case VM_ARCTG:
+        case VM_ARCCTG:
+            _jet_mul(s, a, a, n);
+            s[0] += 1;
+            _jet_solve(dst, a, s, atan(a[0]), n);
+            break;
+
+        default:        for (size_t k = 0; k < n; k++) dst[k] = NAN;
+                        break;
+    }
+
+    if (op == VM_ARCCOS || op == VM_ARCCTG)
+    {
+        dst[0] = M_PI_2 - dst[0];
+        for (size_t k = 1; k < n; k++) dst[k] = -dst[k];
+    }
+}
+
+// Taylor coefficients of f around the point vars in the variable slot:
+// coeffs[k] = f^(k) / k! for k = 0..order, in O(order^2) per instruction.
+int ProgramTaylor(Program * program, const field_t * vars, int slot, size_t order, field_t * coeffs)
+{
+    if (!program || !coeffs) return INVALID_ARGUMENT;
+    if (slot >= (int) program->nvars || (program->nvars && !vars)) return INVALID_ARGUMENT;
+
+    size_t n = order + 1;
+    size_t base = program->consts + program->nvars;
+    field_t * jets = (field_t*) calloc((base + program->size + JET_SCRATCH) * n, sizeof(field_t));
+    if (!jets) return ALLOCATE_MEMORY_ERROR;
+
+    for (size_t reg = 0; reg < program->consts; reg++) jets[reg * n] = program->regs[reg];
+    for (size_t i = 0; i < program->nvars; i++) jets[(program->consts + i) * n] = vars[i];
+    if (slot >= 0 && n > 1) jets[(program->consts + (size_t) slot) * n + 1] = 1;
+
+    field_t * scratch = jets + (base + program->size) * n;
+    const Instr * code = program->code;
+
+    for (size_t i = 0; i < program->size; i++)
+        _jet_op(code[i].op, jets + (base + i) * n, jets + code[i].left * n, jets + code[i].right * n, n, scratch);
+
+    memcpy(coeffs, jets + program->result * n, n * sizeof(field_t));
+    free(jets);
+    return SUCCESS;
+}
+
+// The kernels return how many lanes they have done, the rest of the block
+// and every function call go through _scalar_lanes.
+static size_t _arith_scalar(unsigned int, field_t *, const field_t *, const field_t *, size_t)
+{
+    return 0;
+}
+
+#define SIMD_LOOP(STEP, TYPE, LOAD, STORE, INTRIN)                              \
+    for (; i + STEP <= lanes; i += STEP)                                        \
+    {                                                                           \
+        TYPE l = LOAD(left + i);                                                \
+        TYPE r = LOAD(right + i);                                               \
+        STORE(dst + i, INTRIN(l, r));                                           \
+    }
+
+__attribute__((target("avx2")))
+static size_t _arith_avx2(unsigned int op, field_t * dst, const field_t * left, const field_t * right, size_t lanes)
+{
+    size_t i = 0;
+    switch (op)
+    {
+        case VM_ADD:    SIMD_LOOP(4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd); break;
+        case VM_SUB:    SIMD_LOOP(4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd); break;
+        case VM_MUL:    SIMD_LOOP(4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd); break;
+        case VM_DIV:    SIMD_LOOP(4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd); break;
+        default:        break;
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static size_t _arith_avx512(unsigned int op, field_t * dst, const field_t * left, const field_t * right, size_t lanes)
+{
+    size_t i = 0;
+    switch (op)
+    {
+        case VM_ADD:    SIMD_LOOP(8, __m512d, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd); break;
+        case VM_SUB:    SIMD_LOOP(8, __m512d, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_sub_pd); break;
+        case VM_MUL:    SIMD_LOOP(8, __m512d, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_mul_pd); break;
+        case VM_DIV:    SIMD_LOOP(8, __m512d, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_div_pd); break;
+        default:        break;
+    }
+    return i;
+}
+
+static ArithKernel _arith_select(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))      return _arith_avx512;
+    if (__builtin_cpu_supports("avx2"))         return _arith_avx2;
+    return _arith_scalar;
+}
+
+// picked once, a local static is initialized safely from any thread
+static ArithKernel _arith_kernel(void)
+{
+    static const ArithKernel kernel = _arith_select();
+    return kernel;
+}
+
+#define LANE_LOOP(EXPR)                                                         \
+    for (size_t i = from; i < count; i++) dst[i] = (EXPR);                      \
+    break;
+
+static void _scalar_lanes(unsigned int op, field_t * dst, const field_t * left, const field_t * right, size_t from, size_t count)
+{
+    switch (op)
+    {
+        case VM_ADD:    LANE_LOOP(left[i] + right[i]);
+        case VM_SUB:    LANE_LOOP(left[i] - right[i]);
+        case VM_MUL:    LANE_LOOP(left[i] * right[i]);
+        case VM_DIV:    LANE_LOOP(left[i] / right[i]);
+        case VM_POW:    LANE_LOOP(pow(left[i], right[i]));
+        case VM_SIN:    LANE_LOOP(sin(left[i]));
+        case VM_COS:    LANE_LOOP(cos(left[i]));
+        case VM_LN:     LANE_LOOP(log(left[i]));
+        case VM_EX:     LANE_LOOP(exp(left[i]));
+        default:        LANE_LOOP(_vm_op(op, left[i], right[i]));
+    }
+}
+
+// lanes holds width values per register, the first count of them are live
+static void _eval_block(const Program * program, field_t * lanes, size_t width, size_t count, ArithKernel arith)
+{
+    field_t * out = lanes + (program->consts + program->nvars) * width;
+    const Instr * code = program->code;
+
+    for (size_t i = 0; i < program->size; i++)
+    {
+        field_t * dst = out + i * width;
+        const field_t * left = lanes + code[i].left * width;
+        const field_t * right = lanes + code[i].right * width;
+
+        size_t lane = arith(code[i].op, dst, left, right, count);
+        if (lane < count) _scalar_lanes(code[i].op, dst, left, right, lane, count);
+    }
+}
+
+// Evaluates the program at count points: variable slot takes the values of
+// xs, the other slots keep the values in vars (which may be NULL if there are
+// no other variables). Uses AVX-512 or AVX2 when the CPU has them.
+int ProgramEvalBatch(Program * program, const field_t * vars, int slot, const field_t * xs, field_t * results, size_t count)
+{
+    if (!program || !results) return INVALID_ARGUMENT;
+    if (slot >= (int) program->nvars || (slot >= 0 && !xs)) return INVALID_ARGUMENT;
+
+    size_t nregs = program->consts + program->nvars + program->size;
+    size_t width = BATCH_LANES;
+    while (width > 8 && nregs * width * sizeof(field_t) > BATCH_MEMORY) width /= 2;
+
+    field_t * lanes = (field_t*) aligned_alloc(64, nregs * width * sizeof(field_t));
+    if (!lanes) return ALLOCATE_MEMORY_ERROR;
+
+    // constants and the fixed variables are broadcast once for all blocks
+    for (size_t reg = 0; reg < program->consts + program->nvars; reg++)
+    {
+        field_t value = reg < program->consts ? program->regs[reg] : (vars ? vars[reg - program->consts] : 0);
+        for (size_t lane = 0; lane < width; lane++) lanes[reg * width + lane] = value;
+    }
+
+    ArithKernel arith = _arith_kernel();
+    field_t * var = slot >= 0 ? lanes + (program->consts + (size_t) slot) * width : NULL;
+    const field_t * result = lanes + program->result * width;
+
+    for (size_t done = 0; done < count; done += width)
+    {
+        size_t block = count - done < width ? count - done : width;
+        if (var) memcpy(var, xs + done, block * sizeof(field_t));
+
+        _eval_block(program, lanes, width, block, arith);
+        memcpy(results + done, result, block * sizeof(field_t));
+    }
+
+    free(lanes);
+    return SUCCESS;
+}
+
+void DestroyProgram(Program * program)
+{
+    if (!program) return;
+
+    free(program->code);
+    free(program->regs);
+    free(program->duals);
+    free(program->adjoints);
+    free(program->vars);
+    free(program);
+}
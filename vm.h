@@ -0,0 +1,37 @@
+#ifndef VM_H
+#define VM_H
+
+#include "diff.h"
+
+typedef struct _program Program;
+
+// value and derivative of the forward mode evaluator
+typedef struct _dual
+{
+    field_t value;
+    field_t diff;
+
+} Dual;
+
+Program * CompileTree(Tree * tree);
+
+size_t ProgramVars(const Program * program);
+
+int ProgramVar(const Program * program, int name);
+
+field_t ProgramEval(Program * program, const field_t * vars);
+
+int ProgramEvalBatch(Program * program, const field_t * vars, int slot, const field_t * xs, field_t * results, size_t count);
+
+Dual ProgramEvalDual(Program * program, const field_t * vars, int slot);
+
+int ProgramEvalDualBatch(Program * program, const field_t * vars, int slot, const field_t * xs,
+                         field_t * values, field_t * diffs, size_t count);
+
+field_t ProgramGradient(Program * program, const field_t * vars, field_t * grad);
+
+int ProgramTaylor(Program * program, const field_t * vars, int slot, size_t order, field_t * coeffs);
+
+void DestroyProgram(Program * program);
+
+#endif